@@ -35,7 +35,25 @@
 #include <chrono>
 #include <functional>
 #include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include "CheckBitrateVersion.h"
+#include "CheckBitrateLog.h"
+#include "CheckBitrateInput.h"
+#include "CheckBitrateStream.h"
+#include "CheckBitrateTS.h"
+#include "CheckBitrateMP4.h"
+#include "CheckBitrateMKV.h"
+#include "CheckBitrateWriter.h"
+#include "CheckBitrateVBV.h"
+#include "CheckBitrateSummary.h"
+#include "CheckBitrateFrameType.h"
+#include "CheckBitrateBinary.h"
+#include "CheckBitrateFrameCache.h"
+#include "CheckBitrateRing.h"
+#include "CheckBitrateScheduler.h"
 #include "rgy_util.h"
 #include "rgy_filesystem.h"
 #pragma warning (push)
@@ -71,22 +89,69 @@ struct RGYAVDeleter {
     std::function<void(T**)> deleter;
 };
 
-struct FrameData {
-    int64_t pts;
-    int64_t dts;
-    int size;
-    uint32_t flags;
+enum CheckBitrateDemuxer {
+    CB_DEMUXER_AVFORMAT, // libavformatで読み込む
+    CB_DEMUXER_NATIVE,   // 対応している形式は独自に読み込む
+};
+
+static const struct {
+    CheckBitrateDemuxer demuxer;
+    const TCHAR *name;
+} CB_DEMUXER_NAMES[] = {
+    { CB_DEMUXER_AVFORMAT, _T("avformat") },
+    { CB_DEMUXER_NATIVE,   _T("native") },
+};
 
-    FrameData() : pts(0), dts(0), size(0), flags(0) {};
-    FrameData(int64_t pts_, int64_t dts_, int size_, uint32_t flags_) : pts(pts_), dts(dts_), size(size_), flags(flags_) {};
+static const struct {
+    AVMediaType mediaType;
+    const TCHAR *name;
+} CB_MEDIA_TYPE_NAMES[] = {
+    { AVMEDIA_TYPE_VIDEO,    _T("video") },
+    { AVMEDIA_TYPE_AUDIO,    _T("audio") },
+    { AVMEDIA_TYPE_SUBTITLE, _T("subtitle") },
+    { AVMEDIA_TYPE_DATA,     _T("data") },
 };
 
-struct StreamHandler {
-    int streamId;
-    AVRational streamTimebase;
-    std::vector<FrameData> frameDataList;
+static const TCHAR *get_media_type_name(AVMediaType mediaType) {
+    for (const auto& m : CB_MEDIA_TYPE_NAMES) {
+        if (m.mediaType == mediaType) return m.name;
+    }
+    return _T("unknown");
+}
+
+static const double FOLLOW_DEFAULT_TIMEOUT = 30.0;
 
-    StreamHandler(int stream_id, AVRational stream_timebase) : streamId(stream_id), streamTimebase(stream_timebase), frameDataList() {};
+struct CheckBitrateParam {
+    std::vector<double> intervals; // 空の場合は自動
+    int jobs;        // 同時に処理するファイル数 (0の場合は自動)
+    CheckBitrateInputMode inputMode;
+    CheckBitrateDemuxer demuxer;
+    int chunkThreads; // 1つのTSファイルを分割して処理するスレッド数 (0の場合は自動)
+    bool fastProbe;   // ヘッダにストリームの情報がある形式ではavformat_find_stream_infoを省略する
+    int64_t probesize;      // 0の場合はlibavformatのデフォルト
+    double analyzeDuration; // 負の場合はlibavformatのデフォルト
+    bool quiet;       // av_dump_formatを省略する
+    bool follow;      // 書き込み中のファイルを、ファイルが大きくならなくなるまで読み込む
+    double followTimeout; // followを終了するまでの時間(秒)
+    std::vector<double> peakWindows; // 最大ビットレートを求めるウィンドウの長さ(秒) (空の場合は求めない)
+    std::vector<VBVParam> vbv; // VBVのシミュレーションを行うmaxrate/bufsizeの組 (空の場合は行わない)
+    double vbvInit;            // VBVのバッファの初期占有率
+    bool summary;              // トラックごとのビットレートの分布を出力する
+    tstring summaryAll;        // すべてのファイルのビットレートの分布を出力するファイル (空の場合は出力しない)
+    bool frameType;            // ピクチャタイプごとのサイズとフレーム数を出力する
+    std::vector<AVMediaType> mediaTypes; // 出力するストリームの種類
+    bool muxOutput;            // すべてのトラックをまとめたcsvを出力する (--streams指定時)
+    bool muxBytes;             // コンテナを含めたファイル上のバイト数を出力する
+    int outputFormat;          // ビットレートの出力形式 (CheckBitrateOutputFormat)
+    bool binaryFrames;         // バイナリ出力にフレームごとの列を含める
+    bool binaryToCsv;          // 入力ファイルをバイナリ出力として、csvに変換する
+    bool frameCache;           // 補正後のフレームをキャッシュし、次回以降は入力ファイルを読み込まない
+    bool demuxThread;          // libavformatでの読み込みを別スレッドで行う
+    int64_t memoryBudget;      // -jで並列に処理するファイルのメモリ使用量の見積もりの上限 (byte, 0の場合は上限なし)
+
+    CheckBitrateParam() : intervals(), jobs(1), inputMode(CB_INPUT_AVIO), demuxer(CB_DEMUXER_AVFORMAT), chunkThreads(1),
+        fastProbe(false), probesize(0), analyzeDuration(-1.0), quiet(false), follow(false), followTimeout(FOLLOW_DEFAULT_TIMEOUT), peakWindows(), vbv(), vbvInit(VBV_DEFAULT_INIT), summary(false), summaryAll(), frameType(false), mediaTypes({ AVMEDIA_TYPE_VIDEO }), muxOutput(false), muxBytes(false),
+        outputFormat(CB_OUTPUT_CSV), binaryFrames(false), binaryToCsv(false), frameCache(false), demuxThread(false), memoryBudget(0) {};
 };
 
 std::vector<int> getStreamIndex(AVFormatContext *pFormatCtx, AVMediaType type, const std::vector<int> *pVidStreamIndex = nullptr) {
@@ -167,34 +232,92 @@ int selectStream(AVFormatContext *pFormatCtx, std::vector<int>& videoStreams, in
     return nIndex;
 }
 
-int check(AVFormatContext *pFormatCtx, std::vector<std::unique_ptr<StreamHandler>>& streamHandlers, const uint64_t filesize) {
+//パケットを読み込み、対象のストリーム (targetStreams[index]がtrue) のフレームの情報をonFrame(index, frame)に渡す
+//frameTypeParsersがあるストリームは、パケットの先頭からピクチャタイプを判定する
+//各フレームのmuxSizeは、そのパケットの先頭から同じストリームの次のパケットの先頭まで (最後のパケットはファイルの末尾まで) の
+//ファイル上のバイト数とする (コンテナのヘッダ、stuffing、nullパケット、間に多重化された他のストリームを含む)
+//次のパケットの位置がわかるまで、各ストリームの最後のフレームは1つ保持しておく
+template<typename OnFrame>
+static void demux(AVFormatContext *pFormatCtx, const std::vector<bool>& targetStreams,
+    std::vector<std::unique_ptr<CheckBitrateFrameTypeParser>>& frameTypeParsers, const uint64_t filesize, CheckBitrateLog& log, OnFrame onFrame) {
     std::unique_ptr<AVPacket, RGYAVDeleter<AVPacket>> pkt(av_packet_alloc(), RGYAVDeleter<AVPacket>(av_packet_free));
-    auto tmupdate = std::chrono::system_clock::now();
-    double lastprogress = 0.0;
-    int vidpkts = 0;
+    CheckBitrateReadProgress progress(log, filesize);
+    std::vector<FrameData> lastFrame(pFormatCtx->nb_streams);
+    std::vector<int64_t> lastPos(pFormatCtx->nb_streams, -1); // lastFrameがない場合は-1
     while (av_read_frame(pFormatCtx, pkt.get()) >= 0) {
         if (pkt->flags & AV_PKT_FLAG_CORRUPT) {
             av_packet_unref(pkt.get());
             continue;
         }
-        const auto codecpar = pFormatCtx->streams[pkt->stream_index]->codecpar;
-        if (codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-            vidpkts++;
-            if ((vidpkts % 1000) == 0) {
-                auto tmnow = std::chrono::system_clock::now();
-                if (tmnow - tmupdate > std::chrono::milliseconds(500)) {
-                    double progress = pkt->pos * 100.0 / (double)filesize;
-                    if (progress > lastprogress) {
-                        tmupdate = tmnow;
-                        _ftprintf(stderr, _T("reading input file %.2f%%  \r"), pkt->pos * 100.0 / (double)filesize);
-                        lastprogress = progress;
-                    }
+        if (targetStreams[pkt->stream_index]) {
+            progress.update(pkt->pos);
+            const auto& parser = frameTypeParsers[pkt->stream_index];
+            const auto frameType = (parser) ? parser->parse(pkt->data, pkt->size) : CB_FRAME_TYPE_UNKNOWN;
+            const int index = pkt->stream_index;
+            //posが不明な場合や戻った場合は前のフレームを0とし、そのフレームの分も含めて、次に先に進んだ時点で数える
+            if (lastPos[index] >= 0) {
+                const bool forward = pkt->pos > lastPos[index];
+                lastFrame[index].muxSize = (forward) ? pkt->pos - lastPos[index] : 0;
+                onFrame(index, lastFrame[index]);
+                if (forward) {
+                    lastPos[index] = pkt->pos;
                 }
+            } else {
+                lastPos[index] = std::max<int64_t>(pkt->pos, 0);
             }
-            streamHandlers[pkt->stream_index]->frameDataList.emplace_back(FrameData(pkt->pts, pkt->dts, pkt->size, pkt->flags));
+            lastFrame[index] = FrameData(pkt->pts, pkt->dts, pkt->size, pkt->flags, frameType, 0);
         }
         av_packet_unref(pkt.get());
     }
+    //各ストリームの最後のフレームは、ファイルの末尾まで (ファイルサイズが不明な場合はパケットのサイズ) とする
+    for (int index = 0; index < (int)lastPos.size(); index++) {
+        if (lastPos[index] >= 0) {
+            lastFrame[index].muxSize = ((int64_t)filesize > lastPos[index]) ? (int64_t)filesize - lastPos[index] : lastFrame[index].size;
+            onFrame(index, lastFrame[index]);
+        }
+    }
+}
+
+//読み込みスレッドから集計スレッドに渡すフレームの情報
+struct DemuxRecord {
+    int streamIndex;
+    FrameData frame;
+};
+static const size_t DEMUX_RING_SIZE = 16 * 1024;
+
+//フレームはため込まずに、逐次streamWritersに渡す (streamWritersのないストリームは読み捨てる)
+//demuxThreadの場合は、読み込み (av_read_frame, ピクチャタイプの判定) を別スレッドで行い、
+//フレームの情報をリングバッファ経由でこのスレッドに渡して、timestampの補正と集計・出力を行う
+int check(AVFormatContext *pFormatCtx, std::vector<std::unique_ptr<CheckBitrateWriter>>& streamWriters,
+    std::vector<std::unique_ptr<CheckBitrateFrameTypeParser>>& frameTypeParsers, const uint64_t filesize, const bool demuxThread, CheckBitrateLog& log) {
+    std::vector<bool> targetStreams(streamWriters.size());
+    for (size_t i = 0; i < streamWriters.size(); i++) {
+        targetStreams[i] = (bool)streamWriters[i];
+    }
+    if (!demuxThread) {
+        demux(pFormatCtx, targetStreams, frameTypeParsers, filesize, log, [&streamWriters](int index, const FrameData& frame) {
+            streamWriters[index]->push(frame);
+        });
+        return 0;
+    }
+    CheckBitrateSPSCRing<DemuxRecord> ring(DEMUX_RING_SIZE);
+    //libavのログは、このスレッドと同じCheckBitrateLogに振り分ける
+    auto currentLog = CheckBitrateLog::current();
+    std::thread demuxer([&, currentLog]() {
+        CheckBitrateLog::setCurrent(currentLog);
+        demux(pFormatCtx, targetStreams, frameTypeParsers, filesize, log, [&ring](int index, const FrameData& frame) {
+            ring.push({ index, frame });
+        });
+        ring.close();
+    });
+    DemuxRecord record;
+    while (ring.pop(record)) {
+        streamWriters[record.streamIndex]->push(record.frame);
+    }
+    demuxer.join();
+    //読み込みが律速していればemptyが、集計が律速していればfullが多くなる
+    log.write(_T("demux thread: ring full %llu times, empty %llu times.\n"),
+        (unsigned long long)ring.fullWaits(), (unsigned long long)ring.emptyWaits());
     return 0;
 }
 
@@ -206,170 +329,1017 @@ static int64_t get_dts(const FrameData& frame) {
     return frame.dts != AV_NOPTS_VALUE ? frame.dts : frame.pts;
 }
 
-// 基本的にdtsベースで処理する
-static int writeBitrate(const tstring& filename, StreamHandler *streamHandler, const double interval, const AVRational avgFrameRate) {
-    // 有効なtimestampを探す
-    int64_t firstTimestampIdx = -1;
-    auto& frames = streamHandler->frameDataList;
-    for (int64_t i = 0; i < (int64_t)frames.size(); i++) {
-        if (get_dts(frames[i]) != AV_NOPTS_VALUE) {
-            firstTimestampIdx = i;
-            break;
+//"-"の場合は標準入力から読み込む
+static bool isStdinInput(const tstring& filename) {
+    return filename == _T("-");
+}
+
+static tstring getOutputFilename(const tstring& filename, const int streamId) {
+    const tstring base = (isStdinInput(filename)) ? tstring(_T("stdin")) : filename;
+    return base + _T(".track") + std::to_tstring(streamId + 1) + _T(".bitrate.csv");
+}
+
+//すべてのトラックをまとめたcsv
+static tstring getMuxOutputFilename(const tstring& filename) {
+    const tstring base = (isStdinInput(filename)) ? tstring(_T("stdin")) : filename;
+    return base + _T(".mux.bitrate.csv");
+}
+
+//intervalごとの出力ファイル
+//複数のintervalを指定した場合は、<file>.trackN.bitrate.<interval>s.csv に出力する
+static std::vector<CheckBitrateOutput> getOutputs(const tstring& filename, const int streamId, const std::vector<double>& intervals) {
+    std::vector<CheckBitrateOutput> outputs;
+    const auto outputFilename = getOutputFilename(filename, streamId);
+    for (const auto interval : intervals) {
+        CheckBitrateOutput output;
+        output.filename = (intervals.size() == 1) ? outputFilename
+            : outputFilename.substr(0, outputFilename.length() - _tcslen(_T("csv"))) + strsprintf(_T("%gs.csv"), interval);
+        output.interval = interval;
+        outputs.push_back(output);
+    }
+    return outputs;
+}
+
+static tstring getIntervalString(const std::vector<double>& intervals) {
+    tstring str;
+    for (const auto interval : intervals) {
+        if (str.length() > 0) str += _T(", ");
+        str += strsprintf(_T("%.2f"), interval);
+    }
+    return str;
+}
+
+//標準入力やfollowで読み込む場合、-iの指定がなければ使用するinterval
+//長さがわからないので、長さから自動で決めることはできない
+static const double STREAM_DEFAULT_INTERVAL = 1.0;
+
+//読み込みながらcsvを出力するかどうか
+static bool isStreamingInput(const tstring& filename, const CheckBitrateParam& prm) {
+    return isStdinInput(filename) || prm.follow;
+}
+
+//-iの指定がない場合のinterval
+static double getAutoInterval(const double durationSec) {
+    return clamp(durationSec / 100, 0.5, 4.0);
+}
+
+//csv以外に求めるものを設定する (映像のみ)
+static void setupWriter(CheckBitrateWriter& writer, const AVMediaType mediaType, const CheckBitrateParam& prm) {
+    if (mediaType == AVMEDIA_TYPE_VIDEO) {
+        writer.setPeakWindows(prm.peakWindows);
+        writer.setRecordFrames(prm.vbv.size() > 0);
+    }
+}
+
+//最後の区間を出力し、最大ビットレートとVBVの結果、ビットレートの分布を出力する
+//映像のビットレートの分布はfileSummaryにmergeする
+static int finishWriter(CheckBitrateWriter& writer, const tstring& filename, const int streamId, const AVMediaType mediaType, const CheckBitrateParam& prm, BitrateSummary& fileSummary, CheckBitrateLog& log) {
+    int ret = writer.finish();
+    for (const auto& peak : writer.peakResults()) {
+        log.write(_T("peak bitrate of %s track #%d: %.2f kbps (%g sec window, %.3f - %.3f sec)\n"),
+            get_media_type_name(mediaType), streamId + 1, peak.kbps, peak.window, peak.start, peak.start + peak.window);
+    }
+    if (prm.vbv.size() > 0 && mediaType == AVMEDIA_TYPE_VIDEO) {
+        //<file>.trackN.bitrate.csv -> <file>.trackN.
+        const auto outputFilename = getOutputFilename(filename, streamId);
+        const auto outputBase = outputFilename.substr(0, outputFilename.length() - _tcslen(_T("bitrate.csv")));
+        log.write(_T("simulating vbv of video track #%d...\n"), streamId + 1);
+        ret |= runVBV(writer.frames(), prm.vbv, prm.vbvInit, outputBase, log);
+    }
+    if (prm.summary) {
+        //<file>.trackN.bitrate.csv -> <file>.trackN.summary.csv
+        const auto outputFilename = getOutputFilename(filename, streamId);
+        ret |= writeSummary(outputFilename.substr(0, outputFilename.length() - _tcslen(_T("bitrate.csv"))) + _T("summary.csv"), writer.summary(), log);
+    }
+    if (mediaType == AVMEDIA_TYPE_VIDEO) {
+        fileSummary.merge(writer.summary());
+    }
+    return ret;
+}
+
+static void setFrameCacheTrackInfo(FrameCacheTrack& track, const int streamId, const AVMediaType mediaType, const AVRational timebase, const AVRational avgFrameRate, const char *codecName) {
+    track.streamId = streamId;
+    track.mediaType = mediaType;
+    track.timebaseNum = timebase.num;
+    track.timebaseDen = timebase.den;
+    track.frameRateNum = avgFrameRate.num;
+    track.frameRateDen = avgFrameRate.den;
+    track.codecName = codecName;
+}
+
+//streamHandlerのフレームのtimestampを補正し、区間ごとのビットレートを出力する (最後の区間はoutputBitrate()で出力する)
+//prevTrackがnullptrでなければ、前回までのフレームとして先に出力し、streamHandlerのフレームをその続きとして補正する
+//出力先を開けなかった場合はnullptrを返す
+static std::unique_ptr<CheckBitrateWriter> repairBitrate(const std::vector<CheckBitrateOutput>& outputs, const StreamHandler *streamHandler, const AVRational avgFrameRate, const CheckBitrateParam& prm,
+    const FrameCacheTrack *prevTrack, FrameCacheTrack *cacheTrack, CheckBitrateLog& log) {
+    auto writer = std::make_unique<CheckBitrateWriter>();
+    writer->setOutputFormat(prm.outputFormat, prm.binaryFrames, { streamHandler->streamId, AVMEDIA_TYPE_VIDEO, "" });
+    if (writer->open(outputs, streamHandler->streamTimebase, avgFrameRate, CheckBitrateWriter::UNLIMITED_LOOKAHEAD, false, log)) {
+        return nullptr;
+    }
+    setupWriter(*writer, AVMEDIA_TYPE_VIDEO, prm);
+    if (cacheTrack) {
+        setFrameCacheTrackInfo(*cacheTrack, streamHandler->streamId, AVMEDIA_TYPE_VIDEO, streamHandler->streamTimebase, avgFrameRate, "");
+        writer->setFrameCacheTrack(cacheTrack);
+    }
+    if (prevTrack) {
+        //末尾のresumeDropFrames個は、streamHandlerに読み直したフレームが含まれる
+        const size_t keepFrames = prevTrack->dts.size() - (size_t)prevTrack->resumeDropFrames;
+        for (size_t i = 0; i < keepFrames; i++) {
+            writer->pushRepaired(prevTrack->dts[i], prevTrack->size[i], (CheckBitrateFrameType)prevTrack->frameType[i], prevTrack->muxSize[i]);
         }
+        writer->resumeRepair(prevTrack->repair);
     }
-    if (firstTimestampIdx >= 0) { // 有効なtimestampがある場合
-        // PCR Wrapを考慮 (AV_NOPTS_VALUEでない値を対象にする)
-        // 単調増加に補正する
-        const int64_t PCR_WRAP_CHECK_VAL = (1LL << 32) - 1;
-        const int64_t PCR_WRAP_VAL = (1LL << 33);
-        int64_t ptsOffset = 0;
-        int64_t prevts = get_dts(frames[firstTimestampIdx]);
-        for (int64_t i = firstTimestampIdx; i < (int64_t)frames.size(); i++) {
-            auto timestamp = get_dts(frames[i]);
-            if (timestamp != AV_NOPTS_VALUE) {
-                if (timestamp + ptsOffset < prevts) {
-                    if ((prevts - (timestamp + ptsOffset)) >= PCR_WRAP_CHECK_VAL) {
-                        ptsOffset += PCR_WRAP_VAL;
-                    } else if (frames[i].flags & AV_PKT_FLAG_CORRUPT) {
-                        timestamp = AV_NOPTS_VALUE;
-                    }
-                }
-                frames[i].dts = prevts = ((timestamp == AV_NOPTS_VALUE) ? AV_NOPTS_VALUE : timestamp + ptsOffset);
-            }
+    for (const auto& frame : streamHandler->frameDataList) {
+        writer->push(frame);
+    }
+    return writer;
+}
+
+//repairBitrate()の後に、最後の区間と最大ビットレート・VBV・ビットレートの分布を出力する
+static int outputBitrate(CheckBitrateWriter& writer, const tstring& filename, const int streamId, const CheckBitrateParam& prm, BitrateSummary& fileSummary, FrameCacheTrack *cacheTrack, CheckBitrateLog& log) {
+    const int ret = finishWriter(writer, filename, streamId, AVMEDIA_TYPE_VIDEO, prm, fileSummary, log);
+    if (cacheTrack) {
+        cacheTrack->repair = writer.repairState();
+    }
+    return ret;
+}
+
+static int writeBitrate(const tstring& filename, const std::vector<CheckBitrateOutput>& outputs, const StreamHandler *streamHandler, const AVRational avgFrameRate, const CheckBitrateParam& prm, BitrateSummary& fileSummary,
+    const FrameCacheTrack *prevTrack, FrameCacheTrack *cacheTrack, CheckBitrateLog& log) {
+    auto writer = repairBitrate(outputs, streamHandler, avgFrameRate, prm, prevTrack, cacheTrack, log);
+    if (!writer) {
+        return 1;
+    }
+    return outputBitrate(*writer, filename, streamHandler->streamId, prm, fileSummary, cacheTrack, log);
+}
+
+static void printReadSpeed(CheckBitrateLog& log, const TCHAR *method, const uint64_t bytesRead, const std::chrono::system_clock::time_point& tmStart) {
+    const double elapsed = std::chrono::duration<double>(std::chrono::system_clock::now() - tmStart).count();
+    log.write(_T("input: %s, read %.1f MB in %.3f sec (%.1f MB/s)\n"),
+        method, bytesRead / (1024.0 * 1024.0), elapsed, (elapsed > 0.0) ? bytesRead / (1024.0 * 1024.0) / elapsed : 0.0);
+}
+
+//--fast-probe時に、指定がなければ使用するprobeの上限
+static const int64_t FAST_PROBE_PROBESIZE = 1024 * 1024;
+static const double FAST_PROBE_ANALYZE_DURATION = 0.5;
+
+//コンテナのヘッダにすべてのストリームの情報が記載されている形式かどうか
+//この場合はavformat_find_stream_infoを省略してもストリームの情報が得られる
+static bool canSkipStreamInfo(const AVFormatContext *pFormatCtx) {
+    static const char *HEADER_LISTED_FORMATS[] = { "mov", "matroska", "flv" };
+    if (pFormatCtx->iformat == nullptr || pFormatCtx->iformat->name == nullptr || pFormatCtx->nb_streams == 0) {
+        return false;
+    }
+    const auto formatNames = split(pFormatCtx->iformat->name, ",");
+    if (std::none_of(std::begin(HEADER_LISTED_FORMATS), std::end(HEADER_LISTED_FORMATS), [&formatNames](const char *name) {
+        return std::find(formatNames.begin(), formatNames.end(), name) != formatNames.end();
+    })) {
+        return false;
+    }
+    //flvなどではヘッダにコーデックの情報がない場合があるので、確認しておく
+    for (unsigned int i = 0; i < pFormatCtx->nb_streams; i++) {
+        const auto codecpar = pFormatCtx->streams[i]->codecpar;
+        if (codecpar->codec_type == AVMEDIA_TYPE_VIDEO && codecpar->codec_id == AV_CODEC_ID_NONE) {
+            return false;
         }
-        // 途中にAV_NOPTS_VALUEがある場合も多い
-        // その場合は、前後のtimestampから大雑把に線形補間する
-        prevts = -1;
-        int64_t prevtsidx = firstTimestampIdx;
-        for (int64_t i = firstTimestampIdx; i < (int64_t)frames.size(); i++) {
-            auto timestamp = get_dts(frames[i]);
-            if (timestamp != AV_NOPTS_VALUE) {
-                // 途中までのフレームについてはtimestampを大雑把に線形補間する
-                for (int64_t j = prevtsidx + 1; j < i; j++) {
-                    frames[j].dts = prevts + av_rescale(timestamp - prevts, j - prevtsidx, i - prevtsidx);
-                }
-                frames[i].dts = timestamp;
-                prevts = timestamp;
-                prevtsidx = i;
+    }
+    return true;
+}
+
+//-jでの並列処理時の、ファイルごとのメモリ使用量の見積もり
+static const int64_t MEMORY_ESTIMATE_BASE = 8 * 1024 * 1024; // 読み込みのバッファなど、フレーム数によらない分
+static const uint64_t MEMORY_ESTIMATE_FRAME_SIZE = 16 * 1024; // 読み込む前にファイルサイズからフレーム数を見積もる際の、1フレームの平均サイズ
+
+//出力時に1フレームあたりに保持するメモリ量 (VBVのシミュレーション用のフレームとキャッシュ)
+static int64_t outputBytesPerFrame(const CheckBitrateParam& prm) {
+    int64_t bytes = 0;
+    if (prm.vbv.size() > 0) {
+        bytes += sizeof(VBVFrame);
+    }
+    if (prm.frameCache) {
+        bytes += sizeof(int64_t) + sizeof(int32_t) + sizeof(uint8_t) + sizeof(int64_t);
+    }
+    return bytes;
+}
+
+//読み込む前の、ファイルサイズからの見積もり
+//独自の読み込みではすべてのフレームの情報をため込むので、その分も見積もる
+static int64_t estimateMemory(const uint64_t filesize, const CheckBitrateParam& prm) {
+    int64_t bytesPerFrame = outputBytesPerFrame(prm);
+    if (prm.demuxer == CB_DEMUXER_NATIVE) {
+        bytesPerFrame += FrameDataList::bytesPerFrame();
+    }
+    return MEMORY_ESTIMATE_BASE + (int64_t)(filesize / MEMORY_ESTIMATE_FRAME_SIZE) * bytesPerFrame;
+}
+
+//-jでの並列処理時に、1つのファイルの処理に渡す情報
+//reservedは、このファイルの処理のためにbudgetに確保しているメモリ量
+struct CheckBitrateJob {
+    CheckBitrateTaskScheduler *scheduler;
+    CheckBitrateMemoryBudget *budget;
+    std::atomic<int64_t> reserved;
+
+    CheckBitrateJob(CheckBitrateTaskScheduler *scheduler_, CheckBitrateMemoryBudget *budget_, int64_t reserved_) :
+        scheduler(scheduler_), budget(budget_), reserved(reserved_) {};
+    //確保している量を、実際の使用量に合わせる
+    void resize(int64_t bytes) {
+        budget->add(bytes - reserved.exchange(bytes));
+    }
+    void release(int64_t bytes) {
+        reserved -= bytes;
+        budget->add(-bytes);
+    }
+};
+
+//ファイル内のトラックごとの処理を、jobがあればタスクとして並列に実行する
+//- 各トラックの処理は段階 (Stage) に分かれ、前の段階が成功すると次の段階をタスクとして追加する
+//- ログとビットレートの分布はトラックごとに集め、wait()でトラック順にまとめる
+//- jobがnullptrの場合は、add()の中で順に実行する
+class StreamTasks {
+public:
+    using Stage = std::function<int(BitrateSummary& summary, CheckBitrateLog& log)>;
+
+    StreamTasks(CheckBitrateJob *job, BitrateSummary& fileSummary, CheckBitrateLog& log) :
+        m_job(job), m_fileSummary(fileSummary), m_log(log), m_ret(0), m_group(), m_streams() {};
+    ~StreamTasks() {
+        if (m_job) {
+            m_job->scheduler->wait(m_group);
+        }
+    }
+    void add(std::vector<Stage> stages) {
+        if (!m_job) {
+            for (auto& stage : stages) {
+                const int ret = stage(m_fileSummary, m_log);
+                m_ret |= ret;
+                if (ret) break;
             }
+            return;
         }
-        // その後の区間にAV_NOPTS_VALUEがあれば、最後の30フレームのtimestampを使って線形外挿する
-        const int64_t iterp_interval = std::min<int64_t>(30, prevtsidx);
-        const int64_t ts_iterp_interval = frames[prevtsidx - iterp_interval].dts;
-        for (int64_t i = prevtsidx+1; i < (int64_t)frames.size(); i++) {
-            frames[i].dts = prevts + av_rescale(prevts - ts_iterp_interval, i - prevtsidx, iterp_interval);
+        m_streams.push_back(std::make_unique<Stream>(std::move(stages)));
+        runStage(m_streams.back().get(), 0);
+    }
+    int wait() {
+        if (m_job) {
+            m_job->scheduler->wait(m_group);
         }
-        //for (int64_t i = 0; i < (int64_t)frames.size(); i++) {
-        //    fprintf(stderr, "%12lld, %d\n", frames[i].dts, frames[i].size);
-        //}
-    } else {
-        // avgFrameRate を仮定して、timestampを計算する
-        for (size_t i = 0; i < frames.size(); i++) {
-            frames[i].dts = (int64_t)av_rescale_q(i, streamHandler->streamTimebase, avgFrameRate);
+        for (auto& stream : m_streams) {
+            m_log.append(stream->log);
+            m_fileSummary.merge(stream->summary);
+            m_ret |= stream->ret;
         }
-        firstTimestampIdx = 0;
+        m_streams.clear();
+        return m_ret;
     }
-    const auto firstts = frames[firstTimestampIdx].dts;
-
-    // 出力
-    double tick = 0.0;
-    uint64_t sizetick = 0;
-    uint64_t sizesum = 0;
-    FILE *fp = NULL;
-    if (_tfopen_s(&fp, filename.c_str(), _T("w"))) {
-        _ftprintf(stderr, _T("failed to open output file \"%s\"\n"), filename.c_str());
-        return 1;
+private:
+    struct Stream {
+        std::vector<Stage> stages;
+        BitrateSummary summary;
+        CheckBitrateLog log;
+        int ret;
+        Stream(std::vector<Stage> stages_) : stages(std::move(stages_)), summary(), log(true), ret(0) {};
+    };
+    void runStage(Stream *stream, size_t index) {
+        m_job->scheduler->submit(m_group, [this, stream, index]() {
+            CheckBitrateLogScope logScope(&stream->log);
+            stream->ret = stream->stages[index](stream->summary, stream->log);
+            if (stream->ret == 0 && index + 1 < stream->stages.size()) {
+                runStage(stream, index + 1);
+            }
+        });
     }
-    _ftprintf(fp, _T(",kbps,kbps(avg)\n"));
-    double framesec = 0.0;
-    for (int64_t i = firstTimestampIdx; i < (int64_t)frames.size(); i++) {
-        const auto& frame = frames[i];
-        const auto timestamp = frames[i].dts;
-        framesec = ts2sec(timestamp - firstts, streamHandler->streamTimebase);
-        if (tick + interval < framesec) {
-            double time = framesec - tick;
-            double kbps = sizetick * 8 / time * 0.001;
-            double avgkbps = sizesum * 8 / framesec * 0.001;
-            _ftprintf(fp, _T("%10.3f,%.2f,%.2f\n"), tick, kbps, avgkbps);
-            tick = framesec;
-            sizetick = 0;
-        }
-        sizetick += frame.size;
-        sizesum += frame.size;
-    }
-    double time = framesec - tick;
-    double kbps = sizetick * 8 / time * 0.001;
-    double avgkbps = sizesum * 8 / framesec * 0.001;
-    _ftprintf(fp, _T("%10.3f,%.2f,%.2f\n"), tick, kbps, avgkbps);
-    return 0;
-}
 
-int run(const tstring& filename, double interval = 0.0) {
-    av_log_set_level(AV_LOG_ERROR);
+    CheckBitrateJob *m_job;
+    BitrateSummary& m_fileSummary;
+    CheckBitrateLog& m_log;
+    int m_ret;
+    CheckBitrateTaskGroup m_group;
+    std::vector<std::unique_ptr<Stream>> m_streams;
+};
 
+//フレームをため込まずに、読み込みながら集計してcsvを出力する
+//標準入力やfollowで読み込む場合は、1行出力するたびにファイルに書き出す
+//cacheがnullptrでなければ、補正後のフレームを記録する
+//jobがnullptrでなければ、読み込み後のトラックごとの出力をタスクとして並列に行う
+static int readAVFormat(const tstring& filename, const CheckBitrateParam& prm, BitrateSummary& fileSummary, FrameCache *cache, CheckBitrateJob *job, CheckBitrateLog& log) {
+    const bool isStdin = isStdinInput(filename);
+    const bool isStreaming = isStreamingInput(filename, prm);
+    //followの場合はファイルが大きくなるのを待つため、独自の読み込みを使う
+    const bool isFollow = prm.follow && !isStdin;
+    auto inputMode = prm.inputMode;
+    if (isFollow && inputMode != CB_INPUT_READAHEAD) {
+        if (inputMode != CB_INPUT_AVIO) {
+            log.write(_T("%s cannot be used with --follow, switching to %s.\n"), get_input_mode_name(inputMode), get_input_mode_name(CB_INPUT_READAHEAD));
+        }
+        inputMode = CB_INPUT_READAHEAD;
+    }
     //UTF-8に変換
     std::string filename_char;
-    if (0 == tchar_to_string(filename.c_str(), filename_char, CP_UTF8)) {
-        _ftprintf(stderr, _T("failed to convert filename to utf-8 characters.\n"));
+    if (isStdin) {
+        filename_char = "pipe:0";
+    } else if (0 == tchar_to_string(filename.c_str(), filename_char, CP_UTF8)) {
+        log.write(_T("failed to convert filename to utf-8 characters.\n"));
         return 1;
     }
 
-    auto pFormatCtx = avformat_alloc_context();
+    const auto tmStart = std::chrono::system_clock::now();
+
+    //独自の読み込みを使う場合は、AVIOContextを差し替える
+    //AVFormatContextより後に破棄されるよう、先に宣言しておく
+    std::unique_ptr<CheckBitrateInputFile> inputFile;
+    AVFormatContext *pFormatCtxOpen = avformat_alloc_context();
+    if (isStdin && inputMode != CB_INPUT_AVIO) {
+        log.write(_T("%s cannot be used for stdin, switching to %s.\n"), get_input_mode_name(inputMode), get_input_mode_name(CB_INPUT_AVIO));
+    } else if (inputMode != CB_INPUT_AVIO) {
+        inputFile = std::make_unique<CheckBitrateInputFile>();
+        if (inputFile->open(filename, inputMode)) {
+            log.write(_T("error opening file: \"%s\"\n"), filename.c_str());
+            avformat_free_context(pFormatCtxOpen);
+            return 1;
+        }
+        if (inputFile->mode() != inputMode) {
+            log.write(_T("failed to use %s for input, switching to %s.\n"), get_input_mode_name(inputMode), get_input_mode_name(inputFile->mode()));
+        }
+        if (isFollow) {
+            inputFile->setFollow(prm.followTimeout);
+        }
+        if ((pFormatCtxOpen->pb = inputFile->createAVIOContext()) == nullptr) {
+            log.write(_T("failed to allocate AVIOContext.\n"));
+            avformat_free_context(pFormatCtxOpen);
+            return 1;
+        }
+        pFormatCtxOpen->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
 
     //ts向けの設定
     AVDictionary *pFormatOption = nullptr;
     //av_dict_set(&pFormatOption, "scan_all_pmts", "1", 0);
 
+    //probeの上限
+    const int64_t probesize = (prm.probesize > 0) ? prm.probesize : ((prm.fastProbe) ? FAST_PROBE_PROBESIZE : 0);
+    const double analyzeDuration = (prm.analyzeDuration >= 0.0) ? prm.analyzeDuration : ((prm.fastProbe) ? FAST_PROBE_ANALYZE_DURATION : -1.0);
+    if (probesize > 0) {
+        av_dict_set(&pFormatOption, "probesize", strsprintf("%lld", (long long)probesize).c_str(), 0);
+    }
+    if (analyzeDuration >= 0.0) {
+        av_dict_set(&pFormatOption, "analyzeduration", strsprintf("%lld", (long long)(analyzeDuration * AV_TIME_BASE + 0.5)).c_str(), 0);
+    }
+
     //ファイルのオープン
-    if (avformat_open_input(&pFormatCtx, filename_char.c_str(), nullptr, nullptr)) {
-        _ftprintf(stderr, _T("error opening file: \"%s\"\n"), char_to_tstring(filename_char, CP_UTF8).c_str());
+    //エラー終了時にも確実に閉じられるよう、unique_ptrで管理する
+    //オプションはavformat_open_inputでのみ使用するので、ここで解放する
+    const int openRet = avformat_open_input(&pFormatCtxOpen, filename_char.c_str(), nullptr, &pFormatOption);
+    av_dict_free(&pFormatOption);
+    if (openRet) {
+        log.write(_T("error opening file: \"%s\"\n"), char_to_tstring(filename_char, CP_UTF8).c_str());
         return 1;
     }
+    std::unique_ptr<AVFormatContext, RGYAVDeleter<AVFormatContext>> formatCtx(pFormatCtxOpen, RGYAVDeleter<AVFormatContext>(avformat_close_input));
+    auto pFormatCtx = formatCtx.get();
 
-    if (avformat_find_stream_info(pFormatCtx, nullptr) < 0) {
-        _ftprintf(stderr, _T("error finding stream information.\n"));
+    const bool skipStreamInfo = prm.fastProbe && canSkipStreamInfo(pFormatCtx);
+    if (!skipStreamInfo && avformat_find_stream_info(pFormatCtx, nullptr) < 0) {
+        log.write(_T("error finding stream information.\n"));
         return 1; // Couldn't find stream information
     }
-    av_dump_format(pFormatCtx, 0, filename_char.c_str(), 0);
+    if (!prm.quiet) {
+        av_dump_format(pFormatCtx, 0, filename_char.c_str(), 0);
+    }
+    //probeにかかった時間 (--fast-probeなしの場合と比較できるよう、常に表示する)
+    const double probeTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - tmStart).count() * 1e-3;
+    log.write(_T("probe: %.1f ms%s.\n"), probeTime,
+        (skipStreamInfo) ? _T(", stream info probing skipped") : ((prm.fastProbe) ? _T(", stream info probing bounded") : _T("")));
 
-    auto videoStreams = getStreamIndex(pFormatCtx, AVMEDIA_TYPE_VIDEO);
-    if (videoStreams.size() == 0) {
-        _ftprintf(stderr, _T("no video stream found.\n"));
+    //出力するストリーム (トラック番号順)
+    std::vector<int> targetStreams;
+    for (const auto mediaType : prm.mediaTypes) {
+        const auto streams = getStreamIndex(pFormatCtx, mediaType);
+        targetStreams.insert(targetStreams.end(), streams.begin(), streams.end());
+    }
+    std::sort(targetStreams.begin(), targetStreams.end());
+    if (targetStreams.size() == 0) {
+        log.write((prm.mediaTypes.size() == 1 && prm.mediaTypes[0] == AVMEDIA_TYPE_VIDEO) ? _T("no video stream found.\n") : _T("no target stream found.\n"));
         return 1; // Couldn't find stream information
     }
     //auto nVideoIndex = selectStream(pFormatCtx, videoStreams, nVideoTrack, nStreamId);
 
-    std::vector<std::unique_ptr<StreamHandler>> streamHandlers(pFormatCtx->nb_streams);
-    for (auto index : videoStreams) {
-        streamHandlers[index] = std::make_unique<StreamHandler>(index, pFormatCtx->streams[index]->time_base);
+    //intervalは読み込み前に決めておく
+    auto intervals = prm.intervals;
+    if (intervals.size() == 0) {
+        intervals.push_back((isStreaming) ? STREAM_DEFAULT_INTERVAL
+            : getAutoInterval((pFormatCtx->duration != AV_NOPTS_VALUE) ? ts2sec(pFormatCtx->duration, av_make_q(1, AV_TIME_BASE)) : 0.0));
+    }
+    if (isFollow) {
+        log.write(_T("analyzing video bitrate while following the input (interval: %s sec, timeout: %.1f sec)...\n"), getIntervalString(intervals).c_str(), prm.followTimeout);
+    } else if (isStdin) {
+        log.write(_T("analyzing video bitrate from stdin (interval: %s sec)...\n"), getIntervalString(intervals).c_str());
+    } else {
+        log.write(_T("analyzing video bitrate (interval: %s sec)...\n"), getIntervalString(intervals).c_str());
+    }
+
+    //timestampの補間のために保持するフレーム数を制限し、長さによらずメモリ使用量を一定にする
+    std::vector<std::unique_ptr<CheckBitrateWriter>> streamWriters(pFormatCtx->nb_streams);
+    std::vector<std::unique_ptr<CheckBitrateFrameTypeParser>> frameTypeParsers(pFormatCtx->nb_streams);
+    std::unique_ptr<CheckBitrateMuxWriter> muxWriter;
+    if (prm.muxOutput) {
+        std::vector<tstring> trackNames;
+        for (auto index : targetStreams) {
+            trackNames.push_back(strsprintf(_T("track%d %s"), index + 1, get_media_type_name(pFormatCtx->streams[index]->codecpar->codec_type)));
+        }
+        //各トラックの時刻はstart_timeを基準にそろえる
+        const double startSec = (pFormatCtx->start_time != AV_NOPTS_VALUE) ? ts2sec(pFormatCtx->start_time, av_make_q(1, AV_TIME_BASE)) : -1.0;
+        muxWriter = std::make_unique<CheckBitrateMuxWriter>();
+        log.write(_T("output bitrate of all tracks...\n"));
+        if (muxWriter->open(getMuxOutputFilename(filename), intervals[0], trackNames, startSec, isStreaming, log)) {
+            return 1;
+        }
+    }
+    if (cache) {
+        cache->durationSec = (pFormatCtx->duration != AV_NOPTS_VALUE) ? ts2sec(pFormatCtx->duration, av_make_q(1, AV_TIME_BASE)) : 0.0;
+        cache->startSec = (pFormatCtx->start_time != AV_NOPTS_VALUE) ? ts2sec(pFormatCtx->start_time, av_make_q(1, AV_TIME_BASE)) : -1.0;
+        cache->tracks.resize(targetStreams.size());
+    }
+    for (int i = 0; i < (int)targetStreams.size(); i++) {
+        const int index = targetStreams[i];
+        const auto stream = pFormatCtx->streams[index];
+        const auto mediaType = stream->codecpar->codec_type;
+        auto writer = std::make_unique<CheckBitrateWriter>();
+        log.write(_T("output bitrate of %s track #%d...\n"), get_media_type_name(mediaType), index + 1);
+        if (prm.frameType && mediaType == AVMEDIA_TYPE_VIDEO) {
+            auto parser = std::make_unique<CheckBitrateFrameTypeParser>();
+            if (parser->init(stream->codecpar->codec_id, stream->codecpar->extradata, stream->codecpar->extradata_size)) {
+                log.write(_T("frame type of %s is not supported, frame type columns will be 0.\n"), char_to_tstring(avcodec_get_name(stream->codecpar->codec_id)).c_str());
+            } else {
+                frameTypeParsers[index] = std::move(parser);
+            }
+            writer->setFrameType(true);
+        }
+        writer->setMuxBytes(prm.muxBytes);
+        writer->setOutputFormat(prm.outputFormat, prm.binaryFrames, { index, mediaType, avcodec_get_name(stream->codecpar->codec_id) });
+        //逐次出力しない場合は、最初の有効なtimestampが見つかるまで保持するフレーム数を制限しない
+        if (writer->open(getOutputs(filename, index, intervals), stream->time_base, stream->avg_frame_rate,
+            (isStreaming) ? CheckBitrateWriter::STREAM_LOOKAHEAD : CheckBitrateWriter::UNLIMITED_LOOKAHEAD, isStreaming, log)) {
+            return 1;
+        }
+        setupWriter(*writer, mediaType, prm);
+        if (muxWriter) {
+            writer->setMuxWriter(muxWriter.get(), i);
+        }
+        if (cache) {
+            setFrameCacheTrackInfo(cache->tracks[i], index, mediaType, stream->time_base, stream->avg_frame_rate, avcodec_get_name(stream->codecpar->codec_id));
+            writer->setFrameCacheTrack(&cache->tracks[i]);
+        }
+        streamWriters[index] = std::move(writer);
     }
 
     uint64_t filesize = 0;
-    rgy_get_filesize(filename.c_str(), &filesize);
+    if (!isStreaming) {
+        rgy_get_filesize(filename.c_str(), &filesize);
+    }
+    check(pFormatCtx, streamWriters, frameTypeParsers, filesize, prm.demuxThread, log);
 
-    check(pFormatCtx, streamHandlers, filesize);
+    //全トラックをまとめたcsvには各トラックから順に出力するので、並列には行わない
+    StreamTasks streamTasks((muxWriter) ? nullptr : job, fileSummary, log);
+    for (int index = 0; index < (int)streamWriters.size(); index++) {
+        if (streamWriters[index]) {
+            const auto mediaType = pFormatCtx->streams[index]->codecpar->codec_type;
+            streamTasks.add({ [&, index, mediaType](BitrateSummary& summary, CheckBitrateLog& streamLog) {
+                const int ret = finishWriter(*streamWriters[index], filename, index, mediaType, prm, summary, streamLog);
+                streamWriters[index].reset();
+                return ret;
+            } });
+        }
+    }
+    int ret = streamTasks.wait();
+    if (muxWriter) {
+        ret |= muxWriter->finish();
+    }
+    printReadSpeed(log, get_input_mode_name((inputFile) ? inputFile->mode() : CB_INPUT_AVIO),
+        (inputFile) ? inputFile->bytesRead() : (uint64_t)pFormatCtx->pb->bytes_read, tmStart);
+    return ret;
+}
 
-    double duration_sec = ts2sec(pFormatCtx->duration, av_make_q(1, AV_TIME_BASE));
-    if (interval <= 0.0) {
-        interval = clamp(duration_sec / 100, 0.5, 4.0);
+//フレームのtimestampから長さを求める
+static double getDurationFromFrames(const StreamHandlerList& streamHandlers, const int64_t wrapValue) {
+    double durationSec = 0.0;
+    for (const auto& st : streamHandlers) {
+        if (!st) continue;
+        const auto& frames = st->frameDataList;
+        auto first = std::find_if(frames.begin(), frames.end(), [](const FrameData& frame) { return get_dts(frame) != AV_NOPTS_VALUE; });
+        if (first == frames.end()) continue;
+        size_t last = frames.size() - 1;
+        while (get_dts(frames[last]) == AV_NOPTS_VALUE) {
+            last--;
+        }
+        int64_t duration = get_dts(frames[last]) - get_dts(*first);
+        if (duration < 0 && wrapValue > 0) {
+            duration += wrapValue;
+        }
+        durationSec = std::max(durationSec, ts2sec(duration, st->streamTimebase));
     }
-    _ftprintf(stderr, _T("analyzing video bitrate (interval: %.2f sec)...\n"), interval);
+    return durationSec;
+}
 
+//libavformatを使わずに読み込む
+//対応していない形式の場合は CB_NATIVE_UNSUPPORTED を返す
+static const int CB_NATIVE_UNSUPPORTED = -1;
+//resumeがnullptrでなければ、MPEG-TSの場合に追記された部分を読み込むための情報を返す
+static int readNative(const tstring& filename, const CheckBitrateParam& prm, StreamHandlerList& streamHandlers, double& durationSec, CheckBitrateTSReader::ResumeInfo *resume, CheckBitrateLog& log) {
+    const auto tmStart = std::chrono::system_clock::now();
+    const auto inputMode = (prm.inputMode == CB_INPUT_AVIO) ? CB_INPUT_READAHEAD : prm.inputMode;
+    CheckBitrateInputFile inputFile;
+    if (inputFile.open(filename, inputMode)) {
+        log.write(_T("error opening file: \"%s\"\n"), filename.c_str());
+        return 1;
+    }
+    std::vector<uint8_t> probeBuf((size_t)std::min<int64_t>(inputFile.size(), 256 * 1024));
+    if (inputFile.read(probeBuf.data(), (int64_t)probeBuf.size()) != (int64_t)probeBuf.size()) {
+        log.write(_T("failed to read input file.\n"));
+        return 1;
+    }
+    inputFile.seek(0, SEEK_SET);
 
+    streamHandlers.clear();
+    uint64_t bytesRead = 0; // inputFile以外から読み込んだバイト数
+    if (CheckBitrateTSReader::probe(probeBuf.data(), probeBuf.size())) {
+        log.write(_T("input: native mpeg-ts reader.\n"));
+        CheckBitrateTSReader reader;
+        const int chunkThreads = (prm.chunkThreads > 0) ? prm.chunkThreads : (int)std::thread::hardware_concurrency();
+        uint64_t otherBytesRead = 0;
+        if (reader.readParallel(&inputFile, filename, chunkThreads, streamHandlers, otherBytesRead, log)) {
+            return 1;
+        }
+        bytesRead += otherBytesRead;
+        durationSec = getDurationFromFrames(streamHandlers, 1LL << 33);
+        if (resume) {
+            *resume = reader.resumeInfo();
+        }
+    } else if (CheckBitrateMP4Reader::probe(probeBuf.data(), probeBuf.size())) {
+        log.write(_T("input: native mp4 reader.\n"));
+        CheckBitrateMP4Reader reader;
+        if (reader.read(&inputFile, streamHandlers, durationSec, log)) {
+            return 1;
+        }
+        if (durationSec <= 0.0) {
+            durationSec = getDurationFromFrames(streamHandlers, 0);
+        }
+    } else if (CheckBitrateMKVReader::probe(probeBuf.data(), probeBuf.size())) {
+        log.write(_T("input: native matroska reader.\n"));
+        CheckBitrateMKVReader reader;
+        if (reader.read(&inputFile, streamHandlers, durationSec, log)) {
+            return 1;
+        }
+        if (durationSec <= 0.0) {
+            durationSec = getDurationFromFrames(streamHandlers, 0);
+        }
+    } else {
+        return CB_NATIVE_UNSUPPORTED;
+    }
+    printReadSpeed(log, get_input_mode_name(inputFile.mode()), bytesRead + inputFile.bytesRead(), tmStart);
+
+    if (std::none_of(streamHandlers.begin(), streamHandlers.end(), [](const std::unique_ptr<StreamHandler>& st) { return st && st->frameDataList.size() > 0; })) {
+        log.write(_T("no video stream found.\n"));
+        return 1;
+    }
+    return 0;
+}
+
+//キャッシュに追記された部分を読み込むための情報を設定する
+//どのトラックについても、読み直すフレームがキャッシュに含まれている必要がある
+static void setFrameCacheResume(FrameCache& cache, const CheckBitrateTSReader::ResumeInfo& resume) {
+    cache.resumeOffset = -1;
+    cache.packetSize = resume.packetSize;
+    if (resume.offset < 0) {
+        return;
+    }
+    for (auto& track : cache.tracks) {
+        auto stream = std::find_if(resume.streams.begin(), resume.streams.end(), [&track](const CheckBitrateTSReader::ResumeStream& st) { return st.streamIndex == track.streamId; });
+        if (stream == resume.streams.end() || stream->dropFrames > track.dts.size()
+            || (!track.repair.timestampFound && !track.repair.useFrameRate)) {
+            return;
+        }
+        track.pid = stream->pid;
+        track.resumeDropFrames = stream->dropFrames;
+    }
+    cache.resumeOffset = resume.offset;
+}
+
+//libavformatで読み込む場合は、読み込みながら出力まで行う
+//独自の読み込みの場合は、フレームの情報をため込んでから出力する
+//cacheがnullptrでなければ、補正後のフレームを記録する
+//jobがnullptrでなければ、トラックごとのtimestampの補正と出力をタスクとして並列に行う
+static int readAndWrite(const tstring& filename, const CheckBitrateParam& prm, BitrateSummary& fileSummary, FrameCache *cache, CheckBitrateJob *job, CheckBitrateLog& log) {
+    //独自の読み込みではパケットの中身を読まないので、ピクチャタイプを判定できない
+    //また、映像以外のストリームは読み込まない
+    if (prm.demuxer == CB_DEMUXER_NATIVE && (prm.frameType || prm.muxOutput || prm.muxBytes)) {
+        log.write(_T("native reader does not support %s, switching to libavformat.\n"),
+            (prm.frameType) ? _T("--frame-type") : ((prm.muxOutput) ? _T("--streams") : _T("--mux-bytes")));
+        return readAVFormat(filename, prm, fileSummary, cache, job, log);
+    }
+    if (prm.demuxer != CB_DEMUXER_NATIVE) {
+        return readAVFormat(filename, prm, fileSummary, cache, job, log);
+    }
+    StreamHandlerList streamHandlers;
+    double duration_sec = 0.0;
+    CheckBitrateTSReader::ResumeInfo resume;
+    int ret = readNative(filename, prm, streamHandlers, duration_sec, (cache) ? &resume : nullptr, log);
+    if (ret == CB_NATIVE_UNSUPPORTED) {
+        log.write(_T("native reader does not support this input, switching to libavformat.\n"));
+        return readAVFormat(filename, prm, fileSummary, cache, job, log);
+    }
+    if (ret) {
+        return ret;
+    }
+
+    //フレーム情報のメモリ使用量 (std::vector<FrameData>で保持した場合との比較)
+    size_t frameCount = 0, frameMemory = 0;
+    for (const auto& st : streamHandlers) {
+        if (!st) continue;
+        frameCount += st->frameDataList.size();
+        frameMemory += st->frameDataList.memoryUsage();
+    }
+    log.write(_T("frame index: %lld frames, %.2f MB (%.2f MB as std::vector<FrameData>).\n"),
+        (long long)frameCount, frameMemory / (1024.0 * 1024.0), frameCount * sizeof(FrameData) / (1024.0 * 1024.0));
+    //ファイルサイズからの見積もりを、実際のフレーム数に合わせる
+    const int64_t outputBytes = outputBytesPerFrame(prm);
+    if (job) {
+        job->resize(MEMORY_ESTIMATE_BASE + (int64_t)frameMemory + (int64_t)frameCount * outputBytes);
+    }
+
+    auto intervals = prm.intervals;
+    if (intervals.size() == 0) {
+        intervals.push_back(getAutoInterval(duration_sec));
+    }
+    log.write(_T("analyzing video bitrate (interval: %s sec)...\n"), getIntervalString(intervals).c_str());
+
+    if (cache) {
+        cache->durationSec = duration_sec;
+        cache->tracks.resize(std::count_if(streamHandlers.begin(), streamHandlers.end(), [](const std::unique_ptr<StreamHandler>& st) { return (bool)st; }));
+    }
+    //トラックごとに、timestampの補正 (区間ごとの出力を含む) と、最後の区間・VBVなどの出力を順に行う
+    //補正の終わったトラックのフレームの情報は、出力を待たずに解放する
+    int cacheTrack = 0;
+    StreamTasks streamTasks(job, fileSummary, log);
     for (auto& st : streamHandlers) {
         if (!st) continue;
-        _ftprintf(stderr, _T("output bitrate of video track #%d...\n"), st->streamId + 1);
-        writeBitrate(filename + _T(".track") + std::to_tstring(st->streamId + 1) + _T(".bitrate.csv"), st.get(), interval, pFormatCtx->streams[st->streamId]->avg_frame_rate);
+        auto streamHandler = st.get();
+        auto track = (cache) ? &cache->tracks[cacheTrack++] : nullptr;
+        auto writer = std::make_shared<std::unique_ptr<CheckBitrateWriter>>();
+        streamTasks.add({
+            [&, streamHandler, track, writer](BitrateSummary&, CheckBitrateLog& streamLog) {
+                streamLog.write(_T("output bitrate of video track #%d...\n"), streamHandler->streamId + 1);
+                *writer = repairBitrate(getOutputs(filename, streamHandler->streamId, intervals), streamHandler, streamHandler->avgFrameRate, prm, nullptr, track, streamLog);
+                const int64_t frames = (int64_t)streamHandler->frameDataList.size();
+                const int64_t memory = (int64_t)streamHandler->frameDataList.memoryUsage();
+                streamHandler->frameDataList.clear();
+                if (job) {
+                    job->release(memory + ((*writer) ? 0 : frames * outputBytes));
+                }
+                return (*writer) ? 0 : 1;
+            },
+            [&, streamHandler, track, writer](BitrateSummary& summary, CheckBitrateLog& streamLog) {
+                const int ret = outputBitrate(**writer, filename, streamHandler->streamId, prm, summary, track, streamLog);
+                if (job && prm.vbv.size() > 0) {
+                    job->release((int64_t)(*writer)->frames().size() * sizeof(VBVFrame));
+                }
+                writer->reset();
+                return ret;
+            }
+        });
+    }
+    ret |= streamTasks.wait();
+    if (cache) {
+        setFrameCacheResume(*cache, resume);
     }
+    return ret;
+}
 
-    if (pFormatOption) {
-        av_dict_free(&pFormatOption);
+//追記されたMPEG-TSの、キャッシュの再開位置以降のみを読み込み、キャッシュしたフレームと合わせて出力する
+//更新したキャッシュをnewCacheに返す
+static int appendAndWrite(const tstring& filename, const FrameCache& cache, const CheckBitrateParam& prm, BitrateSummary& fileSummary, FrameCache& newCache, CheckBitrateLog& log) {
+    const auto tmStart = std::chrono::system_clock::now();
+    const auto inputMode = (prm.inputMode == CB_INPUT_AVIO) ? CB_INPUT_READAHEAD : prm.inputMode;
+    CheckBitrateInputFile inputFile;
+    if (inputFile.open(filename, inputMode)) {
+        log.write(_T("error opening file: \"%s\"\n"), filename.c_str());
+        return 1;
     }
-    if (pFormatCtx) {
-        avformat_close_input(&pFormatCtx);
-        avformat_free_context(pFormatCtx);
+    CheckBitrateTSReader::ResumeInfo resume;
+    resume.offset = cache.resumeOffset;
+    resume.packetSize = cache.packetSize;
+    for (const auto& track : cache.tracks) {
+        resume.streams.push_back({ track.pid, track.streamId, track.resumeDropFrames });
     }
-    return 0;
+    log.write(_T("input: native mpeg-ts reader, resuming at %.1f MB of %.1f MB.\n"),
+        resume.offset / (1024.0 * 1024.0), inputFile.size() / (1024.0 * 1024.0));
+    StreamHandlerList streamHandlers;
+    CheckBitrateTSReader reader;
+    if (reader.readResume(&inputFile, resume, streamHandlers, log)) {
+        return 1;
+    }
+    printReadSpeed(log, get_input_mode_name(inputFile.mode()), inputFile.bytesRead(), tmStart);
+
+    //先頭から読み込んだ場合と同じく、最初と最後の有効なtimestampの差から長さを求める
+    //補正後のキャッシュの最初のフレームは、最初の有効なtimestampのフレーム
+    double duration_sec = cache.durationSec;
+    for (const auto& track : cache.tracks) {
+        const auto& frames = streamHandlers[track.streamId]->frameDataList;
+        if (track.dts.size() == 0 || frames.size() == 0) continue;
+        size_t last = frames.size() - 1;
+        while (last > 0 && get_dts(frames[last]) == AV_NOPTS_VALUE) {
+            last--;
+        }
+        if (get_dts(frames[last]) == AV_NOPTS_VALUE) continue;
+        int64_t duration = get_dts(frames[last]) - track.dts.front();
+        if (duration < 0) {
+            duration += 1LL << 33;
+        }
+        duration_sec = std::max(duration_sec, ts2sec(duration, av_make_q(track.timebaseNum, track.timebaseDen)));
+    }
+
+    auto intervals = prm.intervals;
+    if (intervals.size() == 0) {
+        intervals.push_back(getAutoInterval(duration_sec));
+    }
+    log.write(_T("analyzing video bitrate (interval: %s sec)...\n"), getIntervalString(intervals).c_str());
+
+    newCache.options = cache.options;
+    newCache.durationSec = duration_sec;
+    newCache.startSec = cache.startSec;
+    newCache.tracks.resize(cache.tracks.size());
+    int ret = 0;
+    for (size_t i = 0; i < cache.tracks.size(); i++) {
+        const auto& track = cache.tracks[i];
+        auto st = streamHandlers[track.streamId].get();
+        log.write(_T("output bitrate of video track #%d...\n"), st->streamId + 1);
+        ret |= writeBitrate(filename, getOutputs(filename, st->streamId, intervals), st, av_make_q(track.frameRateNum, track.frameRateDen), prm, fileSummary,
+            &track, &newCache.tracks[i], log);
+    }
+    setFrameCacheResume(newCache, reader.resumeInfo());
+    return ret;
+}
+
+//キャッシュした補正後のフレームから出力する
+//全トラックをまとめたcsvに出力するため、各トラックのフレームを時刻順に出力する
+static int writeFromFrameCache(const tstring& filename, const FrameCache& cache, const CheckBitrateParam& prm, BitrateSummary& fileSummary, CheckBitrateLog& log) {
+    auto intervals = prm.intervals;
+    if (intervals.size() == 0) {
+        intervals.push_back(getAutoInterval(cache.durationSec));
+    }
+    log.write(_T("analyzing bitrate from frame cache (interval: %s sec)...\n"), getIntervalString(intervals).c_str());
+
+    std::unique_ptr<CheckBitrateMuxWriter> muxWriter;
+    if (prm.muxOutput) {
+        std::vector<tstring> trackNames;
+        for (const auto& track : cache.tracks) {
+            trackNames.push_back(strsprintf(_T("track%d %s"), track.streamId + 1, get_media_type_name((AVMediaType)track.mediaType)));
+        }
+        muxWriter = std::make_unique<CheckBitrateMuxWriter>();
+        log.write(_T("output bitrate of all tracks...\n"));
+        if (muxWriter->open(getMuxOutputFilename(filename), intervals[0], trackNames, cache.startSec, false, log)) {
+            return 1;
+        }
+    }
+    std::vector<std::unique_ptr<CheckBitrateWriter>> writers;
+    for (int i = 0; i < (int)cache.tracks.size(); i++) {
+        const auto& track = cache.tracks[i];
+        const auto mediaType = (AVMediaType)track.mediaType;
+        auto writer = std::make_unique<CheckBitrateWriter>();
+        log.write(_T("output bitrate of %s track #%d...\n"), get_media_type_name(mediaType), track.streamId + 1);
+        writer->setFrameType(prm.frameType && mediaType == AVMEDIA_TYPE_VIDEO);
+        writer->setMuxBytes(prm.muxBytes);
+        writer->setOutputFormat(prm.outputFormat, prm.binaryFrames, { track.streamId, track.mediaType, track.codecName });
+        if (writer->open(getOutputs(filename, track.streamId, intervals), av_make_q(track.timebaseNum, track.timebaseDen), av_make_q(track.frameRateNum, track.frameRateDen),
+            CheckBitrateWriter::UNLIMITED_LOOKAHEAD, false, log)) {
+            return 1;
+        }
+        setupWriter(*writer, mediaType, prm);
+        if (muxWriter) {
+            writer->setMuxWriter(muxWriter.get(), i);
+        }
+        writers.push_back(std::move(writer));
+    }
+
+    std::vector<size_t> next(cache.tracks.size(), 0);
+    for (;;) {
+        int selected = -1;
+        double selectedSec = 0.0;
+        for (int i = 0; i < (int)cache.tracks.size(); i++) {
+            const auto& track = cache.tracks[i];
+            if (next[i] >= track.dts.size()) continue;
+            const double sec = ts2sec(track.dts[next[i]], av_make_q(track.timebaseNum, track.timebaseDen));
+            if (selected < 0 || sec < selectedSec) {
+                selected = i;
+                selectedSec = sec;
+            }
+        }
+        if (selected < 0) {
+            break;
+        }
+        const auto& track = cache.tracks[selected];
+        const size_t j = next[selected]++;
+        writers[selected]->pushRepaired(track.dts[j], track.size[j], (CheckBitrateFrameType)track.frameType[j], track.muxSize[j]);
+    }
+
+    int ret = 0;
+    for (int i = 0; i < (int)cache.tracks.size(); i++) {
+        ret |= finishWriter(*writers[i], filename, cache.tracks[i].streamId, (AVMediaType)cache.tracks[i].mediaType, prm, fileSummary, log);
+    }
+    if (muxWriter) {
+        ret |= muxWriter->finish();
+    }
+    return ret;
+}
+
+//キャッシュのフレームの情報に影響する設定
+static FrameCacheOptions getFrameCacheOptions(const CheckBitrateParam& prm) {
+    FrameCacheOptions options;
+    options.mediaTypes = 0;
+    for (const auto mediaType : prm.mediaTypes) {
+        options.mediaTypes |= 1u << mediaType;
+    }
+    options.flags = ((prm.frameType) ? FRAME_CACHE_FLAG_FRAME_TYPE : 0) | ((prm.muxBytes) ? FRAME_CACHE_FLAG_MUX_BYTES : 0);
+    options.demuxer = prm.demuxer;
+    return options;
+}
+
+//fileSummaryには、映像トラックのビットレートの分布をmergeする
+//--frame-cacheの場合は、有効なキャッシュがあれば入力ファイルを読み込まずにキャッシュから出力し、
+//なければ入力ファイルを読み込んだ後にキャッシュを保存する
+//キャッシュの作成後に追記されたMPEG-TSは、追記された部分のみを読み込んでキャッシュを更新する
+//jobがnullptrでなければ、ファイル内のトラックごとの処理をタスクとして並列に行う
+int run(const tstring& filename, const CheckBitrateParam& prm, BitrateSummary& fileSummary, CheckBitrateLog& log, CheckBitrateJob *job = nullptr) {
+    if (isStreamingInput(filename, prm)) {
+        if (prm.demuxer == CB_DEMUXER_NATIVE) {
+            log.write(_T("native reader does not support %s, switching to libavformat.\n"), (isStdinInput(filename)) ? _T("stdin") : _T("--follow"));
+        }
+        if (prm.frameCache) {
+            log.write(_T("--frame-cache is not used for %s.\n"), (isStdinInput(filename)) ? _T("stdin") : _T("--follow"));
+        }
+        return readAVFormat(filename, prm, fileSummary, nullptr, job, log);
+    }
+    if (!prm.frameCache) {
+        return readAndWrite(filename, prm, fileSummary, nullptr, job, log);
+    }
+    const auto tmStart = std::chrono::system_clock::now();
+    const auto cacheFilename = getFrameCacheFilename(filename);
+    FrameCacheKey cacheKey;
+    if (getFrameCacheKey(filename, cacheKey)) {
+        log.write(_T("error opening file: \"%s\"\n"), filename.c_str());
+        return 1;
+    }
+    FrameCache cache;
+    FrameCacheKey cachedKey;
+    const auto cacheOptions = getFrameCacheOptions(prm);
+    auto saveCache = [&](const FrameCache& newCache) {
+        if (saveFrameCache(cacheFilename, cacheKey, newCache)) {
+            log.write(_T("failed to write frame cache \"%s\".\n"), cacheFilename.c_str());
+        } else {
+            log.write(_T("frame cache: saved to \"%s\".\n"), cacheFilename.c_str());
+        }
+    };
+    if (loadFrameCache(cacheFilename, cacheOptions, cachedKey, cache) == 0) {
+        const double loadTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - tmStart).count() * 1e-3;
+        if (isSameFrameCacheKey(cachedKey, cacheKey)) {
+            log.write(_T("frame cache: loaded \"%s\" in %.1f ms.\n"), cacheFilename.c_str(), loadTime);
+            return writeFromFrameCache(filename, cache, prm, fileSummary, log);
+        }
+        //追記されたファイルは、キャッシュの続きの部分のみを読み込む
+        //--streamsの場合は映像以外のトラックが必要なので、先頭から読み込み直す
+        if (cache.resumeOffset >= 0 && !prm.muxOutput && isAppendedFile(filename, cachedKey, cacheKey)) {
+            log.write(_T("frame cache: input file was appended (%.1f MB -> %.1f MB), loaded \"%s\" in %.1f ms.\n"),
+                cachedKey.size / (1024.0 * 1024.0), cacheKey.size / (1024.0 * 1024.0), cacheFilename.c_str(), loadTime);
+            FrameCache newCache;
+            const int ret = appendAndWrite(filename, cache, prm, fileSummary, newCache, log);
+            if (ret == 0) {
+                saveCache(newCache);
+            }
+            return ret;
+        }
+    }
+    cache = FrameCache();
+    cache.options = cacheOptions;
+    int ret = readAndWrite(filename, prm, fileSummary, &cache, job, log);
+    if (ret == 0) {
+        saveCache(cache);
+    }
+    return ret;
+}
+
+//複数のファイルを並列に処理する
+//- 各ファイルの処理 (読み込み) と、ファイル内のトラックごとのtimestampの補正・出力をタスクとして、
+//  work stealingのスケジューラで実行する
+//- ファイルサイズの大きい順に、メモリ使用量の見積もりがprm.memoryBudgetに収まる範囲で処理を開始する
+//- 各ファイルのログはファイルごとにため込み、入力順に出力する
+//- 各ファイルのビットレートの分布は、処理の終わった順にmergeする
+int runJobs(const std::vector<tstring>& filelist, const CheckBitrateParam& prm) {
+    const int fileCount = (int)filelist.size();
+    //スケジューラのスレッド数はファイル数で制限しない (1ファイルでもトラックごとの処理を並列に行う)
+    //同時に処理を開始するファイル数は、スレッド数までとする
+    const int jobs = std::max((prm.jobs > 0) ? prm.jobs : (int)std::thread::hardware_concurrency(), 1);
+
+    std::vector<int> results(fileCount, 0);
+    BitrateSummary totalSummary;
+    if (jobs <= 1 || fileCount == 0) {
+        for (int i = 0; i < fileCount; i++) {
+            CheckBitrateLog log(false);
+            CheckBitrateLog::setCurrent(&log);
+            BitrateSummary fileSummary;
+            results[i] = run(filelist[i], prm, fileSummary, log);
+            totalSummary.merge(fileSummary);
+            CheckBitrateLog::setCurrent(nullptr);
+        }
+    } else {
+        std::vector<std::unique_ptr<CheckBitrateLog>> logs(fileCount);
+        std::vector<std::unique_ptr<CheckBitrateJob>> fileJobs(fileCount);
+        std::vector<bool> finished(fileCount, false);
+        std::mutex mtx;
+        std::condition_variable cond;
+        int finishedCount = 0;
+        int flushedCount = 0;
+
+        //大きいファイルから処理を開始し、最後に大きいファイルだけが残らないようにする
+        std::vector<int64_t> estimates(fileCount);
+        std::vector<uint64_t> filesizes(fileCount, 0);
+        std::vector<int> order(fileCount);
+        for (int i = 0; i < fileCount; i++) {
+            if (!isStreamingInput(filelist[i], prm)) {
+                rgy_get_filesize(filelist[i].c_str(), &filesizes[i]);
+            }
+            estimates[i] = estimateMemory(filesizes[i], prm);
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&filesizes](int a, int b) { return filesizes[a] > filesizes[b]; });
+
+        CheckBitrateTaskScheduler scheduler(jobs);
+        CheckBitrateMemoryBudget budget(prm.memoryBudget);
+        CheckBitrateTaskGroup group;
+        int started = 0;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            while (flushedCount < fileCount) {
+                //メモリの見積もりが確保できる範囲で、ファイルの処理を開始する
+                //同時に処理するファイル数はスレッド数までとする
+                while (started < fileCount && started - finishedCount < jobs && budget.tryAcquire(estimates[order[started]])) {
+                    const int i = order[started++];
+                    fileJobs[i] = std::make_unique<CheckBitrateJob>(&scheduler, &budget, estimates[i]);
+                    scheduler.submit(group, [&, i]() {
+                        auto log = std::make_unique<CheckBitrateLog>(true);
+                        BitrateSummary fileSummary;
+                        int ret = 0;
+                        {
+                            CheckBitrateLogScope logScope(log.get());
+                            ret = run(filelist[i], prm, fileSummary, *log, fileJobs[i].get());
+                        }
+                        fileJobs[i]->resize(0);
+
+                        std::lock_guard<std::mutex> lockFinish(mtx);
+                        results[i] = ret;
+                        totalSummary.merge(fileSummary);
+                        logs[i] = std::move(log);
+                        finished[i] = true;
+                        finishedCount++;
+                        cond.notify_one();
+                    });
+                }
+                const int prevFinished = finishedCount;
+                cond.wait_for(lock, std::chrono::milliseconds(200), [&]() { return finishedCount != prevFinished; });
+                //入力順に、処理の終わったファイルのログを出力する
+                while (flushedCount < fileCount && finished[flushedCount]) {
+                    logs[flushedCount]->flush();
+                    logs[flushedCount].reset();
+                    fileJobs[flushedCount].reset();
+                    flushedCount++;
+                }
+                std::lock_guard<std::mutex> lockOut(CheckBitrateLog::outputMutex());
+                if (budget.budget() > 0) {
+                    _ftprintf(stderr, _T("processed %d/%d files, memory %.0f/%.0f MB...\r"), finishedCount, fileCount,
+                        budget.used() / (1024.0 * 1024.0), budget.budget() / (1024.0 * 1024.0));
+                } else {
+                    _ftprintf(stderr, _T("processed %d/%d files, memory %.0f MB...\r"), finishedCount, fileCount, budget.used() / (1024.0 * 1024.0));
+                }
+            }
+        }
+        scheduler.wait(group);
+        _ftprintf(stderr, _T("peak memory (estimated): %.0f MB, %d threads, %llu tasks stolen.\n"),
+            budget.peak() / (1024.0 * 1024.0), scheduler.threads(), (unsigned long long)scheduler.steals());
+    }
+
+    const int errorCount = (int)std::count_if(results.begin(), results.end(), [](int ret) { return ret != 0; });
+    int summaryError = 0;
+    if (prm.summaryAll.length() > 0) {
+        CheckBitrateLog log(false);
+        summaryError = writeSummary(prm.summaryAll, totalSummary, log);
+    }
+    if (fileCount > 1) {
+        _ftprintf(stderr, _T("finished: %d files, %d succeeded, %d failed.\n"), fileCount, fileCount - errorCount, errorCount);
+        for (int i = 0; i < fileCount; i++) {
+            if (results[i]) {
+                _ftprintf(stderr, _T("  failed: %s\n"), filelist[i].c_str());
+            }
+        }
+    }
+    return (errorCount > 0 || summaryError) ? 1 : 0;
 }
 
 //必要なavcodecのdllがそろっているかを確認
@@ -440,9 +1410,85 @@ void option_error(const TCHAR *option, const TCHAR *argvalue) {
 void print_help() {
     tstring str = tstring(_T("CheckBitrate ")) + VER_STR_FILEVERSION_TCHAR + _T(" by rigaya\n");
     str += _T("Usage: <exe> [options] <target filepath1> [<target filepath2>] ...\n");
+    str += _T("       set \"-\" as filepath to read from stdin,\n");
+    str += _T("       bitrate will be written to stdin.trackN.bitrate.csv while reading.\n");
     str += _T("\n");
     str += _T("Options:\n");
-    str += _T("-i,--interval <float>   bitrate calc interval in seconds.\n");
+    str += _T("-i,--interval <float>[,<float>...]\n");
+    str += _T("                        bitrate calc interval in seconds.\n");
+    str += _T("                         when multiple intervals are set, all of them are\n");
+    str += _T("                         calculated in one pass, and written to\n");
+    str += _T("                         <file>.trackN.bitrate.<interval>s.csv.\n");
+    str += _T("-j,--jobs <int>         number of files processed in parallel.\n");
+    str += _T("                         0 = number of logical processors. (default: 1)\n");
+    str += _T("--memory-budget <int>   limit of estimated memory usage in MB of the files\n");
+    str += _T("                         processed in parallel with -j.\n");
+    str += _T("                         0 = unlimited. (default: 0)\n");
+    str += _T("--input-mode <string>   method to read input file.\n");
+    str += _T("                         avio (default), mmap, readahead\n");
+    str += _T("--demuxer <string>      demuxer to read input file.\n");
+    str += _T("                         avformat (default) ... use libavformat.\n");
+    str += _T("                         native   ... read mpeg-ts, mp4/mov, mkv/webm\n");
+    str += _T("                                      without libavformat,\n");
+    str += _T("                                      other formats will use libavformat.\n");
+    str += _T("--chunk-threads <int>   number of threads to read a single mpeg-ts file\n");
+    str += _T("                         by splitting it into byte ranges.\n");
+    str += _T("                         only used with --demuxer native.\n");
+    str += _T("                         0 = number of logical processors. (default: 1)\n");
+    str += _T("--demux-thread          read packets with libavformat on a separate thread,\n");
+    str += _T("                         and analyze them on the main thread.\n");
+    str += _T("--fast-probe            skip stream info probing for formats which list\n");
+    str += _T("                         all streams in the header (mp4/mov, mkv, flv),\n");
+    str += _T("                         and bound probing for other formats.\n");
+    str += _T("--probesize <int>       max bytes to probe the input file.\n");
+    str += _T("--analyzeduration <float>\n");
+    str += _T("                        max duration in seconds to probe the input file.\n");
+    str += _T("--quiet                 do not dump the format of the input file.\n");
+    str += _T("--follow                keep reading the input file while it is being written,\n");
+    str += _T("                         and write the bitrate while reading.\n");
+    str += _T("--follow-timeout <float>\n");
+    str += _T("                        finish --follow when the input file did not grow\n");
+    str += _T("                         for the given seconds. (default: 30)\n");
+    str += _T("--peak-window <float>[,<float>...]\n");
+    str += _T("                        show the peak bitrate over any span of the given\n");
+    str += _T("                         seconds, and where it occurs.\n");
+    str += _T("--vbv <int>:<int>[,<int>:<int>...]\n");
+    str += _T("                        simulate vbv buffer for pairs of maxrate (kbps)\n");
+    str += _T("                         and bufsize (kbit), and write the results to\n");
+    str += _T("                         <file>.trackN.vbv.csv, and the buffer fullness to\n");
+    str += _T("                         <file>.trackN.vbv.<maxrate>k_<bufsize>k.csv.\n");
+    str += _T("--vbv-init <float>      initial vbv buffer fullness. (default: 0.9)\n");
+    str += _T("--frame-type            add I/P/B frame bytes and counts of each interval\n");
+    str += _T("                         to the csv, by parsing slice headers\n");
+    str += _T("                         of h264, hevc, av1, mpeg1/2 without decoding.\n");
+    str += _T("--mux-bytes             add bytes in the file of each interval, from each\n");
+    str += _T("                         packet to the next packet of the same track,\n");
+    str += _T("                         including container headers, stuffing and\n");
+    str += _T("                         other streams, and the ratio of bytes other than\n");
+    str += _T("                         the frame data, to the csv.\n");
+    str += _T("--streams <string>[,<string>...]\n");
+    str += _T("                        types of streams to output bitrate in the same read.\n");
+    str += _T("                         video, audio, subtitle, data, all\n");
+    str += _T("                         bitrate of all output tracks is also written to\n");
+    str += _T("                         <file>.mux.bitrate.csv.\n");
+    str += _T("--output-format <string>\n");
+    str += _T("                        format of <file>.trackN.bitrate.csv.\n");
+    str += _T("                         csv (default) ... text.\n");
+    str += _T("                         binary        ... columnar binary, written to\n");
+    str += _T("                                           <file>.trackN.bitrate.bin.\n");
+    str += _T("                         both          ... csv and binary.\n");
+    str += _T("--binary-frames         add per frame columns to the binary output.\n");
+    str += _T("--bin-to-csv            convert binary output files given as input to csv.\n");
+    str += _T("--frame-cache           save the frames after timestamp repair to\n");
+    str += _T("                         <file>.bitrate.cache, and use it in later runs\n");
+    str += _T("                         instead of reading the input file.\n");
+    str += _T("                         if a mpeg-ts file read with --demuxer native was\n");
+    str += _T("                         appended after the cache was created, only the\n");
+    str += _T("                         appended part is read.\n");
+    str += _T("--summary               write count, avg, p50, p95, p99, max of frame size\n");
+    str += _T("                         and interval bitrate to <file>.trackN.summary.csv.\n");
+    str += _T("--summary-all <string>  write the same statistics merged over all input files\n");
+    str += _T("                         to the given file.\n");
     _ftprintf(stdout, _T("%s"), str.c_str());
 }
 
@@ -452,7 +1498,7 @@ int _tmain(int argc, TCHAR **argv) {
         return 1;
     }
     vector<tstring> filelist;
-    double interval = 0.0;
+    CheckBitrateParam prm;
     for (int i = 1; i < argc; i++) {
         const TCHAR *option_name = nullptr;
         if (argv[i][0] == _T('-')) {
@@ -460,6 +1506,9 @@ int _tmain(int argc, TCHAR **argv) {
             case 'i':
                 option_name = _T("interval");
                 break;
+            case 'j':
+                option_name = _T("jobs");
+                break;
             case '-':
                 option_name = &argv[i][2];
                 break;
@@ -474,10 +1523,247 @@ int _tmain(int argc, TCHAR **argv) {
                     break;
                 }
                 i++;
-                if (1 != _stscanf_s(argv[i], _T("%lf"), &interval)) {
+                prm.intervals.clear();
+                bool error = false;
+                for (const auto& str : split(argv[i], _T(","))) {
+                    double value = 0.0;
+                    if (1 != _stscanf_s(str.c_str(), _T("%lf"), &value)) {
+                        error = true;
+                        break;
+                    }
+                    prm.intervals.push_back(value);
+                }
+                if (error || prm.intervals.size() == 0) {
                     option_error(option_name, argv[i]);
                     break;
                 }
+                //0以下の値は自動 (複数指定する場合は正の値のみ)
+                if (prm.intervals.size() == 1 && prm.intervals[0] <= 0.0) {
+                    prm.intervals.clear();
+                } else if (std::any_of(prm.intervals.begin(), prm.intervals.end(), [](double value) { return value <= 0.0; })) {
+                    option_error(option_name, argv[i]);
+                    break;
+                }
+                //同じintervalは1回だけ出力する
+                std::sort(prm.intervals.begin(), prm.intervals.end());
+                prm.intervals.erase(std::unique(prm.intervals.begin(), prm.intervals.end()), prm.intervals.end());
+            } else if (0 == _tcscmp(option_name, _T("jobs"))) {
+                if (i + 1 >= argc) {
+                    option_error(option_name, nullptr);
+                    break;
+                }
+                i++;
+                if (1 != _stscanf_s(argv[i], _T("%d"), &prm.jobs) || prm.jobs < 0) {
+                    option_error(option_name, argv[i]);
+                    break;
+                }
+            } else if (0 == _tcscmp(option_name, _T("memory-budget"))) {
+                if (i + 1 >= argc) {
+                    option_error(option_name, nullptr);
+                    break;
+                }
+                i++;
+                long long value = 0;
+                if (1 != _stscanf_s(argv[i], _T("%lld"), &value) || value < 0) {
+                    option_error(option_name, argv[i]);
+                    break;
+                }
+                prm.memoryBudget = value * 1024 * 1024;
+            } else if (0 == _tcscmp(option_name, _T("input-mode"))) {
+                if (i + 1 >= argc) {
+                    option_error(option_name, nullptr);
+                    break;
+                }
+                i++;
+                auto mode = std::find_if(std::begin(CB_INPUT_MODE_NAMES), std::end(CB_INPUT_MODE_NAMES), [value = argv[i]](const auto& m) {
+                    return _tcsicmp(m.name, value) == 0;
+                });
+                if (mode == std::end(CB_INPUT_MODE_NAMES)) {
+                    option_error(option_name, argv[i]);
+                    break;
+                }
+                prm.inputMode = mode->mode;
+            } else if (0 == _tcscmp(option_name, _T("demuxer"))) {
+                if (i + 1 >= argc) {
+                    option_error(option_name, nullptr);
+                    break;
+                }
+                i++;
+                auto demuxer = std::find_if(std::begin(CB_DEMUXER_NAMES), std::end(CB_DEMUXER_NAMES), [value = argv[i]](const auto& m) {
+                    return _tcsicmp(m.name, value) == 0;
+                });
+                if (demuxer == std::end(CB_DEMUXER_NAMES)) {
+                    option_error(option_name, argv[i]);
+                    break;
+                }
+                prm.demuxer = demuxer->demuxer;
+            } else if (0 == _tcscmp(option_name, _T("chunk-threads"))) {
+                if (i + 1 >= argc) {
+                    option_error(option_name, nullptr);
+                    break;
+                }
+                i++;
+                if (1 != _stscanf_s(argv[i], _T("%d"), &prm.chunkThreads) || prm.chunkThreads < 0) {
+                    option_error(option_name, argv[i]);
+                    break;
+                }
+            } else if (0 == _tcscmp(option_name, _T("demux-thread"))) {
+                prm.demuxThread = true;
+            } else if (0 == _tcscmp(option_name, _T("fast-probe"))) {
+                prm.fastProbe = true;
+            } else if (0 == _tcscmp(option_name, _T("probesize"))) {
+                if (i + 1 >= argc) {
+                    option_error(option_name, nullptr);
+                    break;
+                }
+                i++;
+                long long value = 0;
+                if (1 != _stscanf_s(argv[i], _T("%lld"), &value) || value <= 0) {
+                    option_error(option_name, argv[i]);
+                    break;
+                }
+                prm.probesize = value;
+            } else if (0 == _tcscmp(option_name, _T("analyzeduration"))) {
+                if (i + 1 >= argc) {
+                    option_error(option_name, nullptr);
+                    break;
+                }
+                i++;
+                if (1 != _stscanf_s(argv[i], _T("%lf"), &prm.analyzeDuration) || prm.analyzeDuration < 0.0) {
+                    option_error(option_name, argv[i]);
+                    break;
+                }
+            } else if (0 == _tcscmp(option_name, _T("follow"))) {
+                prm.follow = true;
+            } else if (0 == _tcscmp(option_name, _T("follow-timeout"))) {
+                if (i + 1 >= argc) {
+                    option_error(option_name, nullptr);
+                    break;
+                }
+                i++;
+                if (1 != _stscanf_s(argv[i], _T("%lf"), &prm.followTimeout) || prm.followTimeout <= 0.0) {
+                    option_error(option_name, argv[i]);
+                    break;
+                }
+                prm.follow = true;
+            } else if (0 == _tcscmp(option_name, _T("peak-window"))) {
+                if (i + 1 >= argc) {
+                    option_error(option_name, nullptr);
+                    break;
+                }
+                i++;
+                prm.peakWindows.clear();
+                bool error = false;
+                for (const auto& str : split(argv[i], _T(","))) {
+                    double value = 0.0;
+                    if (1 != _stscanf_s(str.c_str(), _T("%lf"), &value) || value <= 0.0) {
+                        error = true;
+                        break;
+                    }
+                    prm.peakWindows.push_back(value);
+                }
+                if (error || prm.peakWindows.size() == 0) {
+                    option_error(option_name, argv[i]);
+                    break;
+                }
+                std::sort(prm.peakWindows.begin(), prm.peakWindows.end());
+                prm.peakWindows.erase(std::unique(prm.peakWindows.begin(), prm.peakWindows.end()), prm.peakWindows.end());
+            } else if (0 == _tcscmp(option_name, _T("vbv"))) {
+                if (i + 1 >= argc) {
+                    option_error(option_name, nullptr);
+                    break;
+                }
+                i++;
+                prm.vbv.clear();
+                bool error = false;
+                for (const auto& str : split(argv[i], _T(","))) {
+                    VBVParam vbv;
+                    if (2 != _stscanf_s(str.c_str(), _T("%lf:%lf"), &vbv.maxrate, &vbv.bufsize) || vbv.maxrate <= 0.0 || vbv.bufsize <= 0.0) {
+                        error = true;
+                        break;
+                    }
+                    prm.vbv.push_back(vbv);
+                }
+                if (error || prm.vbv.size() == 0) {
+                    option_error(option_name, argv[i]);
+                    break;
+                }
+            } else if (0 == _tcscmp(option_name, _T("vbv-init"))) {
+                if (i + 1 >= argc) {
+                    option_error(option_name, nullptr);
+                    break;
+                }
+                i++;
+                if (1 != _stscanf_s(argv[i], _T("%lf"), &prm.vbvInit) || prm.vbvInit < 0.0 || prm.vbvInit > 1.0) {
+                    option_error(option_name, argv[i]);
+                    break;
+                }
+            } else if (0 == _tcscmp(option_name, _T("frame-type"))) {
+                prm.frameType = true;
+            } else if (0 == _tcscmp(option_name, _T("mux-bytes"))) {
+                prm.muxBytes = true;
+            } else if (0 == _tcscmp(option_name, _T("streams"))) {
+                if (i + 1 >= argc) {
+                    option_error(option_name, nullptr);
+                    break;
+                }
+                i++;
+                prm.mediaTypes.clear();
+                bool error = false;
+                for (const auto& str : split(argv[i], _T(","))) {
+                    if (_tcsicmp(str.c_str(), _T("all")) == 0) {
+                        for (const auto& m : CB_MEDIA_TYPE_NAMES) {
+                            prm.mediaTypes.push_back(m.mediaType);
+                        }
+                        continue;
+                    }
+                    auto mediaType = std::find_if(std::begin(CB_MEDIA_TYPE_NAMES), std::end(CB_MEDIA_TYPE_NAMES), [value = str.c_str()](const auto& m) {
+                        return _tcsicmp(m.name, value) == 0;
+                    });
+                    if (mediaType == std::end(CB_MEDIA_TYPE_NAMES)) {
+                        error = true;
+                        break;
+                    }
+                    prm.mediaTypes.push_back(mediaType->mediaType);
+                }
+                if (error || prm.mediaTypes.size() == 0) {
+                    option_error(option_name, argv[i]);
+                    break;
+                }
+                std::sort(prm.mediaTypes.begin(), prm.mediaTypes.end());
+                prm.mediaTypes.erase(std::unique(prm.mediaTypes.begin(), prm.mediaTypes.end()), prm.mediaTypes.end());
+                prm.muxOutput = true;
+            } else if (0 == _tcscmp(option_name, _T("output-format"))) {
+                if (i + 1 >= argc) {
+                    option_error(option_name, nullptr);
+                    break;
+                }
+                i++;
+                auto format = std::find_if(std::begin(CB_OUTPUT_FORMAT_NAMES), std::end(CB_OUTPUT_FORMAT_NAMES), [value = argv[i]](const auto& m) {
+                    return _tcsicmp(m.name, value) == 0;
+                });
+                if (format == std::end(CB_OUTPUT_FORMAT_NAMES)) {
+                    option_error(option_name, argv[i]);
+                    break;
+                }
+                prm.outputFormat = format->format;
+            } else if (0 == _tcscmp(option_name, _T("binary-frames"))) {
+                prm.binaryFrames = true;
+            } else if (0 == _tcscmp(option_name, _T("bin-to-csv"))) {
+                prm.binaryToCsv = true;
+            } else if (0 == _tcscmp(option_name, _T("frame-cache"))) {
+                prm.frameCache = true;
+            } else if (0 == _tcscmp(option_name, _T("summary"))) {
+                prm.summary = true;
+            } else if (0 == _tcscmp(option_name, _T("summary-all"))) {
+                if (i + 1 >= argc) {
+                    option_error(option_name, nullptr);
+                    break;
+                }
+                i++;
+                prm.summaryAll = argv[i];
+            } else if (0 == _tcscmp(option_name, _T("quiet"))) {
+                prm.quiet = true;
             } else if (0 == _tcscmp(option_name, _T("help"))) {
                 print_help();
                 return 0;
@@ -486,12 +1772,19 @@ int _tmain(int argc, TCHAR **argv) {
             filelist.push_back(argv[i]);
         }
     }
+    //バイナリ出力の変換はlibavを使用しない
+    if (prm.binaryToCsv) {
+        int ret = 0;
+        for (const auto& filename : filelist) {
+            CheckBitrateLog log(false);
+            ret |= convertBinaryToCsv(filename, getCsvFilenameFromBinary(filename), log);
+        }
+        return ret;
+    }
     if (!check_avcodec_dll()) {
         _ftprintf(stdout, _T("%s"), error_mes_avcodec_dll_not_found().c_str());
         return 1;
     }
-    for (auto filename : filelist) {
-        run(filename, interval);
-    }
-    return 0;
+    CheckBitrateLog::initAVLog(AV_LOG_ERROR);
+    return runJobs(filelist, prm);
 }
@@ -0,0 +1,247 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+
+#include <cstring>
+#include "CheckBitrateBinary.h"
+#include "CheckBitrateCsv.h"
+#include "CheckBitrateLog.h"
+
+static const TCHAR *CB_CSV_EXT = _T(".csv");
+static const TCHAR *CB_BINARY_EXT = _T(".bin");
+
+static tstring replaceExtension(const tstring& filename, const TCHAR *from, const TCHAR *to) {
+    const size_t len = _tcslen(from);
+    if (filename.length() >= len && filename.compare(filename.length() - len, len, from) == 0) {
+        return filename.substr(0, filename.length() - len) + to;
+    }
+    return filename + to;
+}
+
+tstring getBinaryFilename(const tstring& csvFilename) {
+    return replaceExtension(csvFilename, CB_CSV_EXT, CB_BINARY_EXT);
+}
+
+tstring getCsvFilenameFromBinary(const tstring& binaryFilename) {
+    return replaceExtension(binaryFilename, CB_BINARY_EXT, CB_CSV_EXT);
+}
+
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+CheckBitrateBinaryWriter::CheckBitrateBinaryWriter() :
+    m_fp(),
+    m_filename(),
+    m_header(),
+    m_time(),
+    m_kbps(),
+    m_avgKbps() {
+}
+
+CheckBitrateBinaryWriter::~CheckBitrateBinaryWriter() {
+}
+
+int CheckBitrateBinaryWriter::open(const tstring& filename, const CheckBitrateBinaryInfo& info, int timebaseNum, int timebaseDen, int frameRateNum, int frameRateDen, double interval) {
+    FILE *fp = NULL;
+    if (_tfopen_s(&fp, filename.c_str(), _T("wb"))) {
+        return 1;
+    }
+    m_fp.reset(fp);
+    m_filename = filename;
+    memset(&m_header, 0, sizeof(m_header));
+    memcpy(m_header.magic, CB_BINARY_MAGIC, sizeof(m_header.magic));
+    m_header.version = CB_BINARY_VERSION;
+    m_header.headerSize = sizeof(m_header);
+    m_header.streamId = info.streamId;
+    m_header.mediaType = info.mediaType;
+    strncpy(m_header.codecName, info.codecName.c_str(), sizeof(m_header.codecName) - 1);
+    m_header.timebaseNum = timebaseNum;
+    m_header.timebaseDen = timebaseDen;
+    m_header.frameRateNum = frameRateNum;
+    m_header.frameRateDen = frameRateDen;
+    m_header.interval = interval;
+    m_time.clear();
+    m_kbps.clear();
+    m_avgKbps.clear();
+    return 0;
+}
+
+int CheckBitrateBinaryWriter::close(const CheckBitrateBinaryFrames *frames) {
+    if (!m_fp) {
+        return 1;
+    }
+    auto& header = m_header;
+    header.rowCount = m_time.size();
+    header.rowTimeOffset = sizeof(header);
+    header.rowKbpsOffset = header.rowTimeOffset + header.rowCount * sizeof(double);
+    header.rowAvgKbpsOffset = header.rowKbpsOffset + header.rowCount * sizeof(double);
+    uint64_t endOffset = header.rowAvgKbpsOffset + header.rowCount * sizeof(double);
+    if (frames) {
+        header.frameCount = frames->time.size();
+        header.frameTimeOffset = endOffset;
+        header.frameSizeOffset = header.frameTimeOffset + header.frameCount * sizeof(double);
+        header.frameTypeOffset = alignOffset(header.frameSizeOffset + header.frameCount * sizeof(uint32_t));
+        endOffset = header.frameTypeOffset + header.frameCount * sizeof(uint8_t);
+    }
+
+    bool error = false;
+    uint64_t pos = 0;
+    auto writeData = [&](const void *data, uint64_t offset, size_t size) {
+        static const char padding[8] = { 0 };
+        if (offset > pos && fwrite(padding, 1, (size_t)(offset - pos), m_fp.get()) != offset - pos) {
+            error = true;
+        }
+        if (size > 0 && fwrite(data, 1, size, m_fp.get()) != size) {
+            error = true;
+        }
+        pos = offset + size;
+    };
+    writeData(&header, 0, sizeof(header));
+    writeData(m_time.data(), header.rowTimeOffset, m_time.size() * sizeof(double));
+    writeData(m_kbps.data(), header.rowKbpsOffset, m_kbps.size() * sizeof(double));
+    writeData(m_avgKbps.data(), header.rowAvgKbpsOffset, m_avgKbps.size() * sizeof(double));
+    if (frames) {
+        writeData(frames->time.data(), header.frameTimeOffset, frames->time.size() * sizeof(double));
+        writeData(frames->size.data(), header.frameSizeOffset, frames->size.size() * sizeof(uint32_t));
+        writeData(frames->type.data(), header.frameTypeOffset, frames->type.size() * sizeof(uint8_t));
+    }
+    if (fflush(m_fp.get())) {
+        error = true;
+    }
+    if (fclose(m_fp.release())) {
+        error = true;
+    }
+    m_time.clear();
+    m_kbps.clear();
+    m_avgKbps.clear();
+    return (error) ? 1 : 0;
+}
+
+CheckBitrateBinaryReader::CheckBitrateBinaryReader() :
+    m_file(),
+    m_buffer(),
+    m_data(nullptr),
+    m_size(0),
+    m_header(nullptr) {
+}
+
+CheckBitrateBinaryReader::~CheckBitrateBinaryReader() {
+    close();
+}
+
+int CheckBitrateBinaryReader::open(const tstring& filename) {
+    close();
+    if (m_file.open(filename, CB_INPUT_MMAP)) {
+        return 1;
+    }
+    m_size = m_file.size();
+    m_data = m_file.data();
+    if (m_data == nullptr) {
+        //空のファイルなどでメモリマップできない場合
+        m_buffer.resize((size_t)((m_size + 7) / 8));
+        if (m_file.read(m_buffer.data(), m_size) != m_size) {
+            close();
+            return 1;
+        }
+        m_data = (const uint8_t *)m_buffer.data();
+    }
+    m_header = (const CheckBitrateBinaryHeader *)m_data;
+    if (validate()) {
+        close();
+        return 1;
+    }
+    return 0;
+}
+
+void CheckBitrateBinaryReader::close() {
+    m_file.close();
+    m_buffer.clear();
+    m_data = nullptr;
+    m_size = 0;
+    m_header = nullptr;
+}
+
+int CheckBitrateBinaryReader::validate() const {
+    if (m_size < (int64_t)sizeof(CheckBitrateBinaryHeader)
+        || memcmp(m_header->magic, CB_BINARY_MAGIC, sizeof(CB_BINARY_MAGIC)) != 0
+        || m_header->version != CB_BINARY_VERSION
+        || m_header->headerSize != sizeof(CheckBitrateBinaryHeader)) {
+        return 1;
+    }
+    //各列がファイルの範囲内にあり、型の境界にそろっているか
+    auto checkColumn = [&](uint64_t offset, uint64_t count, uint64_t elemSize) {
+        if (offset == 0) {
+            return count == 0;
+        }
+        return offset % elemSize == 0
+            && offset >= sizeof(CheckBitrateBinaryHeader)
+            && offset <= (uint64_t)m_size
+            && count <= ((uint64_t)m_size - offset) / elemSize;
+    };
+    if (!checkColumn(m_header->rowTimeOffset, m_header->rowCount, sizeof(double))
+        || !checkColumn(m_header->rowKbpsOffset, m_header->rowCount, sizeof(double))
+        || !checkColumn(m_header->rowAvgKbpsOffset, m_header->rowCount, sizeof(double))
+        || !checkColumn(m_header->frameTimeOffset, m_header->frameCount, sizeof(double))
+        || !checkColumn(m_header->frameSizeOffset, m_header->frameCount, sizeof(uint32_t))
+        || !checkColumn(m_header->frameTypeOffset, m_header->frameCount, sizeof(uint8_t))) {
+        return 1;
+    }
+    return 0;
+}
+
+int convertBinaryToCsv(const tstring& binaryFilename, const tstring& csvFilename, CheckBitrateLog& log) {
+    CheckBitrateBinaryReader reader;
+    if (reader.open(binaryFilename)) {
+        log.write(_T("failed to read binary file \"%s\"\n"), binaryFilename.c_str());
+        return 1;
+    }
+    CheckBitrateCsvWriter csv;
+    if (csv.open(csvFilename)) {
+        log.write(_T("failed to open output file \"%s\"\n"), csvFilename.c_str());
+        return 1;
+    }
+    const auto time = reader.rowTime();
+    const auto kbps = reader.rowKbps();
+    const auto avgKbps = reader.rowAvgKbps();
+    csv.write(",kbps,kbps(avg)\n");
+    for (uint64_t i = 0; i < reader.rowCount(); i++) {
+        csv.writeFixed(time[i], 3, 10);
+        csv.put(',');
+        csv.writeFixed(kbps[i], 2);
+        csv.put(',');
+        csv.writeFixed(avgKbps[i], 2);
+        csv.put('\n');
+    }
+    if (csv.close()) {
+        log.write(_T("failed to write output file \"%s\"\n"), csvFilename.c_str());
+        return 1;
+    }
+    log.write(_T("converted \"%s\" -> \"%s\" (%llu rows)\n"), binaryFilename.c_str(), csvFilename.c_str(), (unsigned long long)reader.rowCount());
+    return 0;
+}
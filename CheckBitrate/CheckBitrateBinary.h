@@ -0,0 +1,172 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __CHECK_BITRATE_BINARY_H__
+#define __CHECK_BITRATE_BINARY_H__
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include "rgy_tchar.h"
+#include "rgy_util.h"
+#include "CheckBitrateInput.h"
+
+class CheckBitrateLog;
+
+enum CheckBitrateOutputFormat {
+    CB_OUTPUT_CSV    = 0x01,
+    CB_OUTPUT_BINARY = 0x02,
+    CB_OUTPUT_BOTH   = CB_OUTPUT_CSV | CB_OUTPUT_BINARY,
+};
+
+static const struct {
+    CheckBitrateOutputFormat format;
+    const TCHAR *name;
+} CB_OUTPUT_FORMAT_NAMES[] = {
+    { CB_OUTPUT_CSV,    _T("csv") },
+    { CB_OUTPUT_BINARY, _T("binary") },
+    { CB_OUTPUT_BOTH,   _T("both") },
+};
+
+static const char CB_BINARY_MAGIC[8] = { 'C', 'B', 'I', 'T', 'R', 'A', 'T', 'E' };
+static const uint32_t CB_BINARY_VERSION = 1;
+
+// 列形式のバイナリ出力のヘッダ (ファイルの先頭に置く)
+// - 数値はすべてリトルエンディアン
+// - 各列は同じ型の値を行数分だけ連続して並べたもので、列の位置はファイル先頭からのoffsetで示す
+// - 各列の位置は8byte境界にそろえる
+// - フレームごとの列がない場合は、frameCountとframe*Offsetを0とする
+struct CheckBitrateBinaryHeader {
+    char magic[8];             // CB_BINARY_MAGIC
+    uint32_t version;          // CB_BINARY_VERSION
+    uint32_t headerSize;       // sizeof(CheckBitrateBinaryHeader)
+    int32_t streamId;          // 0から始まるトラック番号
+    int32_t mediaType;         // AVMediaType
+    char codecName[32];        // コーデック名 (不明な場合は空)
+    int32_t timebaseNum;       // 入力のtimebase
+    int32_t timebaseDen;
+    int32_t frameRateNum;      // 入力の平均フレームレート (不明な場合は0/1)
+    int32_t frameRateDen;
+    double interval;           // 区間の長さ(秒)
+    uint64_t rowCount;         // 区間の数
+    uint64_t frameCount;       // フレームの数
+    uint64_t rowTimeOffset;    // double: 区間の開始時刻(秒)
+    uint64_t rowKbpsOffset;    // double: 区間のビットレート(kbps)
+    uint64_t rowAvgKbpsOffset; // double: 先頭から区間の終わりまでの平均ビットレート(kbps)
+    uint64_t frameTimeOffset;  // double: 補正後のdtsの先頭のフレームからの時刻(秒)
+    uint64_t frameSizeOffset;  // uint32_t: フレームのサイズ(byte)
+    uint64_t frameTypeOffset;  // uint8_t: CheckBitrateFrameType
+};
+static_assert(sizeof(CheckBitrateBinaryHeader) == 144, "unexpected size of CheckBitrateBinaryHeader");
+
+// ヘッダに記録するトラックの情報
+struct CheckBitrateBinaryInfo {
+    int streamId;
+    int mediaType;
+    std::string codecName;
+};
+
+// フレームごとの列
+struct CheckBitrateBinaryFrames {
+    std::vector<double> time;
+    std::vector<uint32_t> size;
+    std::vector<uint8_t> type;
+};
+
+// <name>.csv -> <name>.bin
+tstring getBinaryFilename(const tstring& csvFilename);
+// <name>.bin -> <name>.csv
+tstring getCsvFilenameFromBinary(const tstring& binaryFilename);
+
+// 区間ごとの値をメモリに保持し、close()でまとめて列ごとに書き出す
+class CheckBitrateBinaryWriter {
+public:
+    CheckBitrateBinaryWriter();
+    ~CheckBitrateBinaryWriter();
+
+    int open(const tstring& filename, const CheckBitrateBinaryInfo& info, int timebaseNum, int timebaseDen, int frameRateNum, int frameRateDen, double interval);
+    void addRow(double time, double kbps, double avgKbps) {
+        m_time.push_back(time);
+        m_kbps.push_back(kbps);
+        m_avgKbps.push_back(avgKbps);
+    }
+    const tstring& filename() const { return m_filename; }
+    // framesがnullptrでなければ、フレームごとの列も書き出す
+    // 書き込みに失敗した場合は1を返す
+    int close(const CheckBitrateBinaryFrames *frames);
+private:
+    std::unique_ptr<FILE, fp_deleter> m_fp;
+    tstring m_filename;
+    CheckBitrateBinaryHeader m_header;
+    std::vector<double> m_time;
+    std::vector<double> m_kbps;
+    std::vector<double> m_avgKbps;
+};
+
+// バイナリ出力の読み込み
+// ファイル全体をメモリマップし、各列はマップした領域を直接参照する
+// (メモリマップできない場合はファイル全体を読み込む)
+class CheckBitrateBinaryReader {
+public:
+    CheckBitrateBinaryReader();
+    ~CheckBitrateBinaryReader();
+
+    // ファイルが壊れている場合やバージョンが異なる場合は1を返す
+    int open(const tstring& filename);
+    void close();
+
+    const CheckBitrateBinaryHeader& header() const { return *m_header; }
+    uint64_t rowCount() const { return m_header->rowCount; }
+    const double *rowTime() const { return column<double>(m_header->rowTimeOffset); }
+    const double *rowKbps() const { return column<double>(m_header->rowKbpsOffset); }
+    const double *rowAvgKbps() const { return column<double>(m_header->rowAvgKbpsOffset); }
+    uint64_t frameCount() const { return m_header->frameCount; }
+    const double *frameTime() const { return column<double>(m_header->frameTimeOffset); }
+    const uint32_t *frameSize() const { return column<uint32_t>(m_header->frameSizeOffset); }
+    const uint8_t *frameType() const { return column<uint8_t>(m_header->frameTypeOffset); }
+private:
+    template<typename T>
+    const T *column(uint64_t offset) const {
+        return (offset > 0) ? (const T *)(m_data + offset) : nullptr;
+    }
+    int validate() const;
+
+    CheckBitrateInputFile m_file;
+    std::vector<uint64_t> m_buffer; // メモリマップできない場合に読み込む
+    const uint8_t *m_data;
+    int64_t m_size;
+    const CheckBitrateBinaryHeader *m_header;
+};
+
+// バイナリ出力を-iで出力するcsvと同じ形式に変換する
+int convertBinaryToCsv(const tstring& binaryFilename, const tstring& csvFilename, CheckBitrateLog& log);
+
+#endif //__CHECK_BITRATE_BINARY_H__
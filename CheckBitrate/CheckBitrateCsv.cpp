@@ -0,0 +1,140 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include "CheckBitrateCsv.h"
+
+CheckBitrateCsvWriter::CheckBitrateCsvWriter() :
+    m_fp(),
+    m_filename(),
+    m_buffer(),
+    m_pos(0),
+    m_error(false) {
+}
+
+CheckBitrateCsvWriter::~CheckBitrateCsvWriter() {
+    close();
+}
+
+int CheckBitrateCsvWriter::open(const tstring& filename) {
+    close();
+    FILE *fp = NULL;
+    if (_tfopen_s(&fp, filename.c_str(), _T("w"))) {
+        return 1;
+    }
+    m_fp.reset(fp);
+    m_filename = filename;
+    m_buffer.resize(CSV_BUFFER_SIZE);
+    m_pos = 0;
+    m_error = false;
+    return 0;
+}
+
+void CheckBitrateCsvWriter::write(const char *str) {
+    for (size_t len = strlen(str); len > 0; ) {
+        const size_t size = std::min(len, m_buffer.size() - m_pos);
+        memcpy(m_buffer.data() + m_pos, str, size);
+        m_pos += size;
+        str += size;
+        len -= size;
+        if (m_pos >= m_buffer.size()) {
+            writeBuffer();
+        }
+    }
+}
+
+void CheckBitrateCsvWriter::write(const tstring& str) {
+#if defined(_UNICODE) || defined(UNICODE)
+    write(tchar_to_string(str).c_str());
+#else
+    write(str.c_str());
+#endif
+}
+
+void CheckBitrateCsvWriter::writeFixed(double value, int precision, int width) {
+    char *ptr = reserve(CSV_MAX_NUMBER_LENGTH + width);
+    const auto result = std::to_chars(ptr, ptr + CSV_MAX_NUMBER_LENGTH, value, std::chars_format::fixed, precision);
+    if (result.ec != std::errc()) {
+        m_error = true;
+        return;
+    }
+    const int len = (int)(result.ptr - ptr);
+    if (len < width) {
+        memmove(ptr + (width - len), ptr, len);
+        memset(ptr, ' ', width - len);
+        m_pos += width;
+    } else {
+        m_pos += len;
+    }
+}
+
+void CheckBitrateCsvWriter::writeInt(int64_t value) {
+    char *ptr = reserve(CSV_MAX_NUMBER_LENGTH);
+    m_pos += std::to_chars(ptr, ptr + CSV_MAX_NUMBER_LENGTH, value).ptr - ptr;
+}
+
+void CheckBitrateCsvWriter::writeUInt(uint64_t value) {
+    char *ptr = reserve(CSV_MAX_NUMBER_LENGTH);
+    m_pos += std::to_chars(ptr, ptr + CSV_MAX_NUMBER_LENGTH, value).ptr - ptr;
+}
+
+void CheckBitrateCsvWriter::writeBuffer() {
+    if (m_pos > 0 && m_fp) {
+        if (fwrite(m_buffer.data(), 1, m_pos, m_fp.get()) != m_pos) {
+            m_error = true;
+        }
+    }
+    m_pos = 0;
+}
+
+int CheckBitrateCsvWriter::flush() {
+    if (!m_fp) {
+        return 1;
+    }
+    writeBuffer();
+    if (fflush(m_fp.get())) {
+        m_error = true;
+    }
+    return (m_error) ? 1 : 0;
+}
+
+int CheckBitrateCsvWriter::close() {
+    if (!m_fp) {
+        return 0;
+    }
+    int ret = flush();
+    if (fclose(m_fp.release())) {
+        ret = 1;
+    }
+    m_buffer.clear();
+    m_buffer.shrink_to_fit();
+    return ret;
+}
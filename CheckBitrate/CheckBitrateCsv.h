@@ -0,0 +1,92 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __CHECK_BITRATE_CSV_H__
+#define __CHECK_BITRATE_CSV_H__
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include "rgy_tchar.h"
+#include "rgy_util.h"
+
+// csvの出力
+// - 行ごとにファイルに書き出さず、固定サイズのバッファにため込んでまとめて書き出す
+// - 数値はstd::to_charsでバッファに直接書き込むので、1行ごとのメモリ確保や書式の解析がない
+// - 書き込みのエラーは記録しておき、flush()/close()で返す
+class CheckBitrateCsvWriter {
+public:
+    static const size_t CSV_BUFFER_SIZE = 1024 * 1024;
+
+    CheckBitrateCsvWriter();
+    ~CheckBitrateCsvWriter();
+    CheckBitrateCsvWriter(const CheckBitrateCsvWriter&) = delete;
+    CheckBitrateCsvWriter& operator=(const CheckBitrateCsvWriter&) = delete;
+
+    int open(const tstring& filename);
+    bool isOpen() const { return (bool)m_fp; }
+    const tstring& filename() const { return m_filename; }
+
+    void put(char c) {
+        if (m_pos >= m_buffer.size()) {
+            writeBuffer();
+        }
+        m_buffer[m_pos++] = c;
+    }
+    void write(const char *str);
+    void write(const tstring& str);
+    // printfの"%*.*f"と同じ形式で出力する (widthに満たない場合は左を空白で埋める)
+    void writeFixed(double value, int precision, int width = 0);
+    void writeInt(int64_t value);
+    void writeUInt(uint64_t value);
+
+    // バッファをファイルに書き出す
+    int flush();
+    // flushしてファイルを閉じる (エラーがあった場合は1を返す)
+    int close();
+private:
+    static const size_t CSV_MAX_NUMBER_LENGTH = 512; // doubleを固定小数点で出力した場合の最大長
+
+    void writeBuffer();
+    char *reserve(size_t size) {
+        if (m_pos + size > m_buffer.size()) {
+            writeBuffer();
+        }
+        return m_buffer.data() + m_pos;
+    }
+
+    std::unique_ptr<FILE, fp_deleter> m_fp;
+    tstring m_filename;
+    std::vector<char> m_buffer;
+    size_t m_pos;
+    bool m_error;
+};
+
+#endif //__CHECK_BITRATE_CSV_H__
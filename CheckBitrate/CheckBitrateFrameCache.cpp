@@ -0,0 +1,380 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include "CheckBitrateFrameCache.h"
+#include "CheckBitrateInput.h"
+#include "rgy_util.h"
+#include "rgy_filesystem.h"
+
+static const char FRAME_CACHE_MAGIC[8] = { 'C', 'B', 'F', 'C', 'A', 'C', 'H', 'E' };
+static const uint32_t FRAME_CACHE_VERSION = 3;
+
+static const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+static const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// キャッシュの内容はメモリ上で組み立ててから書き出す
+// timestampとファイル上のバイト数は前のフレームとの差分を、sizeはピクチャタイプと合わせて可変長で記録する
+class FrameCacheBuffer {
+public:
+    FrameCacheBuffer() : m_data() {};
+    const std::vector<uint8_t>& data() const { return m_data; }
+    void putBytes(const void *ptr, size_t size) {
+        m_data.insert(m_data.end(), (const uint8_t *)ptr, (const uint8_t *)ptr + size);
+    }
+    void putU32(uint32_t value) { putBytes(&value, sizeof(value)); }
+    void putI32(int32_t value) { putBytes(&value, sizeof(value)); }
+    void putU64(uint64_t value) { putBytes(&value, sizeof(value)); }
+    void putF64(double value) { putBytes(&value, sizeof(value)); }
+    void putString(const std::string& str) {
+        putU32((uint32_t)str.length());
+        putBytes(str.data(), str.length());
+    }
+    void putVarint(uint64_t value) {
+        while (value >= 0x80) {
+            m_data.push_back((uint8_t)(value | 0x80));
+            value >>= 7;
+        }
+        m_data.push_back((uint8_t)value);
+    }
+    void putSignedVarint(int64_t value) {
+        putVarint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+    }
+private:
+    std::vector<uint8_t> m_data;
+};
+
+// 範囲外を読もうとした場合はerror()をtrueとし、以降は0を返す
+class FrameCacheReader {
+public:
+    FrameCacheReader(const uint8_t *data, size_t size) : m_data(data), m_size(size), m_pos(0), m_error(false) {};
+    bool error() const { return m_error; }
+    size_t pos() const { return m_pos; }
+    bool getBytes(void *ptr, size_t size) {
+        if (m_error || size > m_size - m_pos) {
+            m_error = true;
+            memset(ptr, 0, size);
+            return false;
+        }
+        memcpy(ptr, m_data + m_pos, size);
+        m_pos += size;
+        return true;
+    }
+    uint32_t getU32() { uint32_t value; getBytes(&value, sizeof(value)); return value; }
+    int32_t getI32() { int32_t value; getBytes(&value, sizeof(value)); return value; }
+    uint64_t getU64() { uint64_t value; getBytes(&value, sizeof(value)); return value; }
+    double getF64() { double value; getBytes(&value, sizeof(value)); return value; }
+    std::string getString() {
+        const uint32_t length = getU32();
+        if (m_error || length > m_size - m_pos) {
+            m_error = true;
+            return std::string();
+        }
+        std::string str((const char *)m_data + m_pos, length);
+        m_pos += length;
+        return str;
+    }
+    uint64_t getVarint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (m_pos >= m_size) {
+                break;
+            }
+            const uint8_t byte = m_data[m_pos++];
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        m_error = true;
+        return 0;
+    }
+    int64_t getSignedVarint() {
+        const uint64_t value = getVarint();
+        return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+    }
+private:
+    const uint8_t *m_data;
+    size_t m_size;
+    size_t m_pos;
+    bool m_error;
+};
+
+tstring getFrameCacheFilename(const tstring& filename) {
+    return filename + _T(".bitrate.cache");
+}
+
+//[offset, offset+size)のhashを求める
+static int hashFileBlock(CheckBitrateInputFile& file, int64_t offset, int64_t size, std::vector<uint8_t>& buffer, uint64_t& hash) {
+    if (file.seek(offset, SEEK_SET) < 0) {
+        return 1;
+    }
+    const auto readSize = file.read(buffer.data(), size);
+    if (readSize != size) {
+        return 1;
+    }
+    hash = fnv1a(FNV_OFFSET_BASIS, buffer.data(), (size_t)readSize);
+    return 0;
+}
+
+int getFrameCacheKey(const tstring& filename, FrameCacheKey& key) {
+    std::error_code ec;
+    const auto mtime = std::filesystem::last_write_time(std::filesystem::path(filename), ec);
+    if (ec) {
+        return 1;
+    }
+    CheckBitrateInputFile file;
+    if (file.open(filename, CB_INPUT_READAHEAD)) {
+        return 1;
+    }
+    key.path = tchar_to_string(GetFullPathFrom(filename.c_str()), CP_UTF8);
+    key.size = (uint64_t)file.size();
+    key.mtime = (int64_t)mtime.time_since_epoch().count();
+    key.hash = FNV_OFFSET_BASIS;
+    key.headHash = FNV_OFFSET_BASIS;
+    key.tailHash = FNV_OFFSET_BASIS;
+
+    //先頭・中央・末尾 (重なる場合は1回だけ)
+    const int64_t blockSize = FRAME_CACHE_HASH_BLOCK_SIZE;
+    std::vector<int64_t> offsets = { 0, (file.size() - blockSize) / 2, file.size() - blockSize };
+    for (auto& offset : offsets) {
+        offset = std::max<int64_t>(offset, 0);
+    }
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+    std::vector<uint8_t> buffer(FRAME_CACHE_HASH_BLOCK_SIZE);
+    for (const auto offset : offsets) {
+        if (file.seek(offset, SEEK_SET) < 0) {
+            return 1;
+        }
+        const auto readSize = file.read(buffer.data(), std::min(blockSize, file.size() - offset));
+        if (readSize < 0) {
+            return 1;
+        }
+        key.hash = fnv1a(key.hash, buffer.data(), (size_t)readSize);
+        if (offset == offsets.front()) {
+            key.headHash = fnv1a(FNV_OFFSET_BASIS, buffer.data(), (size_t)readSize);
+        }
+        if (offset == offsets.back()) {
+            key.tailHash = fnv1a(FNV_OFFSET_BASIS, buffer.data(), (size_t)readSize);
+        }
+    }
+    return 0;
+}
+
+bool isSameFrameCacheKey(const FrameCacheKey& a, const FrameCacheKey& b) {
+    return a.path == b.path && a.size == b.size && a.mtime == b.mtime && a.hash == b.hash;
+}
+
+bool isAppendedFile(const tstring& filename, const FrameCacheKey& cachedKey, const FrameCacheKey& key) {
+    if (key.path != cachedKey.path || key.size <= cachedKey.size) {
+        return false;
+    }
+    CheckBitrateInputFile file;
+    if (file.open(filename, CB_INPUT_READAHEAD)) {
+        return false;
+    }
+    //追記前のファイルでのブロックの位置で比較する
+    const int64_t cachedSize = (int64_t)cachedKey.size;
+    const int64_t blockSize = std::min<int64_t>(FRAME_CACHE_HASH_BLOCK_SIZE, cachedSize);
+    std::vector<uint8_t> buffer((size_t)blockSize);
+    uint64_t headHash = 0, tailHash = 0;
+    return hashFileBlock(file, 0, blockSize, buffer, headHash) == 0
+        && headHash == cachedKey.headHash
+        && hashFileBlock(file, cachedSize - blockSize, blockSize, buffer, tailHash) == 0
+        && tailHash == cachedKey.tailHash;
+}
+
+static bool readFile(const tstring& filename, std::vector<uint8_t>& data) {
+    FILE *fp = NULL;
+    if (_tfopen_s(&fp, filename.c_str(), _T("rb"))) {
+        return false;
+    }
+    std::unique_ptr<FILE, fp_deleter> fpIn(fp);
+    uint8_t buffer[64 * 1024];
+    size_t readSize = 0;
+    while ((readSize = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        data.insert(data.end(), buffer, buffer + readSize);
+    }
+    return !ferror(fp);
+}
+
+int loadFrameCache(const tstring& cacheFilename, const FrameCacheOptions& options, FrameCacheKey& cachedKey, FrameCache& cache) {
+    std::vector<uint8_t> data;
+    if (!readFile(cacheFilename, data) || data.size() < sizeof(FRAME_CACHE_MAGIC) + sizeof(uint64_t)) {
+        return 1;
+    }
+    //末尾のhashで破損を確認する
+    const size_t bodySize = data.size() - sizeof(uint64_t);
+    uint64_t checksum = 0;
+    memcpy(&checksum, data.data() + bodySize, sizeof(checksum));
+    if (checksum != fnv1a(FNV_OFFSET_BASIS, data.data(), bodySize)) {
+        return 1;
+    }
+    FrameCacheReader reader(data.data(), bodySize);
+    char magic[sizeof(FRAME_CACHE_MAGIC)];
+    reader.getBytes(magic, sizeof(magic));
+    if (memcmp(magic, FRAME_CACHE_MAGIC, sizeof(magic)) != 0 || reader.getU32() != FRAME_CACHE_VERSION) {
+        return 1;
+    }
+    cachedKey.path = reader.getString();
+    cachedKey.size = reader.getU64();
+    cachedKey.mtime = (int64_t)reader.getU64();
+    cachedKey.hash = reader.getU64();
+    cachedKey.headHash = reader.getU64();
+    cachedKey.tailHash = reader.getU64();
+    cache.options.mediaTypes = reader.getU32();
+    cache.options.flags = reader.getU32();
+    cache.options.demuxer = reader.getI32();
+    if (cache.options.mediaTypes != options.mediaTypes
+        || cache.options.flags != options.flags
+        || cache.options.demuxer != options.demuxer) {
+        return 1;
+    }
+    const bool hasMuxSize = (cache.options.flags & FRAME_CACHE_FLAG_MUX_BYTES) != 0;
+    cache.durationSec = reader.getF64();
+    cache.startSec = reader.getF64();
+    cache.resumeOffset = (int64_t)reader.getU64();
+    cache.packetSize = reader.getI32();
+    const uint32_t trackCount = reader.getU32();
+    cache.tracks.clear();
+    for (uint32_t i = 0; i < trackCount && !reader.error(); i++) {
+        FrameCacheTrack track;
+        track.streamId = reader.getI32();
+        track.mediaType = reader.getI32();
+        track.timebaseNum = reader.getI32();
+        track.timebaseDen = reader.getI32();
+        track.frameRateNum = reader.getI32();
+        track.frameRateDen = reader.getI32();
+        track.codecName = reader.getString();
+        track.pid = reader.getI32();
+        track.resumeDropFrames = reader.getU64();
+        const uint32_t repairFlags = reader.getU32();
+        track.repair.timestampFound = (repairFlags & 0x01) != 0;
+        track.repair.useFrameRate = (repairFlags & 0x02) != 0;
+        track.repair.ptsOffset = (int64_t)reader.getU64();
+        const uint64_t frameCount = reader.getU64();
+        //1フレームあたり最低2byte
+        if (reader.error() || frameCount > (bodySize - reader.pos()) / 2) {
+            return 1;
+        }
+        track.dts.reserve((size_t)frameCount);
+        track.size.reserve((size_t)frameCount);
+        track.frameType.reserve((size_t)frameCount);
+        track.muxSize.reserve((size_t)frameCount);
+        int64_t dts = 0, muxSize = 0;
+        for (uint64_t j = 0; j < frameCount; j++) {
+            dts += reader.getSignedVarint();
+            const uint64_t sizeType = reader.getVarint();
+            if (hasMuxSize) {
+                muxSize += reader.getSignedVarint();
+            }
+            track.add(dts, (int)(sizeType >> 2), (CheckBitrateFrameType)(sizeType & 0x03), muxSize);
+        }
+        cache.tracks.push_back(std::move(track));
+    }
+    if (reader.error() || reader.pos() != bodySize) {
+        return 1;
+    }
+    return 0;
+}
+
+int saveFrameCache(const tstring& cacheFilename, const FrameCacheKey& key, const FrameCache& cache) {
+    const bool hasMuxSize = (cache.options.flags & FRAME_CACHE_FLAG_MUX_BYTES) != 0;
+    FrameCacheBuffer buffer;
+    buffer.putBytes(FRAME_CACHE_MAGIC, sizeof(FRAME_CACHE_MAGIC));
+    buffer.putU32(FRAME_CACHE_VERSION);
+    buffer.putString(key.path);
+    buffer.putU64(key.size);
+    buffer.putU64((uint64_t)key.mtime);
+    buffer.putU64(key.hash);
+    buffer.putU64(key.headHash);
+    buffer.putU64(key.tailHash);
+    buffer.putU32(cache.options.mediaTypes);
+    buffer.putU32(cache.options.flags);
+    buffer.putI32(cache.options.demuxer);
+    buffer.putF64(cache.durationSec);
+    buffer.putF64(cache.startSec);
+    buffer.putU64((uint64_t)cache.resumeOffset);
+    buffer.putI32(cache.packetSize);
+    buffer.putU32((uint32_t)cache.tracks.size());
+    for (const auto& track : cache.tracks) {
+        buffer.putI32(track.streamId);
+        buffer.putI32(track.mediaType);
+        buffer.putI32(track.timebaseNum);
+        buffer.putI32(track.timebaseDen);
+        buffer.putI32(track.frameRateNum);
+        buffer.putI32(track.frameRateDen);
+        buffer.putString(track.codecName);
+        buffer.putI32(track.pid);
+        buffer.putU64(track.resumeDropFrames);
+        buffer.putU32(((track.repair.timestampFound) ? 0x01 : 0) | ((track.repair.useFrameRate) ? 0x02 : 0));
+        buffer.putU64((uint64_t)track.repair.ptsOffset);
+        buffer.putU64(track.dts.size());
+        int64_t prevDts = 0, prevMuxSize = 0;
+        for (size_t i = 0; i < track.dts.size(); i++) {
+            buffer.putSignedVarint(track.dts[i] - prevDts);
+            buffer.putVarint(((uint64_t)(uint32_t)track.size[i] << 2) | (track.frameType[i] & 0x03));
+            if (hasMuxSize) {
+                buffer.putSignedVarint(track.muxSize[i] - prevMuxSize);
+                prevMuxSize = track.muxSize[i];
+            }
+            prevDts = track.dts[i];
+        }
+    }
+    const auto& data = buffer.data();
+    const uint64_t checksum = fnv1a(FNV_OFFSET_BASIS, data.data(), data.size());
+
+    const auto tmpFilename = cacheFilename + _T(".tmp");
+    FILE *fp = NULL;
+    if (_tfopen_s(&fp, tmpFilename.c_str(), _T("wb"))) {
+        return 1;
+    }
+    bool error = fwrite(data.data(), 1, data.size(), fp) != data.size()
+        || fwrite(&checksum, 1, sizeof(checksum), fp) != sizeof(checksum);
+    error |= fclose(fp) != 0;
+    std::error_code ec;
+    if (!error) {
+        std::filesystem::rename(std::filesystem::path(tmpFilename), std::filesystem::path(cacheFilename), ec);
+    }
+    if (error || ec) {
+        std::filesystem::remove(std::filesystem::path(tmpFilename), ec);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __CHECK_BITRATE_FRAME_CACHE_H__
+#define __CHECK_BITRATE_FRAME_CACHE_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "rgy_tchar.h"
+#include "CheckBitrateStream.h"
+
+// 入力ファイルの同一性の確認に使用する情報
+// 内容のhashはファイルの先頭・中央・末尾のFRAME_CACHE_HASH_BLOCK_SIZEずつから求める
+// 追記されたかの確認のため、先頭と末尾のブロックのhashも個別に持つ
+struct FrameCacheKey {
+    std::string path; // 絶対パス (UTF-8)
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+    uint64_t headHash;
+    uint64_t tailHash;
+};
+
+// キャッシュを作成した時の設定
+// フレームの情報が変わるので、異なる場合はキャッシュを作り直す
+struct FrameCacheOptions {
+    uint32_t mediaTypes; // 1 << AVMediaType の組み合わせ
+    uint32_t flags;      // FRAME_CACHE_FLAG_*
+    int32_t demuxer;
+};
+
+static const uint32_t FRAME_CACHE_FLAG_FRAME_TYPE = 0x01; // ピクチャタイプを含む
+static const uint32_t FRAME_CACHE_FLAG_MUX_BYTES  = 0x02; // ファイル上のバイト数を含む
+
+// CheckBitrateWriterのtimestampの補正の状態 (追記された部分の続きの補正に使用する)
+struct FrameCacheRepairState {
+    bool timestampFound;
+    bool useFrameRate;
+    int64_t ptsOffset; // PCR Wrapの補正量
+
+    FrameCacheRepairState() : timestampFound(false), useFrameRate(false), ptsOffset(0) {};
+};
+
+// 1トラック分の補正後のフレーム
+struct FrameCacheTrack {
+    int streamId;
+    int mediaType;
+    int timebaseNum;
+    int timebaseDen;
+    int frameRateNum;
+    int frameRateDen;
+    std::string codecName;
+    int pid;                       // MPEG-TSのPID (追記された部分の読み込みに使用する, 不明な場合は-1)
+    uint64_t resumeDropFrames;     // 追記された部分を読み込む際に、末尾から除いて読み直すフレーム数
+    FrameCacheRepairState repair;
+    std::vector<int64_t> dts;      // 補正後のtimestamp (timebase単位)
+    std::vector<int32_t> size;
+    std::vector<uint8_t> frameType; // CheckBitrateFrameType
+    std::vector<int64_t> muxSize;  // FRAME_CACHE_FLAG_MUX_BYTESの場合のみ
+
+    FrameCacheTrack() : streamId(0), mediaType(0), timebaseNum(0), timebaseDen(1), frameRateNum(0), frameRateDen(1),
+        codecName(), pid(-1), resumeDropFrames(0), repair(), dts(), size(), frameType(), muxSize() {};
+    void add(int64_t frameDts, int frameSize, CheckBitrateFrameType type, int64_t frameMuxSize) {
+        dts.push_back(frameDts);
+        size.push_back(frameSize);
+        frameType.push_back((uint8_t)type);
+        muxSize.push_back(frameMuxSize);
+    }
+};
+
+// ファイル単位のキャッシュ
+struct FrameCache {
+    FrameCacheOptions options;
+    double durationSec; // -iの指定がない場合のintervalの決定に使用する
+    double startSec;    // 全トラックをまとめたcsvの時刻の基準 (負の場合は最初のフレーム)
+    int64_t resumeOffset; // 追記された部分を読み込む際に、読み込みを再開する位置 (負の場合は追記に対応しない)
+    int packetSize;       // MPEG-TSのパケットサイズ
+    std::vector<FrameCacheTrack> tracks;
+
+    FrameCache() : options(), durationSec(0.0), startSec(-1.0), resumeOffset(-1), packetSize(0), tracks() {};
+};
+
+static const int FRAME_CACHE_HASH_BLOCK_SIZE = 1024 * 1024;
+
+// <file>.bitrate.cache
+tstring getFrameCacheFilename(const tstring& filename);
+int getFrameCacheKey(const tstring& filename, FrameCacheKey& key);
+// キャッシュが存在し、optionsが一致する場合に0を返す
+// キャッシュを作成した時の入力ファイルの情報をcachedKeyに返す
+int loadFrameCache(const tstring& cacheFilename, const FrameCacheOptions& options, FrameCacheKey& cachedKey, FrameCache& cache);
+bool isSameFrameCacheKey(const FrameCacheKey& a, const FrameCacheKey& b);
+// cachedKeyのファイルの末尾にデータが追記されたものかを、先頭と追記前の末尾のブロックのhashで確認する
+bool isAppendedFile(const tstring& filename, const FrameCacheKey& cachedKey, const FrameCacheKey& key);
+// 一時ファイルに書き出してから置き換えるので、書き込み中に中断しても壊れたキャッシュは残らない
+int saveFrameCache(const tstring& cacheFilename, const FrameCacheKey& key, const FrameCache& cache);
+
+#endif //__CHECK_BITRATE_FRAME_CACHE_H__
@@ -0,0 +1,359 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+
+#include <cstring>
+#include <algorithm>
+#include "CheckBitrateFrameType.h"
+
+// emulation prevention byteを除きながら読み込む
+class NALBitReader {
+public:
+    NALBitReader(const uint8_t *data, int size, bool removeEPB) :
+        m_data(data), m_size(size), m_pos(0), m_bit(0), m_zeros(0), m_removeEPB(removeEPB), m_error(false) {};
+    uint32_t u(int bits) {
+        uint32_t value = 0;
+        for (int i = 0; i < bits; i++) {
+            value = (value << 1) | readBit();
+        }
+        return value;
+    }
+    uint32_t ue() {
+        int leadingZeros = 0;
+        while (readBit() == 0) {
+            if (m_error || ++leadingZeros > 31) {
+                m_error = true;
+                return 0;
+            }
+        }
+        return (uint32_t)(((uint64_t)1 << leadingZeros) - 1 + u(leadingZeros));
+    }
+    bool error() const { return m_error; }
+private:
+    uint32_t readBit() {
+        if (m_bit == 0) {
+            if (m_removeEPB && m_zeros >= 2 && m_pos < m_size && m_data[m_pos] == 0x03) {
+                m_pos++;
+                m_zeros = 0;
+            }
+            if (m_pos >= m_size) {
+                m_error = true;
+                return 0;
+            }
+            m_zeros = (m_data[m_pos] == 0) ? m_zeros + 1 : 0;
+        }
+        const uint32_t bit = (m_data[m_pos] >> (7 - m_bit)) & 1;
+        if (++m_bit == 8) {
+            m_bit = 0;
+            m_pos++;
+        }
+        return bit;
+    }
+    const uint8_t *m_data;
+    int m_size;
+    int m_pos;
+    int m_bit;
+    int m_zeros;
+    bool m_removeEPB;
+    bool m_error;
+};
+
+CheckBitrateFrameTypeParser::CheckBitrateFrameTypeParser() :
+    m_codecId(AV_CODEC_ID_NONE),
+    m_nalLengthSize(0),
+    m_hevcExtraSliceHeaderBits(),
+    m_av1ReducedStillPicture(false) {
+}
+
+CheckBitrateFrameTypeParser::~CheckBitrateFrameTypeParser() {
+}
+
+int CheckBitrateFrameTypeParser::init(AVCodecID codecId, const uint8_t *extradata, int extradataSize) {
+    m_codecId = codecId;
+    m_nalLengthSize = 0;
+    memset(m_hevcExtraSliceHeaderBits, 0, sizeof(m_hevcExtraSliceHeaderBits));
+    m_av1ReducedStillPicture = false;
+    switch (codecId) {
+    case AV_CODEC_ID_H264:
+        // avcC (configurationVersion = 1)
+        if (extradataSize >= 7 && extradata[0] == 1) {
+            m_nalLengthSize = (extradata[4] & 0x03) + 1;
+        }
+        return 0;
+    case AV_CODEC_ID_HEVC:
+        // hvcC (Annex Bは00 00 01 または 00 00 00 01で始まる)
+        if (extradataSize >= 23 && (extradata[0] || extradata[1] || extradata[2] > 1)) {
+            m_nalLengthSize = (extradata[21] & 0x03) + 1;
+            parseHEVCConfig(extradata, extradataSize);
+        } else if (extradataSize > 0) {
+            parseNALUnits(extradata, extradataSize, 0, [this](const uint8_t *nal, int size) {
+                if (size >= 2 && ((nal[0] >> 1) & 0x3f) == 34) {
+                    parseHEVCPPS(nal, size);
+                }
+                return CB_FRAME_TYPE_UNKNOWN;
+            });
+        }
+        return 0;
+    case AV_CODEC_ID_AV1:
+        // av1C (marker = 1) の後ろにsequence header OBUがある
+        if (extradataSize > 4 && (extradata[0] & 0x80)) {
+            parseAV1(extradata + 4, extradataSize - 4);
+        }
+        return 0;
+    case AV_CODEC_ID_MPEG1VIDEO:
+    case AV_CODEC_ID_MPEG2VIDEO:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+CheckBitrateFrameType CheckBitrateFrameTypeParser::parse(const uint8_t *data, int size) {
+    if (data == nullptr || size <= 0) {
+        return CB_FRAME_TYPE_UNKNOWN;
+    }
+    switch (m_codecId) {
+    case AV_CODEC_ID_H264:
+        return parseNALUnits(data, size, m_nalLengthSize, [this](const uint8_t *nal, int nalSize) { return parseH264NAL(nal, nalSize); });
+    case AV_CODEC_ID_HEVC:
+        return parseNALUnits(data, size, m_nalLengthSize, [this](const uint8_t *nal, int nalSize) { return parseHEVCNAL(nal, nalSize); });
+    case AV_CODEC_ID_AV1:
+        return parseAV1(data, size);
+    case AV_CODEC_ID_MPEG1VIDEO:
+    case AV_CODEC_ID_MPEG2VIDEO:
+        return parseMPEG2(data, size);
+    default:
+        return CB_FRAME_TYPE_UNKNOWN;
+    }
+}
+
+// Annex Bの場合、NAL unitの終わりは次のstart codeを探して決める
+template<typename T>
+CheckBitrateFrameType CheckBitrateFrameTypeParser::parseNALUnits(const uint8_t *data, int size, int lengthSize, T handler) {
+    if (lengthSize > 0) {
+        for (int pos = 0; pos + lengthSize <= size; ) {
+            uint32_t nalSize = 0;
+            for (int i = 0; i < lengthSize; i++) {
+                nalSize = (nalSize << 8) | data[pos + i];
+            }
+            pos += lengthSize;
+            if (nalSize > (uint32_t)(size - pos)) {
+                nalSize = (uint32_t)(size - pos);
+            }
+            const auto type = handler(data + pos, (int)nalSize);
+            if (type != CB_FRAME_TYPE_UNKNOWN) {
+                return type;
+            }
+            pos += (int)nalSize;
+        }
+        return CB_FRAME_TYPE_UNKNOWN;
+    }
+    auto findStartCode = [data, size](int pos) {
+        for (; pos + 3 <= size; pos++) {
+            if (data[pos + 2] > 1) {
+                pos += 2; // data[pos+2]を含むstart codeはない
+            } else if (data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 1) {
+                return pos;
+            }
+        }
+        return size;
+    };
+    int start = findStartCode(0);
+    while (start < size) {
+        const int nalStart = start + 3;
+        const int next = findStartCode(nalStart);
+        // 次のstart codeの前の0 (4byteのstart code) は含めない
+        int nalEnd = next;
+        while (nalEnd > nalStart && data[nalEnd - 1] == 0) {
+            nalEnd--;
+        }
+        const auto type = handler(data + nalStart, nalEnd - nalStart);
+        if (type != CB_FRAME_TYPE_UNKNOWN) {
+            return type;
+        }
+        start = next;
+    }
+    return CB_FRAME_TYPE_UNKNOWN;
+}
+
+CheckBitrateFrameType CheckBitrateFrameTypeParser::parseH264NAL(const uint8_t *nal, int size) {
+    if (size < 2) {
+        return CB_FRAME_TYPE_UNKNOWN;
+    }
+    const int nalType = nal[0] & 0x1f;
+    if (nalType != 1 && nalType != 5) { // non-IDR slice, IDR slice
+        return CB_FRAME_TYPE_UNKNOWN;
+    }
+    NALBitReader reader(nal + 1, size - 1, true);
+    reader.ue(); // first_mb_in_slice
+    const uint32_t sliceType = reader.ue();
+    if (reader.error()) {
+        return CB_FRAME_TYPE_UNKNOWN;
+    }
+    switch (sliceType % 5) {
+    case 0: // P
+    case 3: // SP
+        return CB_FRAME_TYPE_P;
+    case 1:
+        return CB_FRAME_TYPE_B;
+    default: // I, SI
+        return CB_FRAME_TYPE_I;
+    }
+}
+
+CheckBitrateFrameType CheckBitrateFrameTypeParser::parseHEVCNAL(const uint8_t *nal, int size) {
+    if (size < 3) {
+        return CB_FRAME_TYPE_UNKNOWN;
+    }
+    const int nalType = (nal[0] >> 1) & 0x3f;
+    if (nalType == 34) { // PPS
+        parseHEVCPPS(nal, size);
+        return CB_FRAME_TYPE_UNKNOWN;
+    }
+    if (nalType > 21) { // VCLのみ
+        return CB_FRAME_TYPE_UNKNOWN;
+    }
+    NALBitReader reader(nal + 2, size - 2, true);
+    if (!reader.u(1)) { // first_slice_segment_in_pic_flag
+        return CB_FRAME_TYPE_UNKNOWN;
+    }
+    if (nalType >= 16) { // IRAP
+        reader.u(1); // no_output_of_prior_pics_flag
+    }
+    const uint32_t ppsId = reader.ue();
+    if (reader.error() || ppsId >= HEVC_MAX_PPS) {
+        return CB_FRAME_TYPE_UNKNOWN;
+    }
+    reader.u(m_hevcExtraSliceHeaderBits[ppsId]); // slice_reserved_flag
+    const uint32_t sliceType = reader.ue();
+    if (reader.error()) {
+        return CB_FRAME_TYPE_UNKNOWN;
+    }
+    switch (sliceType) {
+    case 0: return CB_FRAME_TYPE_B;
+    case 1: return CB_FRAME_TYPE_P;
+    case 2: return CB_FRAME_TYPE_I;
+    default: return CB_FRAME_TYPE_UNKNOWN;
+    }
+}
+
+void CheckBitrateFrameTypeParser::parseHEVCPPS(const uint8_t *nal, int size) {
+    NALBitReader reader(nal + 2, size - 2, true);
+    const uint32_t ppsId = reader.ue();
+    reader.ue(); // pps_seq_parameter_set_id
+    reader.u(1); // dependent_slice_segments_enabled_flag
+    reader.u(1); // output_flag_present_flag
+    const uint32_t extraBits = reader.u(3);
+    if (!reader.error() && ppsId < HEVC_MAX_PPS) {
+        m_hevcExtraSliceHeaderBits[ppsId] = (uint8_t)extraBits;
+    }
+}
+
+// hvcCのNAL unitの配列からPPSを探す
+void CheckBitrateFrameTypeParser::parseHEVCConfig(const uint8_t *data, int size) {
+    const int arrayCount = data[22];
+    int pos = 23;
+    for (int i = 0; i < arrayCount && pos + 3 <= size; i++) {
+        const int nalType = data[pos] & 0x3f;
+        const int nalCount = (data[pos + 1] << 8) | data[pos + 2];
+        pos += 3;
+        for (int j = 0; j < nalCount && pos + 2 <= size; j++) {
+            const int nalSize = std::min((data[pos] << 8) | data[pos + 1], size - pos - 2);
+            pos += 2;
+            if (nalType == 34 && nalSize >= 2) {
+                parseHEVCPPS(data + pos, nalSize);
+            }
+            pos += nalSize;
+        }
+    }
+}
+
+CheckBitrateFrameType CheckBitrateFrameTypeParser::parseAV1(const uint8_t *data, int size) {
+    for (int pos = 0; pos < size; ) {
+        const int obuType = (data[pos] >> 3) & 0x0f;
+        const bool extension = (data[pos] & 0x04) != 0;
+        const bool hasSize = (data[pos] & 0x02) != 0;
+        pos += (extension) ? 2 : 1;
+        int64_t obuSize = size - pos;
+        if (hasSize) {
+            // leb128
+            obuSize = 0;
+            for (int i = 0; i < 8; i++) {
+                if (pos >= size) {
+                    return CB_FRAME_TYPE_UNKNOWN;
+                }
+                const uint8_t byte = data[pos++];
+                obuSize |= (int64_t)(byte & 0x7f) << (i * 7);
+                if (!(byte & 0x80)) break;
+            }
+        }
+        if (pos > size || obuSize > size - pos) {
+            return CB_FRAME_TYPE_UNKNOWN;
+        }
+        NALBitReader reader(data + pos, (int)obuSize, false);
+        if (obuType == 1) { // OBU_SEQUENCE_HEADER
+            reader.u(3); // seq_profile
+            reader.u(1); // still_picture
+            const bool reducedStillPicture = reader.u(1) != 0;
+            if (!reader.error()) {
+                m_av1ReducedStillPicture = reducedStillPicture;
+            }
+        } else if (obuType == 3 || obuType == 6) { // OBU_FRAME_HEADER, OBU_FRAME
+            if (m_av1ReducedStillPicture) {
+                return CB_FRAME_TYPE_I;
+            }
+            // show_existing_frameの場合は、以前のフレームを表示するだけなので次を見る
+            if (!reader.u(1)) {
+                const uint32_t frameType = reader.u(2);
+                if (reader.error()) {
+                    return CB_FRAME_TYPE_UNKNOWN;
+                }
+                return (frameType == 0 || frameType == 2) ? CB_FRAME_TYPE_I : CB_FRAME_TYPE_P; // KEY_FRAME, INTRA_ONLY_FRAME
+            }
+        }
+        pos += (int)obuSize;
+    }
+    return CB_FRAME_TYPE_UNKNOWN;
+}
+
+// picture_start_code (00 00 01 00) の後ろのpicture_coding_type
+CheckBitrateFrameType CheckBitrateFrameTypeParser::parseMPEG2(const uint8_t *data, int size) {
+    for (int pos = 0; pos + 6 <= size; pos++) {
+        if (data[pos + 2] > 1) {
+            pos += 2;
+        } else if (data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 1 && data[pos + 3] == 0) {
+            switch ((data[pos + 5] >> 3) & 0x07) {
+            case 1: return CB_FRAME_TYPE_I;
+            case 2: return CB_FRAME_TYPE_P;
+            case 3: return CB_FRAME_TYPE_B;
+            default: return CB_FRAME_TYPE_UNKNOWN;
+            }
+        }
+    }
+    return CB_FRAME_TYPE_UNKNOWN;
+}
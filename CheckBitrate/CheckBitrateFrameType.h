@@ -0,0 +1,75 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __CHECK_BITRATE_FRAME_TYPE_H__
+#define __CHECK_BITRATE_FRAME_TYPE_H__
+
+#include <cstdint>
+#include "CheckBitrateStream.h"
+#pragma warning (push)
+#pragma warning (disable: 4244)
+#pragma warning (disable: 4819)
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+#pragma warning (pop)
+
+// デコードせずに、パケットの先頭のスライスヘッダ等からピクチャタイプを判定する
+// - H.264/HEVC: 最初のスライスのslice_type (Annex B, avcC/hvcCのどちらの形式にも対応)
+// - AV1: 最初のフレームヘッダのframe_type (KEY/INTRA_ONLYはI、INTER/SWITCHはPとする)
+// - MPEG-1/2: picture_coding_type
+// 最初のスライスまでしか読まないので、パケットの残りは走査しない
+class CheckBitrateFrameTypeParser {
+public:
+    CheckBitrateFrameTypeParser();
+    ~CheckBitrateFrameTypeParser();
+
+    // 対応していないコーデックの場合は1を返す
+    int init(AVCodecID codecId, const uint8_t *extradata, int extradataSize);
+    CheckBitrateFrameType parse(const uint8_t *data, int size);
+protected:
+    static const int HEVC_MAX_PPS = 64;
+
+    // NAL unitを順に処理し、handlerが判定できた時点で終了する
+    template<typename T>
+    CheckBitrateFrameType parseNALUnits(const uint8_t *data, int size, int lengthSize, T handler);
+    CheckBitrateFrameType parseH264NAL(const uint8_t *nal, int size);
+    CheckBitrateFrameType parseHEVCNAL(const uint8_t *nal, int size);
+    void parseHEVCPPS(const uint8_t *nal, int size);
+    void parseHEVCConfig(const uint8_t *data, int size);
+    CheckBitrateFrameType parseAV1(const uint8_t *data, int size);
+    CheckBitrateFrameType parseMPEG2(const uint8_t *data, int size);
+
+    AVCodecID m_codecId;
+    int m_nalLengthSize;        // 0の場合はAnnex B
+    uint8_t m_hevcExtraSliceHeaderBits[HEVC_MAX_PPS]; // PPSのnum_extra_slice_header_bits
+    bool m_av1ReducedStillPicture;
+};
+
+#endif //__CHECK_BITRATE_FRAME_TYPE_H__
@@ -0,0 +1,333 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstdio>
+#include <cerrno>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "CheckBitrateInput.h"
+#if !(defined(_WIN32) || defined(_WIN64))
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
+#pragma warning (push)
+#pragma warning (disable: 4244)
+#pragma warning (disable: 4819)
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/error.h>
+#include <libavformat/avio.h>
+}
+#pragma warning (pop)
+
+CheckBitrateInputFile::CheckBitrateInputFile() :
+    m_mode(CB_INPUT_AVIO),
+#if defined(_WIN32) || defined(_WIN64)
+    m_handle(INVALID_HANDLE_VALUE),
+    m_mapping(NULL),
+#else
+    m_fd(-1),
+    m_inotify(-1),
+#endif
+    m_filename(),
+    m_followTimeout(0.0),
+    m_map(nullptr),
+    m_size(0),
+    m_pos(0),
+    m_bytesRead(0),
+    m_avio(nullptr) {
+}
+
+CheckBitrateInputFile::~CheckBitrateInputFile() {
+    close();
+}
+
+int CheckBitrateInputFile::openFile(const tstring& filename) {
+#if defined(_WIN32) || defined(_WIN64)
+    m_handle = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (m_handle == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+#else
+    m_fd = ::open(filename.c_str(), O_RDONLY);
+    if (m_fd < 0) {
+        return 1;
+    }
+    //カーネルの先読みを大きくする
+    posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return updateSize();
+}
+
+int CheckBitrateInputFile::updateSize() {
+#if defined(_WIN32) || defined(_WIN64)
+    LARGE_INTEGER filesize;
+    if (!GetFileSizeEx(m_handle, &filesize)) {
+        return 1;
+    }
+    m_size = filesize.QuadPart;
+#else
+    struct stat st;
+    if (fstat(m_fd, &st)) {
+        return 1;
+    }
+    m_size = st.st_size;
+#endif
+    return 0;
+}
+
+void CheckBitrateInputFile::setFollow(double idleTimeoutSec) {
+    m_followTimeout = idleTimeoutSec;
+#if !(defined(_WIN32) || defined(_WIN64))
+    if (m_followTimeout > 0.0 && m_inotify < 0) {
+        //inotifyが使えない場合は、一定間隔でファイルサイズを確認する
+        m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m_inotify >= 0 && inotify_add_watch(m_inotify, m_filename.c_str(), IN_MODIFY) < 0) {
+            ::close(m_inotify);
+            m_inotify = -1;
+        }
+    }
+#endif
+}
+
+bool CheckBitrateInputFile::waitForGrowth() {
+    const auto tmStart = std::chrono::steady_clock::now();
+    for (;;) {
+        if (updateSize() == 0 && m_size > m_pos) {
+            return true;
+        }
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+        if (elapsed >= m_followTimeout) {
+            return false;
+        }
+        const int remainingMs = (int)((m_followTimeout - elapsed) * 1000.0) + 1;
+        const int waitMs = (remainingMs < FOLLOW_POLL_INTERVAL_MS) ? remainingMs : FOLLOW_POLL_INTERVAL_MS;
+#if !(defined(_WIN32) || defined(_WIN64))
+        if (m_inotify >= 0) {
+            struct pollfd pfd = { m_inotify, POLLIN, 0 };
+            if (poll(&pfd, 1, waitMs) > 0) {
+                //たまったイベントは読み捨てる
+                char events[4096];
+                while (::read(m_inotify, events, sizeof(events)) > 0) {}
+            }
+            continue;
+        }
+#endif
+        std::this_thread::sleep_for(std::chrono::milliseconds(waitMs));
+    }
+}
+
+int CheckBitrateInputFile::mapFile() {
+    if (m_size <= 0 || (uint64_t)m_size > (uint64_t)SIZE_MAX) {
+        return 1;
+    }
+#if defined(_WIN32) || defined(_WIN64)
+    m_mapping = CreateFileMapping(m_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m_mapping == NULL) {
+        return 1;
+    }
+    m_map = (const uint8_t *)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (m_map == nullptr) {
+        CloseHandle(m_mapping);
+        m_mapping = NULL;
+        return 1;
+    }
+#else
+    void *ptr = mmap(nullptr, (size_t)m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (ptr == MAP_FAILED) {
+        return 1;
+    }
+    madvise(ptr, (size_t)m_size, MADV_SEQUENTIAL);
+    m_map = (const uint8_t *)ptr;
+#endif
+    return 0;
+}
+
+void CheckBitrateInputFile::unmapFile() {
+    if (m_map) {
+#if defined(_WIN32) || defined(_WIN64)
+        UnmapViewOfFile(m_map);
+#else
+        munmap((void *)m_map, (size_t)m_size);
+#endif
+        m_map = nullptr;
+    }
+#if defined(_WIN32) || defined(_WIN64)
+    if (m_mapping) {
+        CloseHandle(m_mapping);
+        m_mapping = NULL;
+    }
+#endif
+}
+
+int CheckBitrateInputFile::open(const tstring& filename, CheckBitrateInputMode mode) {
+    close();
+    if (openFile(filename)) {
+        close();
+        return 1;
+    }
+    m_filename = filename;
+    m_mode = mode;
+    if (m_mode == CB_INPUT_MMAP && mapFile()) {
+        m_mode = CB_INPUT_READAHEAD;
+    }
+    return 0;
+}
+
+void CheckBitrateInputFile::close() {
+    if (m_avio) {
+        av_freep(&m_avio->buffer);
+        avio_context_free(&m_avio);
+    }
+    unmapFile();
+#if defined(_WIN32) || defined(_WIN64)
+    if (m_handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_handle);
+        m_handle = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (m_inotify >= 0) {
+        ::close(m_inotify);
+        m_inotify = -1;
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+#endif
+    m_filename.clear();
+    m_followTimeout = 0.0;
+    m_size = 0;
+    m_pos = 0;
+    m_bytesRead = 0;
+}
+
+int64_t CheckBitrateInputFile::read(void *buf, int64_t size) {
+    if (m_followTimeout > 0.0 && !m_map && m_pos >= m_size && !waitForGrowth()) {
+        return 0;
+    }
+    size = std::min(size, m_size - m_pos);
+    if (size <= 0) {
+        return 0;
+    }
+    if (m_map) {
+        memcpy(buf, m_map + m_pos, (size_t)size);
+        m_pos += size;
+        m_bytesRead += size;
+        return size;
+    }
+    int64_t total = 0;
+    while (total < size) {
+#if defined(_WIN32) || defined(_WIN64)
+        DWORD readSize = 0;
+        const DWORD requestSize = (DWORD)std::min<int64_t>(size - total, READAHEAD_BLOCK_SIZE);
+        if (!ReadFile(m_handle, (uint8_t *)buf + total, requestSize, &readSize, NULL)) {
+            return (total > 0) ? total : -1;
+        }
+#else
+        const auto readSize = ::read(m_fd, (uint8_t *)buf + total, (size_t)(size - total));
+        if (readSize < 0) {
+            if (errno == EINTR) continue;
+            return (total > 0) ? total : -1;
+        }
+#endif
+        if (readSize == 0) {
+            break;
+        }
+        total += readSize;
+    }
+    m_pos += total;
+    m_bytesRead += total;
+    return total;
+}
+
+int64_t CheckBitrateInputFile::seek(int64_t offset, int whence) {
+    int64_t pos = 0;
+    switch (whence) {
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = m_pos + offset; break;
+    case SEEK_END: pos = m_size + offset; break;
+    default: return -1;
+    }
+    if (pos < 0) {
+        return -1;
+    }
+    if (!m_map) {
+#if defined(_WIN32) || defined(_WIN64)
+        LARGE_INTEGER distance;
+        distance.QuadPart = pos;
+        if (!SetFilePointerEx(m_handle, distance, NULL, FILE_BEGIN)) {
+            return -1;
+        }
+#else
+        if (lseek(m_fd, pos, SEEK_SET) < 0) {
+            return -1;
+        }
+#endif
+    }
+    m_pos = pos;
+    return m_pos;
+}
+
+static int avio_read_packet(void *opaque, uint8_t *buf, int buf_size) {
+    auto file = (CheckBitrateInputFile *)opaque;
+    const auto ret = file->read(buf, buf_size);
+    if (ret == 0) {
+        return AVERROR_EOF;
+    }
+    return (ret < 0) ? AVERROR(EIO) : (int)ret;
+}
+
+static int64_t avio_seek_file(void *opaque, int64_t offset, int whence) {
+    auto file = (CheckBitrateInputFile *)opaque;
+    if (whence & AVSEEK_SIZE) {
+        return file->size();
+    }
+    const auto ret = file->seek(offset, whence & ~AVSEEK_FORCE);
+    return (ret < 0) ? AVERROR(EINVAL) : ret;
+}
+
+AVIOContext *CheckBitrateInputFile::createAVIOContext() {
+    if (m_avio) {
+        return m_avio;
+    }
+    const int bufferSize = (m_mode == CB_INPUT_MMAP) ? MMAP_AVIO_BUFFER_SIZE : READAHEAD_BLOCK_SIZE;
+    auto buffer = (unsigned char *)av_malloc(bufferSize);
+    if (buffer == nullptr) {
+        return nullptr;
+    }
+    //follow時はseekできないようにして、libavformatがファイルの終端を読みに行かないようにする
+    m_avio = avio_alloc_context(buffer, bufferSize, 0, this, avio_read_packet, nullptr, (m_followTimeout > 0.0) ? nullptr : avio_seek_file);
+    if (m_avio == nullptr) {
+        av_free(buffer);
+    }
+    return m_avio;
+}
@@ -0,0 +1,126 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __CHECK_BITRATE_INPUT_H__
+#define __CHECK_BITRATE_INPUT_H__
+
+#include <cstdint>
+#include "rgy_osdep.h"
+#include "rgy_tchar.h"
+
+struct AVIOContext;
+
+enum CheckBitrateInputMode {
+    CB_INPUT_AVIO,      // libavformatのfileプロトコルをそのまま使用
+    CB_INPUT_MMAP,      // ファイル全体をメモリマップして読み込む
+    CB_INPUT_READAHEAD, // 大きなブロック単位でシーケンシャルに読み込む
+};
+
+static const struct {
+    CheckBitrateInputMode mode;
+    const TCHAR *name;
+} CB_INPUT_MODE_NAMES[] = {
+    { CB_INPUT_AVIO,      _T("avio") },
+    { CB_INPUT_MMAP,      _T("mmap") },
+    { CB_INPUT_READAHEAD, _T("readahead") },
+};
+
+static inline const TCHAR *get_input_mode_name(CheckBitrateInputMode mode) {
+    for (const auto& m : CB_INPUT_MODE_NAMES) {
+        if (m.mode == mode) return m.name;
+    }
+    return _T("unknown");
+}
+
+// ローカルファイルの読み込み
+// libavformatにはcreateAVIOContext()で作成したAVIOContextを渡して使用する
+class CheckBitrateInputFile {
+public:
+    static const int READAHEAD_BLOCK_SIZE = 4 * 1024 * 1024;
+    static const int MMAP_AVIO_BUFFER_SIZE = 1024 * 1024;
+    static const int FOLLOW_POLL_INTERVAL_MS = 500; // follow時にファイルサイズを確認する間隔
+
+    CheckBitrateInputFile();
+    ~CheckBitrateInputFile();
+
+    // mmapに失敗した場合はreadaheadに切り替える
+    int open(const tstring& filename, CheckBitrateInputMode mode);
+    void close();
+    // 書き込み中のファイルを読み込む場合に使用する
+    // ファイルの終端に達したら、ファイルが大きくなるのをidleTimeoutSec秒まで待つ
+    // 先頭からのシーケンシャルな読み込みのみとなり、createAVIOContext()はseekできないAVIOContextを返す
+    // mmapでは使用できない
+    void setFollow(double idleTimeoutSec);
+
+    // 読み込んだバイト数を返す (EOFで0, エラーで負)
+    int64_t read(void *buf, int64_t size);
+    // whenceはSEEK_SET/SEEK_CUR/SEEK_END
+    int64_t seek(int64_t offset, int whence);
+    int64_t tell() const { return m_pos; }
+    int64_t size() const { return m_size; }
+    CheckBitrateInputMode mode() const { return m_mode; }
+    // mmapの場合はファイル全体の先頭ポインタ、それ以外はnullptr
+    const uint8_t *data() const { return m_map; }
+    // mmapの場合にoffsetからsize分を直接参照する (読み込んだバイト数に加算する)
+    const uint8_t *mapped(int64_t offset, int64_t size) {
+        if (m_map == nullptr || offset < 0 || offset + size > m_size) return nullptr;
+        m_bytesRead += size;
+        return m_map + offset;
+    }
+    // 実際にファイルから読み込んだバイト数 (速度計測用)
+    uint64_t bytesRead() const { return m_bytesRead; }
+
+    // 呼び出し元のAVFormatContextを閉じた後、このクラスの破棄時に解放される
+    AVIOContext *createAVIOContext();
+private:
+    int openFile(const tstring& filename);
+    // ファイルサイズを更新する
+    int updateSize();
+    // ファイルが大きくなるのを待つ (タイムアウトした場合はfalse)
+    bool waitForGrowth();
+    int mapFile();
+    void unmapFile();
+
+    CheckBitrateInputMode m_mode;
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE m_handle;
+    HANDLE m_mapping;
+#else
+    int m_fd;
+    int m_inotify; // follow時にファイルの変更を待つ
+#endif
+    tstring m_filename;
+    double m_followTimeout; // 0以下の場合はfollowしない
+    const uint8_t *m_map;
+    int64_t m_size;
+    int64_t m_pos;
+    uint64_t m_bytesRead;
+    AVIOContext *m_avio;
+};
+
+#endif //__CHECK_BITRATE_INPUT_H__
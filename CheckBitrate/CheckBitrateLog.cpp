@@ -0,0 +1,167 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstdarg>
+#include <vector>
+#include "rgy_util.h"
+#include "CheckBitrateLog.h"
+#pragma warning (push)
+#pragma warning (disable: 4244)
+#pragma warning (disable: 4819)
+extern "C" {
+#include <libavutil/avutil.h>
+}
+#pragma warning (pop)
+
+static thread_local CheckBitrateLog *g_currentLog = nullptr;
+
+CheckBitrateLog::CheckBitrateLog(bool buffered) : m_buffered(buffered), m_bufMutex(), m_buf() {
+}
+
+CheckBitrateLog::~CheckBitrateLog() {
+    flush();
+}
+
+void CheckBitrateLog::write(const TCHAR *format, ...) {
+    va_list args;
+    va_start(args, format);
+    const int len = _vsctprintf(format, args) + 1;
+    va_end(args);
+    if (len <= 1) {
+        return;
+    }
+
+    std::vector<TCHAR> buffer(len, 0);
+    va_start(args, format);
+    _vstprintf_s(buffer.data(), len, format, args);
+    va_end(args);
+
+    if (m_buffered) {
+        std::lock_guard<std::mutex> lock(m_bufMutex);
+        m_buf += buffer.data();
+    } else {
+        std::lock_guard<std::mutex> lock(outputMutex());
+        _ftprintf(stderr, _T("%s"), buffer.data());
+    }
+}
+
+void CheckBitrateLog::progress(const TCHAR *format, ...) {
+    if (m_buffered) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    const int len = _vsctprintf(format, args) + 1;
+    va_end(args);
+    if (len <= 1) {
+        return;
+    }
+
+    std::vector<TCHAR> buffer(len, 0);
+    va_start(args, format);
+    _vstprintf_s(buffer.data(), len, format, args);
+    va_end(args);
+
+    std::lock_guard<std::mutex> lock(outputMutex());
+    _ftprintf(stderr, _T("%s"), buffer.data());
+}
+
+void CheckBitrateLog::flush() {
+    std::lock_guard<std::mutex> bufLock(m_bufMutex);
+    if (m_buf.length() == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(outputMutex());
+    _ftprintf(stderr, _T("%s"), m_buf.c_str());
+    fflush(stderr);
+    m_buf.clear();
+}
+
+void CheckBitrateLog::append(CheckBitrateLog& other) {
+    tstring buf;
+    {
+        std::lock_guard<std::mutex> lock(other.m_bufMutex);
+        buf.swap(other.m_buf);
+    }
+    if (buf.length() > 0) {
+        write(_T("%s"), buf.c_str());
+    }
+}
+
+std::mutex& CheckBitrateLog::outputMutex() {
+    static std::mutex mtx;
+    return mtx;
+}
+
+CheckBitrateLog *CheckBitrateLog::current() {
+    return g_currentLog;
+}
+
+void CheckBitrateLog::setCurrent(CheckBitrateLog *log) {
+    g_currentLog = log;
+}
+
+static void av_log_callback(void *ptr, int level, const char *fmt, va_list vl) {
+    if (level > av_log_get_level()) {
+        return;
+    }
+    auto log = CheckBitrateLog::current();
+    if (log == nullptr || !log->buffered()) {
+        std::lock_guard<std::mutex> lock(CheckBitrateLog::outputMutex());
+        av_log_default_callback(ptr, level, fmt, vl);
+        return;
+    }
+    static thread_local int print_prefix = 1;
+    char line[1024];
+    av_log_format_line2(ptr, level, fmt, vl, line, sizeof(line), &print_prefix);
+    log->write(_T("%s"), char_to_tstring(line).c_str());
+}
+
+void CheckBitrateLog::initAVLog(int level) {
+    // av_log_set_levelはグローバルな設定なので、スレッドを起動する前に一度だけ設定する
+    av_log_set_level(level);
+    av_log_set_callback(av_log_callback);
+}
+
+CheckBitrateReadProgress::CheckBitrateReadProgress(CheckBitrateLog& log, uint64_t filesize, uint32_t checkInterval) :
+    m_log(log), m_filesize(filesize), m_checkInterval(std::max(checkInterval, 1u)), m_count(0), m_lastProgress(0.0), m_tmUpdate(std::chrono::system_clock::now()) {
+}
+
+void CheckBitrateReadProgress::update(int64_t pos) {
+    if ((++m_count % m_checkInterval) != 0 || m_filesize == 0 || m_log.buffered()) {
+        return;
+    }
+    auto tmnow = std::chrono::system_clock::now();
+    if (tmnow - m_tmUpdate > std::chrono::milliseconds(500)) {
+        const double progress = pos * 100.0 / (double)m_filesize;
+        if (progress > m_lastProgress) {
+            m_tmUpdate = tmnow;
+            m_log.progress(_T("reading input file %.2f%%  \r"), progress);
+            m_lastProgress = progress;
+        }
+    }
+}
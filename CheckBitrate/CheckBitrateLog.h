@@ -0,0 +1,93 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __CHECK_BITRATE_LOG_H__
+#define __CHECK_BITRATE_LOG_H__
+
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include "rgy_tchar.h"
+
+// ファイルごとのログ出力
+// bufferedの場合はメッセージをため込んでおき、flush()でまとめてstderrに出力する
+// (並列処理時に複数ファイルのログが混ざらないようにするため)
+// 1ファイルの処理でも読み込みスレッドと集計スレッドから書き込む場合があるので、ため込む際も排他する
+class CheckBitrateLog {
+public:
+    CheckBitrateLog(bool buffered = false);
+    ~CheckBitrateLog();
+
+    void write(const TCHAR *format, ...);
+    // 進捗表示 (bufferedの場合は表示しない)
+    void progress(const TCHAR *format, ...);
+    void flush();
+    // otherにため込んだメッセージを、このログに書き込む
+    void append(CheckBitrateLog& other);
+    bool buffered() const { return m_buffered; }
+
+    // libavのログをこのスレッドで処理中のCheckBitrateLogに振り分ける
+    static void initAVLog(int level);
+    static CheckBitrateLog *current();
+    static void setCurrent(CheckBitrateLog *log);
+    // stderrへの出力を排他する
+    static std::mutex& outputMutex();
+private:
+    bool m_buffered;
+    std::mutex m_bufMutex;
+    tstring m_buf;
+};
+
+// スコープの間、このスレッドで処理中のCheckBitrateLogを切り替える
+// (タスクの実行中に別のファイルのタスクを実行する場合があるので、終了時に元に戻す)
+class CheckBitrateLogScope {
+public:
+    CheckBitrateLogScope(CheckBitrateLog *log) : m_prev(CheckBitrateLog::current()) { CheckBitrateLog::setCurrent(log); }
+    ~CheckBitrateLogScope() { CheckBitrateLog::setCurrent(m_prev); }
+    CheckBitrateLogScope(const CheckBitrateLogScope&) = delete;
+    CheckBitrateLogScope& operator=(const CheckBitrateLogScope&) = delete;
+private:
+    CheckBitrateLog *m_prev;
+};
+
+// 入力ファイルの読み込みの進捗表示
+// update()は頻繁に呼んでもよいが、時刻の確認はcheckInterval回ごと、表示は一定間隔ごとに行う
+class CheckBitrateReadProgress {
+public:
+    CheckBitrateReadProgress(CheckBitrateLog& log, uint64_t filesize, uint32_t checkInterval = 1000);
+    void update(int64_t pos);
+private:
+    CheckBitrateLog& m_log;
+    uint64_t m_filesize;
+    uint32_t m_checkInterval;
+    uint32_t m_count;
+    double m_lastProgress;
+    std::chrono::system_clock::time_point m_tmUpdate;
+};
+
+#endif //__CHECK_BITRATE_LOG_H__
@@ -0,0 +1,472 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#include <cstring>
+#include <algorithm>
+#include "rgy_util.h"
+#include "CheckBitrateMKV.h"
+#include "CheckBitrateInput.h"
+#include "CheckBitrateLog.h"
+#pragma warning (push)
+#pragma warning (disable: 4244)
+#pragma warning (disable: 4819)
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+#pragma warning (pop)
+
+enum : uint32_t {
+    MKV_ID_EBML            = 0x1A45DFA3,
+    MKV_ID_SEGMENT         = 0x18538067,
+    MKV_ID_INFO            = 0x1549A966,
+    MKV_ID_TIMECODE_SCALE  = 0x2AD7B1,
+    MKV_ID_DURATION        = 0x4489,
+    MKV_ID_TRACKS          = 0x1654AE6B,
+    MKV_ID_TRACK_ENTRY     = 0xAE,
+    MKV_ID_TRACK_NUMBER    = 0xD7,
+    MKV_ID_TRACK_TYPE      = 0x83,
+    MKV_ID_DEFAULT_DURATION = 0x23E383,
+    MKV_ID_CLUSTER         = 0x1F43B675,
+    MKV_ID_CLUSTER_TIMECODE = 0xE7,
+    MKV_ID_SIMPLE_BLOCK    = 0xA3,
+    MKV_ID_BLOCK_GROUP     = 0xA0,
+    MKV_ID_BLOCK           = 0xA1,
+    MKV_ID_REFERENCE_BLOCK = 0xFB,
+};
+
+static const int MKV_TRACK_TYPE_VIDEO = 1;
+static const int MKV_BLOCK_HEADER_READ_SIZE = 256; // ブロックヘッダ(+lacingヘッダ)として最初に読み込むサイズ
+static const int64_t MKV_MAX_HEADER_ELEMENT_SIZE = 64 * 1024 * 1024; // Info/Tracksとして許容する最大サイズ
+
+// EBMLの可変長整数の長さ (先頭バイトから判定、不正な場合は0)
+static inline int ebml_vint_length(uint8_t first, int maxLength) {
+    for (int i = 0; i < maxLength; i++) {
+        if (first & (0x80 >> i)) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// EBMLの可変長整数を読み込む (読み込んだバイト数を返す、失敗時は0)
+// マーカービットを除いた値を返し、すべて1の場合はunknownにtrueを設定する
+static int ebml_read_vint(const uint8_t *ptr, const uint8_t *fin, uint64_t& value, bool *unknown = nullptr) {
+    if (ptr >= fin) {
+        return 0;
+    }
+    const int len = ebml_vint_length(ptr[0], 8);
+    if (len == 0 || fin - ptr < len) {
+        return 0;
+    }
+    value = ptr[0] & (0xff >> len);
+    bool allOnes = value == (uint64_t)(0xff >> len);
+    for (int i = 1; i < len; i++) {
+        value = (value << 8) | ptr[i];
+        allOnes &= ptr[i] == 0xff;
+    }
+    if (unknown) {
+        *unknown = allOnes;
+    }
+    return len;
+}
+
+static uint64_t ebml_read_uint(const uint8_t *ptr, int64_t size) {
+    uint64_t value = 0;
+    for (int64_t i = 0; i < std::min<int64_t>(size, 8); i++) {
+        value = (value << 8) | ptr[i];
+    }
+    return value;
+}
+
+static double ebml_read_float(const uint8_t *ptr, int64_t size) {
+    if (size == 4) {
+        const uint32_t u = (uint32_t)ebml_read_uint(ptr, size);
+        float f;
+        memcpy(&f, &u, sizeof(f));
+        return f;
+    } else if (size == 8) {
+        const uint64_t u = ebml_read_uint(ptr, size);
+        double d;
+        memcpy(&d, &u, sizeof(d));
+        return d;
+    }
+    return 0.0;
+}
+
+// バッファ中の子要素を順に取り出す
+static bool ebml_next_element(const uint8_t *& ptr, const uint8_t *fin, uint32_t& id, const uint8_t *& data, int64_t& size) {
+    if (ptr >= fin) {
+        return false;
+    }
+    const int idLen = ebml_vint_length(ptr[0], 4);
+    if (idLen == 0 || fin - ptr < idLen) {
+        return false;
+    }
+    id = 0;
+    for (int i = 0; i < idLen; i++) {
+        id = (id << 8) | ptr[i];
+    }
+    uint64_t elemSize = 0;
+    bool unknown = false;
+    const int sizeLen = ebml_read_vint(ptr + idLen, fin, elemSize, &unknown);
+    if (sizeLen == 0) {
+        return false;
+    }
+    data = ptr + idLen + sizeLen;
+    size = (unknown) ? fin - data : (int64_t)std::min<uint64_t>(elemSize, fin - data);
+    ptr = data + size;
+    return true;
+}
+
+CheckBitrateMKVReader::CheckBitrateMKVReader() :
+    m_file(nullptr),
+    m_streamHandlers(nullptr),
+    m_tracks(),
+    m_timecodeScale(1000000),
+    m_duration(0.0),
+    m_clusterTimecode(0),
+    m_laceErrors(0) {
+}
+
+CheckBitrateMKVReader::~CheckBitrateMKVReader() {
+}
+
+bool CheckBitrateMKVReader::probe(const uint8_t *data, size_t size) {
+    return size >= 4 && readUB32(data) == MKV_ID_EBML;
+}
+
+CheckBitrateMKVReader::Track *CheckBitrateMKVReader::findTrack(uint64_t trackNumber) {
+    for (auto& track : m_tracks) {
+        if (track.trackNumber == trackNumber) {
+            return &track;
+        }
+    }
+    return nullptr;
+}
+
+bool CheckBitrateMKVReader::readElementHeader(int64_t pos, uint32_t& id, int64_t& size, int& headerSize) {
+    uint8_t header[12];
+    if (m_file->seek(pos, SEEK_SET) < 0) {
+        return false;
+    }
+    const int64_t readSize = m_file->read(header, std::min<int64_t>(sizeof(header), m_file->size() - pos));
+    if (readSize <= 0) {
+        return false;
+    }
+    const int idLen = ebml_vint_length(header[0], 4);
+    if (idLen == 0 || readSize < idLen) {
+        return false;
+    }
+    id = 0;
+    for (int i = 0; i < idLen; i++) {
+        id = (id << 8) | header[i];
+    }
+    uint64_t elemSize = 0;
+    bool unknown = false;
+    const int sizeLen = ebml_read_vint(header + idLen, header + readSize, elemSize, &unknown);
+    if (sizeLen == 0) {
+        return false;
+    }
+    headerSize = idLen + sizeLen;
+    size = (unknown) ? EBML_UNKNOWN_SIZE : (int64_t)std::min<uint64_t>(elemSize, INT64_MAX);
+    return true;
+}
+
+bool CheckBitrateMKVReader::readPayload(int64_t pos, int64_t size, std::vector<uint8_t>& buffer) {
+    buffer.resize((size_t)size);
+    return m_file->seek(pos, SEEK_SET) >= 0 && m_file->read(buffer.data(), size) == size;
+}
+
+void CheckBitrateMKVReader::parseInfo(const uint8_t *data, int64_t size) {
+    const uint8_t *ptr = data, *elem = nullptr;
+    uint32_t id = 0;
+    int64_t elemSize = 0;
+    while (ebml_next_element(ptr, data + size, id, elem, elemSize)) {
+        switch (id) {
+        case MKV_ID_TIMECODE_SCALE: m_timecodeScale = ebml_read_uint(elem, elemSize); break;
+        case MKV_ID_DURATION:       m_duration = ebml_read_float(elem, elemSize); break;
+        default: break;
+        }
+    }
+    if (m_timecodeScale == 0) {
+        m_timecodeScale = 1000000;
+    }
+}
+
+void CheckBitrateMKVReader::parseTracks(const uint8_t *data, int64_t size) {
+    const uint8_t *ptr = data, *elem = nullptr;
+    uint32_t id = 0;
+    int64_t elemSize = 0;
+    while (ebml_next_element(ptr, data + size, id, elem, elemSize)) {
+        if (id != MKV_ID_TRACK_ENTRY) {
+            continue;
+        }
+        Track track;
+        track.streamIndex = (int)m_tracks.size();
+        const uint8_t *ptrEntry = elem, *child = nullptr;
+        uint32_t childId = 0;
+        int64_t childSize = 0;
+        while (ebml_next_element(ptrEntry, elem + elemSize, childId, child, childSize)) {
+            switch (childId) {
+            case MKV_ID_TRACK_NUMBER:     track.trackNumber = ebml_read_uint(child, childSize); break;
+            case MKV_ID_TRACK_TYPE:       track.isVideo = ebml_read_uint(child, childSize) == MKV_TRACK_TYPE_VIDEO; break;
+            case MKV_ID_DEFAULT_DURATION: track.defaultDuration = ebml_read_uint(child, childSize); break;
+            default: break;
+            }
+        }
+        m_tracks.push_back(track);
+    }
+}
+
+int CheckBitrateMKVReader::parseBlockGroup(int64_t pos, int64_t size) {
+    //ReferenceBlockがなければキーフレーム
+    int64_t blockPos = -1, blockSize = 0;
+    bool hasReference = false;
+    for (int64_t childPos = pos; childPos < pos + size; ) {
+        uint32_t id = 0;
+        int64_t childSize = 0;
+        int headerSize = 0;
+        if (!readElementHeader(childPos, id, childSize, headerSize) || childSize == EBML_UNKNOWN_SIZE) {
+            break;
+        }
+        if (id == MKV_ID_BLOCK) {
+            blockPos = childPos + headerSize;
+            blockSize = childSize;
+        } else if (id == MKV_ID_REFERENCE_BLOCK) {
+            hasReference = true;
+        }
+        childPos += headerSize + childSize;
+    }
+    if (blockPos < 0) {
+        return 0;
+    }
+    return parseBlock(blockPos, blockSize, false, !hasReference);
+}
+
+int CheckBitrateMKVReader::parseBlock(int64_t pos, int64_t size, bool simpleBlock, bool keyframe) {
+    std::vector<uint8_t> header;
+    const int64_t firstReadSize = std::min<int64_t>(size, MKV_BLOCK_HEADER_READ_SIZE);
+    if (!readPayload(pos, firstReadSize, header)) {
+        return 1;
+    }
+    uint64_t trackNumber = 0;
+    int offset = ebml_read_vint(header.data(), header.data() + header.size(), trackNumber);
+    if (offset == 0 || (int64_t)header.size() < offset + 3) {
+        return 1;
+    }
+    auto track = findTrack(trackNumber);
+    if (track == nullptr || !track->isVideo) {
+        return 0;
+    }
+    const int16_t blockTimecode = (int16_t)readUB16(header.data() + offset);
+    const uint8_t flags = header[offset + 2];
+    offset += 3;
+    if (simpleBlock) {
+        keyframe = (flags & 0x80) != 0;
+    }
+
+    std::vector<int64_t> frameSizes;
+    const int lacing = (flags >> 1) & 0x03;
+    if (lacing == 0) {
+        frameSizes.push_back(size - offset);
+    } else {
+        //lacingヘッダが最初に読み込んだ範囲に収まらない場合は追加で読み込む
+        auto ensure = [&](int64_t required) {
+            if (required <= (int64_t)header.size()) {
+                return true;
+            }
+            if (required > size) {
+                return false;
+            }
+            return readPayload(pos, std::min<int64_t>(size, required + MKV_BLOCK_HEADER_READ_SIZE), header);
+        };
+        if (!ensure(offset + 1)) {
+            m_laceErrors++;
+            return 0;
+        }
+        const int frameCount = header[offset] + 1;
+        offset++;
+        int64_t sizeSum = 0;
+        bool error = false;
+        if (lacing == 1) { // Xiph lacing
+            for (int i = 0; i < frameCount - 1 && !error; i++) {
+                int64_t frameSize = 0;
+                for (;;) {
+                    if (!ensure(offset + 1)) {
+                        error = true;
+                        break;
+                    }
+                    const uint8_t value = header[offset++];
+                    frameSize += value;
+                    if (value != 255) break;
+                }
+                frameSizes.push_back(frameSize);
+                sizeSum += frameSize;
+            }
+        } else if (lacing == 3) { // EBML lacing
+            int64_t frameSize = 0;
+            for (int i = 0; i < frameCount - 1 && !error; i++) {
+                uint64_t value = 0;
+                if (!ensure(std::min<int64_t>(offset + 8, size))) {
+                    error = true;
+                    break;
+                }
+                const int len = ebml_read_vint(header.data() + offset, header.data() + header.size(), value);
+                if (len == 0) {
+                    error = true;
+                    break;
+                }
+                offset += len;
+                if (i == 0) {
+                    frameSize = (int64_t)value;
+                } else {
+                    //2フレーム目以降は前のフレームとの差分 (符号付き)
+                    frameSize += (int64_t)value - ((1LL << (7 * len - 1)) - 1);
+                }
+                frameSizes.push_back(frameSize);
+                sizeSum += frameSize;
+            }
+        } else { // fixed-size lacing
+            const int64_t frameSize = (size - offset) / frameCount;
+            frameSizes.assign(frameCount - 1, frameSize);
+            sizeSum = frameSize * (frameCount - 1);
+        }
+        const int64_t lastFrameSize = size - offset - sizeSum;
+        if (error || lastFrameSize < 0 || std::any_of(frameSizes.begin(), frameSizes.end(), [](int64_t s) { return s < 0; })) {
+            //サイズが取得できない場合はブロック全体を1フレームとして扱う
+            m_laceErrors++;
+            frameSizes.assign(1, size);
+        } else {
+            frameSizes.push_back(lastFrameSize);
+        }
+    }
+
+    //lacingされた2フレーム目以降のtimestampはDefaultDurationから推定し、わからなければ補間に任せる
+    auto& frames = (*m_streamHandlers)[track->streamIndex]->frameDataList;
+    const int64_t timecode = m_clusterTimecode + blockTimecode;
+    for (size_t i = 0; i < frameSizes.size(); i++) {
+        int64_t pts = timecode;
+        if (i > 0) {
+            pts = (track->defaultDuration > 0) ? timecode + (int64_t)((double)(i * track->defaultDuration) / m_timecodeScale + 0.5) : AV_NOPTS_VALUE;
+        }
+        frames.push_back(FrameData(pts, AV_NOPTS_VALUE, (int)frameSizes[i], (keyframe) ? AV_PKT_FLAG_KEY : 0));
+    }
+    return 0;
+}
+
+int CheckBitrateMKVReader::read(CheckBitrateInputFile *file, StreamHandlerList& streamHandlers, double& durationSec, CheckBitrateLog& log) {
+    m_file = file;
+    m_streamHandlers = &streamHandlers;
+    const int64_t filesize = file->size();
+    CheckBitrateReadProgress progress(log, filesize);
+    std::vector<uint8_t> buffer;
+    bool tracksFound = false;
+    int64_t blockCount = 0;
+
+    //Segment, Clusterの中には入り込み、それ以外の要素はサイズ分読み飛ばす
+    //(サイズ不明のSegment/Clusterにも対応するため、階層を持たずに順に走査する)
+    for (int64_t pos = 0; pos < filesize; ) {
+        uint32_t id = 0;
+        int64_t size = 0;
+        int headerSize = 0;
+        if (!readElementHeader(pos, id, size, headerSize)) {
+            //途中で切れたファイルや、末尾が0で埋められたファイルでは、それまでに読んだフレームを使う
+            log.write(_T("failed to read element header at %lld, stop parsing.\n"), (long long)pos);
+            break;
+        }
+        progress.update(pos);
+        if (id == MKV_ID_SEGMENT || id == MKV_ID_CLUSTER) {
+            pos += headerSize;
+            continue;
+        }
+        if (size == EBML_UNKNOWN_SIZE) {
+            log.write(_T("element with unknown size found at %lld, stop parsing.\n"), (long long)pos);
+            break;
+        }
+        const int64_t payloadPos = pos + headerSize;
+        size = std::min(size, filesize - payloadPos);
+        switch (id) {
+        case MKV_ID_INFO:
+        case MKV_ID_TRACKS:
+            if (size > MKV_MAX_HEADER_ELEMENT_SIZE || !readPayload(payloadPos, size, buffer)) {
+                log.write(_T("failed to read %s element.\n"), (id == MKV_ID_INFO) ? _T("Info") : _T("Tracks"));
+                return 1;
+            }
+            if (id == MKV_ID_INFO) {
+                parseInfo(buffer.data(), size);
+            } else if (!tracksFound) {
+                parseTracks(buffer.data(), size);
+                tracksFound = true;
+                streamHandlers.clear();
+                streamHandlers.resize(m_tracks.size());
+                const AVRational timebase = av_make_q((int)m_timecodeScale, 1000000000);
+                for (const auto& track : m_tracks) {
+                    if (track.isVideo) {
+                        const AVRational frameRate = (track.defaultDuration > 0 && track.defaultDuration <= INT_MAX)
+                            ? av_make_q(1000000000, (int)track.defaultDuration) : av_make_q(0, 1);
+                        streamHandlers[track.streamIndex] = std::make_unique<StreamHandler>(track.streamIndex, timebase, frameRate);
+                    }
+                }
+            }
+            break;
+        case MKV_ID_CLUSTER_TIMECODE:
+            if (readPayload(payloadPos, std::min<int64_t>(size, 8), buffer)) {
+                m_clusterTimecode = (int64_t)ebml_read_uint(buffer.data(), buffer.size());
+            }
+            break;
+        case MKV_ID_SIMPLE_BLOCK:
+            blockCount += (tracksFound) ? 1 : 0;
+            if (tracksFound && parseBlock(payloadPos, size, true, false)) {
+                log.write(_T("invalid block found at %lld.\n"), (long long)pos);
+            }
+            break;
+        case MKV_ID_BLOCK_GROUP:
+            blockCount += (tracksFound) ? 1 : 0;
+            if (tracksFound && parseBlockGroup(payloadPos, size)) {
+                log.write(_T("invalid block found at %lld.\n"), (long long)pos);
+            }
+            break;
+        default:
+            break;
+        }
+        pos = payloadPos + size;
+    }
+    if (!tracksFound) {
+        log.write(_T("Tracks element not found.\n"));
+        return 1;
+    }
+    if (blockCount == 0) {
+        log.write(_T("no block found.\n"));
+        return 1;
+    }
+    if (m_laceErrors > 0) {
+        log.write(_T("failed to parse lacing of %llu blocks.\n"), (unsigned long long)m_laceErrors);
+    }
+    durationSec = m_duration * m_timecodeScale * 1e-9;
+    return 0;
+}
@@ -0,0 +1,83 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __CHECK_BITRATE_MKV_H__
+#define __CHECK_BITRATE_MKV_H__
+
+#include <cstdint>
+#include <vector>
+#include "CheckBitrateStream.h"
+
+class CheckBitrateLog;
+class CheckBitrateInputFile;
+
+// libavformatを使わずにMatroska/WebMのEBML要素を走査し、
+// Cluster/SimpleBlock/BlockGroupのヘッダのみから映像のフレーム情報を取得する
+// ブロックの中身は読まずにseekで読み飛ばす
+class CheckBitrateMKVReader {
+public:
+    static const int64_t EBML_UNKNOWN_SIZE = -1;
+
+    CheckBitrateMKVReader();
+    ~CheckBitrateMKVReader();
+
+    // Matroska/WebMかどうかを判定する
+    static bool probe(const uint8_t *data, size_t size);
+
+    // ファイル全体を走査し、映像のフレーム情報をstreamHandlersに格納する
+    int read(CheckBitrateInputFile *file, StreamHandlerList& streamHandlers, double& durationSec, CheckBitrateLog& log);
+protected:
+    struct Track {
+        uint64_t trackNumber;
+        int streamIndex;
+        bool isVideo;
+        uint64_t defaultDuration; // ns
+
+        Track() : trackNumber(0), streamIndex(-1), isVideo(false), defaultDuration(0) {};
+    };
+
+    // posから要素のIDとサイズを読み込む (サイズ不明の場合はsizeにEBML_UNKNOWN_SIZE)
+    bool readElementHeader(int64_t pos, uint32_t& id, int64_t& size, int& headerSize);
+    bool readPayload(int64_t pos, int64_t size, std::vector<uint8_t>& buffer);
+    void parseInfo(const uint8_t *data, int64_t size);
+    void parseTracks(const uint8_t *data, int64_t size);
+    int parseBlockGroup(int64_t pos, int64_t size);
+    int parseBlock(int64_t pos, int64_t size, bool simpleBlock, bool keyframe);
+    Track *findTrack(uint64_t trackNumber);
+
+    CheckBitrateInputFile *m_file;
+    StreamHandlerList *m_streamHandlers;
+    std::vector<Track> m_tracks;
+    uint64_t m_timecodeScale;   // ns
+    double m_duration;          // timecodeScale単位
+    int64_t m_clusterTimecode;
+    uint64_t m_laceErrors;
+};
+
+#endif //__CHECK_BITRATE_MKV_H__
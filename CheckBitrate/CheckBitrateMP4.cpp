@@ -0,0 +1,457 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include "rgy_util.h"
+#include "CheckBitrateMP4.h"
+#include "CheckBitrateInput.h"
+#include "CheckBitrateLog.h"
+#pragma warning (push)
+#pragma warning (disable: 4244)
+#pragma warning (disable: 4819)
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+#pragma warning (pop)
+
+static constexpr uint32_t mp4_fourcc(const char *str) {
+    return ((uint32_t)(uint8_t)str[0] << 24) | ((uint32_t)(uint8_t)str[1] << 16) | ((uint32_t)(uint8_t)str[2] << 8) | (uint32_t)(uint8_t)str[3];
+}
+
+static const int64_t MP4_MAX_HEADER_BOX_SIZE = 1024 * 1024 * 1024; // moov/moofとして許容する最大サイズ
+
+static inline uint64_t readUB64(const uint8_t *ptr) {
+    return ((uint64_t)readUB32(ptr) << 32) | readUB32(ptr + 4);
+}
+
+struct MP4Box {
+    uint32_t type;
+    const uint8_t *data; // ヘッダを除いた中身
+    int64_t size;        // ヘッダを除いたサイズ
+};
+
+// バッファ中のボックスを順に取り出す
+static bool mp4_next_box(const uint8_t *& ptr, const uint8_t *fin, MP4Box& box) {
+    if (fin - ptr < 8) {
+        return false;
+    }
+    int64_t boxSize = readUB32(ptr);
+    int headerSize = 8;
+    box.type = readUB32(ptr + 4);
+    if (boxSize == 1) {
+        if (fin - ptr < 16) {
+            return false;
+        }
+        boxSize = (int64_t)readUB64(ptr + 8);
+        headerSize = 16;
+    } else if (boxSize == 0) {
+        boxSize = fin - ptr;
+    }
+    if (boxSize < headerSize || boxSize > fin - ptr) {
+        return false;
+    }
+    box.data = ptr + headerSize;
+    box.size = boxSize - headerSize;
+    ptr += boxSize;
+    return true;
+}
+
+CheckBitrateMP4Reader::CheckBitrateMP4Reader() :
+    m_tracks(),
+    m_streamHandlers(nullptr),
+    m_headerBytes(0),
+    m_fileSize(0) {
+}
+
+CheckBitrateMP4Reader::~CheckBitrateMP4Reader() {
+}
+
+bool CheckBitrateMP4Reader::probe(const uint8_t *data, size_t size) {
+    if (size < 8) {
+        return false;
+    }
+    switch (readUB32(data + 4)) {
+    case mp4_fourcc("ftyp"):
+    case mp4_fourcc("styp"):
+    case mp4_fourcc("moov"):
+    case mp4_fourcc("mdat"):
+    case mp4_fourcc("wide"):
+    case mp4_fourcc("free"):
+    case mp4_fourcc("skip"):
+    case mp4_fourcc("pnot"):
+        return true;
+    default:
+        return false;
+    }
+}
+
+CheckBitrateMP4Reader::Track *CheckBitrateMP4Reader::findTrack(uint32_t trackId) {
+    for (auto& track : m_tracks) {
+        if (track.trackId == trackId) {
+            return &track;
+        }
+    }
+    return nullptr;
+}
+
+void CheckBitrateMP4Reader::parseMoov(const uint8_t *data, int64_t size) {
+    const uint8_t *ptr = data;
+    MP4Box box;
+    while (mp4_next_box(ptr, data + size, box)) {
+        switch (box.type) {
+        case mp4_fourcc("trak"): parseTrak(box.data, box.size); break;
+        case mp4_fourcc("mvex"): parseMvex(box.data, box.size); break;
+        default: break;
+        }
+    }
+}
+
+void CheckBitrateMP4Reader::parseTrak(const uint8_t *data, int64_t size) {
+    Track track;
+    track.streamIndex = (int)m_tracks.size();
+    const uint8_t *stblData = nullptr;
+    int64_t stblSize = 0;
+
+    //trak -> tkhd, mdia -> mdhd, hdlr, minf -> stbl
+    const uint8_t *ptr = data;
+    MP4Box box;
+    while (mp4_next_box(ptr, data + size, box)) {
+        if (box.type == mp4_fourcc("tkhd") && box.size >= 24) {
+            track.trackId = readUB32(box.data + ((box.data[0] == 1) ? 20 : 12));
+        } else if (box.type == mp4_fourcc("mdia")) {
+            const uint8_t *ptrMdia = box.data;
+            MP4Box boxMdia;
+            while (mp4_next_box(ptrMdia, box.data + box.size, boxMdia)) {
+                if (boxMdia.type == mp4_fourcc("mdhd") && boxMdia.size >= 24) {
+                    if (boxMdia.data[0] == 1) {
+                        if (boxMdia.size >= 36) {
+                            track.timescale = readUB32(boxMdia.data + 20);
+                            track.duration = readUB64(boxMdia.data + 24);
+                        }
+                    } else {
+                        track.timescale = readUB32(boxMdia.data + 12);
+                        track.duration = readUB32(boxMdia.data + 16);
+                    }
+                } else if (boxMdia.type == mp4_fourcc("hdlr") && boxMdia.size >= 12) {
+                    track.isVideo = readUB32(boxMdia.data + 8) == mp4_fourcc("vide");
+                } else if (boxMdia.type == mp4_fourcc("minf")) {
+                    const uint8_t *ptrMinf = boxMdia.data;
+                    MP4Box boxMinf;
+                    while (mp4_next_box(ptrMinf, boxMdia.data + boxMdia.size, boxMinf)) {
+                        if (boxMinf.type == mp4_fourcc("stbl")) {
+                            stblData = boxMinf.data;
+                            stblSize = boxMinf.size;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if (track.isVideo && stblData) {
+        parseStbl(track, stblData, stblSize);
+    }
+    m_tracks.push_back(std::move(track));
+}
+
+void CheckBitrateMP4Reader::parseStbl(Track& track, const uint8_t *data, int64_t size) {
+    const uint8_t *ptr = data;
+    MP4Box box;
+    while (mp4_next_box(ptr, data + size, box)) {
+        const uint8_t *p = box.data;
+        const int64_t boxSize = box.size;
+        switch (box.type) {
+        case mp4_fourcc("stsz"):
+            if (boxSize >= 12) {
+                track.constSampleSize = readUB32(p + 4);
+                track.sampleCount = readUB32(p + 8);
+                if (track.constSampleSize == 0) {
+                    const uint32_t count = (uint32_t)std::min<int64_t>(track.sampleCount, (boxSize - 12) / 4);
+                    track.sampleSizes.resize(count);
+                    for (uint32_t i = 0; i < count; i++) {
+                        track.sampleSizes[i] = readUB32(p + 12 + i * 4);
+                    }
+                    track.sampleCount = count;
+                }
+            }
+            break;
+        case mp4_fourcc("stz2"):
+            if (boxSize >= 12) {
+                const int fieldSize = p[7];
+                const uint32_t sampleCount = readUB32(p + 8);
+                const uint32_t count = (uint32_t)std::min<int64_t>(sampleCount, (fieldSize > 0) ? (boxSize - 12) * 8 / fieldSize : 0);
+                track.constSampleSize = 0;
+                track.sampleSizes.resize(count);
+                for (uint32_t i = 0; i < count; i++) {
+                    switch (fieldSize) {
+                    case 4:  track.sampleSizes[i] = (p[12 + i / 2] >> ((i & 1) ? 0 : 4)) & 0x0f; break;
+                    case 8:  track.sampleSizes[i] = p[12 + i]; break;
+                    case 16: track.sampleSizes[i] = readUB16(p + 12 + i * 2); break;
+                    default: break;
+                    }
+                }
+                track.sampleCount = count;
+            }
+            break;
+        case mp4_fourcc("stts"):
+            if (boxSize >= 8) {
+                const uint32_t count = (uint32_t)std::min<int64_t>(readUB32(p + 4), (boxSize - 8) / 8);
+                track.stts.resize(count);
+                for (uint32_t i = 0; i < count; i++) {
+                    track.stts[i] = std::make_pair(readUB32(p + 8 + i * 8), readUB32(p + 12 + i * 8));
+                }
+            }
+            break;
+        case mp4_fourcc("ctts"):
+            if (boxSize >= 8) {
+                const uint32_t count = (uint32_t)std::min<int64_t>(readUB32(p + 4), (boxSize - 8) / 8);
+                track.ctts.resize(count);
+                for (uint32_t i = 0; i < count; i++) {
+                    //version 0でも負の値を入れているファイルがあるので、常にsignedとして扱う
+                    track.ctts[i] = std::make_pair(readUB32(p + 8 + i * 8), (int32_t)readUB32(p + 12 + i * 8));
+                }
+            }
+            break;
+        case mp4_fourcc("stss"):
+            if (boxSize >= 8) {
+                const uint32_t count = (uint32_t)std::min<int64_t>(readUB32(p + 4), (boxSize - 8) / 4);
+                track.stss.resize(count);
+                for (uint32_t i = 0; i < count; i++) {
+                    track.stss[i] = readUB32(p + 8 + i * 4);
+                }
+                track.hasStss = true;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void CheckBitrateMP4Reader::parseMvex(const uint8_t *data, int64_t size) {
+    const uint8_t *ptr = data;
+    MP4Box box;
+    while (mp4_next_box(ptr, data + size, box)) {
+        if (box.type == mp4_fourcc("trex") && box.size >= 24) {
+            if (auto track = findTrack(readUB32(box.data + 4))) {
+                track->defaultSampleDuration = readUB32(box.data + 12);
+                track->defaultSampleSize = readUB32(box.data + 16);
+                track->defaultSampleFlags = readUB32(box.data + 20);
+            }
+        }
+    }
+}
+
+void CheckBitrateMP4Reader::outputSampleTable(Track& track) {
+    auto& frames = (*m_streamHandlers)[track.streamIndex]->frameDataList;
+    frames.reserve(frames.size() + track.sampleCount);
+
+    int64_t dts = 0;
+    size_t sttsIdx = 0, cttsIdx = 0, stssIdx = 0;
+    uint32_t sttsRemain = (track.stts.size() > 0) ? track.stts[0].first : 0;
+    uint32_t cttsRemain = (track.ctts.size() > 0) ? track.ctts[0].first : 0;
+    for (uint32_t i = 0; i < track.sampleCount; i++) {
+        //sttsが足りない場合は、最後のsample_deltaを使い続ける
+        while (sttsRemain == 0 && sttsIdx + 1 < track.stts.size()) {
+            sttsRemain = track.stts[++sttsIdx].first;
+        }
+        while (cttsRemain == 0 && cttsIdx + 1 < track.ctts.size()) {
+            cttsRemain = track.ctts[++cttsIdx].first;
+        }
+        const int64_t delta = (track.stts.size() > 0) ? track.stts[sttsIdx].second : 0;
+        const int64_t offset = (cttsRemain > 0) ? track.ctts[cttsIdx].second : 0;
+        const int size = (int)((track.constSampleSize) ? track.constSampleSize : track.sampleSizes[i]);
+
+        bool key = !track.hasStss;
+        if (track.hasStss) {
+            while (stssIdx < track.stss.size() && track.stss[stssIdx] < i + 1) {
+                stssIdx++;
+            }
+            key = stssIdx < track.stss.size() && track.stss[stssIdx] == i + 1;
+        }
+        frames.push_back(FrameData(dts + offset, dts, size, (key) ? AV_PKT_FLAG_KEY : 0));
+
+        dts += delta;
+        if (sttsRemain > 0) sttsRemain--;
+        if (cttsRemain > 0) cttsRemain--;
+    }
+    track.nextFragmentDts = dts;
+}
+
+void CheckBitrateMP4Reader::parseMoof(const uint8_t *data, int64_t size) {
+    const uint8_t *ptr = data;
+    MP4Box box;
+    while (mp4_next_box(ptr, data + size, box)) {
+        if (box.type == mp4_fourcc("traf")) {
+            parseTraf(box.data, box.size);
+        }
+    }
+}
+
+void CheckBitrateMP4Reader::parseTraf(const uint8_t *data, int64_t size) {
+    Track *track = nullptr;
+    uint32_t defaultDuration = 0, defaultSize = 0, defaultFlags = 0;
+
+    const uint8_t *ptr = data;
+    MP4Box box;
+    while (mp4_next_box(ptr, data + size, box)) {
+        const uint8_t *p = box.data;
+        if (box.type == mp4_fourcc("tfhd") && box.size >= 8) {
+            const uint32_t flags = readUB32(p) & 0xffffff;
+            track = findTrack(readUB32(p + 4));
+            if (track == nullptr || !track->isVideo) {
+                return;
+            }
+            defaultDuration = track->defaultSampleDuration;
+            defaultSize = track->defaultSampleSize;
+            defaultFlags = track->defaultSampleFlags;
+            int offset = 8;
+            if (flags & 0x01) offset += 8; // base_data_offset
+            if (flags & 0x02) offset += 4; // sample_description_index
+            if ((flags & 0x08) && offset + 4 <= box.size) { defaultDuration = readUB32(p + offset); offset += 4; }
+            if ((flags & 0x10) && offset + 4 <= box.size) { defaultSize = readUB32(p + offset); offset += 4; }
+            if ((flags & 0x20) && offset + 4 <= box.size) { defaultFlags = readUB32(p + offset); offset += 4; }
+        } else if (box.type == mp4_fourcc("tfdt") && track && box.size >= 8) {
+            track->nextFragmentDts = (p[0] == 1 && box.size >= 12) ? (int64_t)readUB64(p + 4) : (int64_t)readUB32(p + 4);
+        } else if (box.type == mp4_fourcc("trun") && track && box.size >= 8) {
+            const uint32_t flags = readUB32(p) & 0xffffff;
+            const uint32_t sampleCount = readUB32(p + 4);
+            int offset = 8;
+            if (flags & 0x001) offset += 4; // data_offset
+            if (offset > box.size) {
+                continue;
+            }
+            uint32_t firstSampleFlags = defaultFlags;
+            bool hasFirstSampleFlags = false;
+            if ((flags & 0x004) && offset + 4 <= box.size) {
+                firstSampleFlags = readUB32(p + offset);
+                hasFirstSampleFlags = true;
+                offset += 4;
+            }
+            const int entrySize = ((flags & 0x100) ? 4 : 0) + ((flags & 0x200) ? 4 : 0) + ((flags & 0x400) ? 4 : 0) + ((flags & 0x800) ? 4 : 0);
+            //サンプルごとの値がない場合は、各サンプルがdefaultSize (0の場合は1byte) としてファイルに収まる数までとする
+            const int64_t maxCount = (entrySize > 0) ? (box.size - offset) / entrySize : m_fileSize / std::max<int64_t>(defaultSize, 1);
+            const uint32_t count = (uint32_t)std::max<int64_t>(std::min<int64_t>(sampleCount, maxCount), 0);
+            auto& frames = (*m_streamHandlers)[track->streamIndex]->frameDataList;
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t duration = defaultDuration, sampleSize = defaultSize;
+                uint32_t sampleFlags = (i == 0 && hasFirstSampleFlags) ? firstSampleFlags : defaultFlags;
+                int64_t cto = 0;
+                if (flags & 0x100) { duration = readUB32(p + offset); offset += 4; }
+                if (flags & 0x200) { sampleSize = readUB32(p + offset); offset += 4; }
+                if (flags & 0x400) { sampleFlags = readUB32(p + offset); offset += 4; }
+                if (flags & 0x800) { cto = (int32_t)readUB32(p + offset); offset += 4; }
+                if (i == 0 && hasFirstSampleFlags) {
+                    sampleFlags = firstSampleFlags;
+                }
+                const bool key = ((sampleFlags >> 16) & 0x01) == 0; // sample_is_non_sync_sample
+                const int64_t dts = track->nextFragmentDts;
+                frames.push_back(FrameData(dts + cto, dts, (int)sampleSize, (key) ? AV_PKT_FLAG_KEY : 0));
+                track->nextFragmentDts += duration;
+            }
+        }
+    }
+}
+
+int CheckBitrateMP4Reader::read(CheckBitrateInputFile *file, StreamHandlerList& streamHandlers, double& durationSec, CheckBitrateLog& log) {
+    m_streamHandlers = &streamHandlers;
+    const int64_t filesize = file->size();
+    m_fileSize = filesize;
+    std::vector<uint8_t> buffer;
+    bool moovFound = false;
+    //トップレベルのボックスを順に見ていき、moov/moof以外は読み飛ばす
+    for (int64_t pos = 0; pos + 8 <= filesize; ) {
+        uint8_t header[16];
+        file->seek(pos, SEEK_SET);
+        const int64_t headerRead = file->read(header, std::min<int64_t>(sizeof(header), filesize - pos));
+        if (headerRead < 8) {
+            break;
+        }
+        int64_t boxSize = readUB32(header);
+        int headerSize = 8;
+        const uint32_t type = readUB32(header + 4);
+        if (boxSize == 1) {
+            if (headerRead < 16) break;
+            boxSize = (int64_t)readUB64(header + 8);
+            headerSize = 16;
+        } else if (boxSize == 0) {
+            boxSize = filesize - pos;
+        }
+        if (boxSize < headerSize) {
+            log.write(_T("invalid box found at %lld.\n"), (long long)pos);
+            break;
+        }
+        if (type == mp4_fourcc("moov") || (type == mp4_fourcc("moof") && moovFound)) {
+            const int64_t dataSize = std::min(boxSize, filesize - pos) - headerSize;
+            if (dataSize > MP4_MAX_HEADER_BOX_SIZE) {
+                log.write(_T("too large box found at %lld.\n"), (long long)pos);
+                return 1;
+            }
+            buffer.resize((size_t)dataSize);
+            file->seek(pos + headerSize, SEEK_SET);
+            if (file->read(buffer.data(), dataSize) != dataSize) {
+                log.write(_T("failed to read input file.\n"));
+                return 1;
+            }
+            m_headerBytes += dataSize;
+            if (type == mp4_fourcc("moov")) {
+                parseMoov(buffer.data(), dataSize);
+                moovFound = true;
+                streamHandlers.clear();
+                streamHandlers.resize(m_tracks.size());
+                for (auto& track : m_tracks) {
+                    //timebaseはAVRationalなので、intに収まらないtimescaleのトラックは使用しない
+                    if (track.isVideo && (track.timescale == 0 || track.timescale > INT_MAX)) {
+                        log.write(_T("invalid timescale %u of track #%d, skipped.\n"), track.timescale, track.streamIndex + 1);
+                        track.isVideo = false;
+                    }
+                    if (track.isVideo) {
+                        streamHandlers[track.streamIndex] = std::make_unique<StreamHandler>(track.streamIndex, av_make_q(1, (int)track.timescale), av_make_q(0, 1));
+                        outputSampleTable(track);
+                    }
+                }
+            } else {
+                parseMoof(buffer.data(), dataSize);
+            }
+        }
+        pos += boxSize;
+    }
+    if (!moovFound) {
+        log.write(_T("moov box not found.\n"));
+        return 1;
+    }
+    durationSec = 0.0;
+    for (const auto& track : m_tracks) {
+        if (track.isVideo && track.timescale > 0) {
+            durationSec = std::max(durationSec, track.duration / (double)track.timescale);
+            durationSec = std::max(durationSec, track.nextFragmentDts / (double)track.timescale);
+        }
+    }
+    return 0;
+}
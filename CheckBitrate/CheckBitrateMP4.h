@@ -0,0 +1,97 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __CHECK_BITRATE_MP4_H__
+#define __CHECK_BITRATE_MP4_H__
+
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include "CheckBitrateStream.h"
+
+class CheckBitrateLog;
+class CheckBitrateInputFile;
+
+// libavformatを使わずにMP4/MOVのボックスを解析し、サンプルテーブル(stsz/stz2, stts, ctts, stss)から
+// 映像のフレーム情報を取得する (mdatの中身は読み込まない)
+// moof/trafによるfragmented MP4 (CMAF) にも対応する
+class CheckBitrateMP4Reader {
+public:
+    CheckBitrateMP4Reader();
+    ~CheckBitrateMP4Reader();
+
+    // MP4/MOVかどうかを判定する
+    static bool probe(const uint8_t *data, size_t size);
+
+    // ファイル全体のボックスを走査し、映像のフレーム情報をstreamHandlersに格納する
+    int read(CheckBitrateInputFile *file, StreamHandlerList& streamHandlers, double& durationSec, CheckBitrateLog& log);
+
+    // ボックスの中身を読み込んだバイト数 (mdatの中身は含まない)
+    uint64_t headerBytes() const { return m_headerBytes; }
+protected:
+    struct Track {
+        uint32_t trackId;
+        int streamIndex;
+        bool isVideo;
+        uint32_t timescale;
+        uint64_t duration;
+        uint32_t sampleCount;
+        uint32_t constSampleSize;                         // stsz: 0でない場合はすべてのサンプルがこのサイズ
+        std::vector<uint32_t> sampleSizes;                // stsz/stz2
+        std::vector<std::pair<uint32_t, uint32_t>> stts;  // sample_count, sample_delta
+        std::vector<std::pair<uint32_t, int32_t>> ctts;   // sample_count, sample_offset
+        std::vector<uint32_t> stss;                       // sync sampleの番号 (1から)
+        bool hasStss;
+        // fragmented MP4 (trex)
+        uint32_t defaultSampleDuration;
+        uint32_t defaultSampleSize;
+        uint32_t defaultSampleFlags;
+        int64_t nextFragmentDts;
+
+        Track() : trackId(0), streamIndex(-1), isVideo(false), timescale(0), duration(0), sampleCount(0), constSampleSize(0),
+            sampleSizes(), stts(), ctts(), stss(), hasStss(false),
+            defaultSampleDuration(0), defaultSampleSize(0), defaultSampleFlags(0), nextFragmentDts(0) {};
+    };
+
+    void parseMoov(const uint8_t *data, int64_t size);
+    void parseTrak(const uint8_t *data, int64_t size);
+    void parseStbl(Track& track, const uint8_t *data, int64_t size);
+    void parseMvex(const uint8_t *data, int64_t size);
+    void parseMoof(const uint8_t *data, int64_t size);
+    void parseTraf(const uint8_t *data, int64_t size);
+    Track *findTrack(uint32_t trackId);
+    void outputSampleTable(Track& track);
+
+    std::vector<Track> m_tracks;
+    StreamHandlerList *m_streamHandlers;
+    uint64_t m_headerBytes;
+    int64_t m_fileSize;
+};
+
+#endif //__CHECK_BITRATE_MP4_H__
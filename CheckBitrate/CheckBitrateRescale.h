@@ -0,0 +1,70 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __CHECK_BITRATE_RESCALE_H__
+#define __CHECK_BITRATE_RESCALE_H__
+
+#include <cstdint>
+#include <algorithm>
+
+// av_rescale(a, j, c) を j = 1, 2, 3, ... の順に求める
+// av_rescale (AV_ROUND_NEAR_INF) と同じく sign(a) * floor((|a| * j + c / 2) / c) となるが、
+// フレームごとに除算 (128bit演算を含む) を行わず、商と余りを更新するだけで求める
+class RescaleStep {
+public:
+    RescaleStep(int64_t a, int64_t c) :
+        m_negative(a < 0),
+        m_c(c),
+        m_stepQuot(0),
+        m_stepRem(0),
+        m_quot(0),
+        m_rem(c / 2) {
+        const uint64_t absA = (a < 0) ? (uint64_t)(-std::max(a, -INT64_MAX)) : (uint64_t)a;
+        m_stepQuot = (int64_t)(absA / (uint64_t)c);
+        m_stepRem = (int64_t)(absA % (uint64_t)c);
+    }
+    int64_t next() {
+        m_quot += m_stepQuot;
+        m_rem += m_stepRem;
+        if (m_rem >= m_c) {
+            m_quot++;
+            m_rem -= m_c;
+        }
+        return (m_negative) ? -m_quot : m_quot;
+    }
+private:
+    bool m_negative;
+    int64_t m_c;
+    int64_t m_stepQuot;
+    int64_t m_stepRem;
+    int64_t m_quot;
+    int64_t m_rem;
+};
+
+#endif //__CHECK_BITRATE_RESCALE_H__
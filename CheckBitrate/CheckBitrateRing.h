@@ -0,0 +1,142 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __CHECK_BITRATE_RING_H__
+#define __CHECK_BITRATE_RING_H__
+
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+// 1つのスレッドからpush、別の1つのスレッドからpopする固定長のリングバッファ (ロックなし)
+// - 読み込み位置と書き込み位置はそれぞれのスレッドのみが更新し、相手の位置はキャッシュしておいて
+//   満杯/空に見えた場合のみ読み直す
+// - 満杯/空の場合はしばらくspinしてからyield、それでも進まない場合はsleepして待つ
+// - producerはclose()で終了を通知し、consumerのpop()はデータがなくなった後にfalseを返す
+template<typename T>
+class CheckBitrateSPSCRing {
+public:
+    static const int SPIN_COUNT = 64;
+    static const int YIELD_COUNT = 64;
+
+    explicit CheckBitrateSPSCRing(size_t capacity) :
+        m_buffer(roundUpPow2(capacity)), m_mask(m_buffer.size() - 1),
+        m_head(0), m_tailCache(0), m_emptyWaits(0),
+        m_tail(0), m_headCache(0), m_fullWaits(0),
+        m_closed(false) {};
+    CheckBitrateSPSCRing(const CheckBitrateSPSCRing&) = delete;
+    CheckBitrateSPSCRing& operator=(const CheckBitrateSPSCRing&) = delete;
+
+    size_t capacity() const { return m_buffer.size(); }
+
+    // producer
+    bool tryPush(const T& value) {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_headCache >= m_buffer.size()) {
+            m_headCache = m_head.load(std::memory_order_acquire);
+            if (tail - m_headCache >= m_buffer.size()) {
+                return false;
+            }
+        }
+        m_buffer[tail & m_mask] = value;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+    void push(const T& value) {
+        for (int i = 0; !tryPush(value); i++) {
+            if (i == 0) m_fullWaits++;
+            wait(i);
+        }
+    }
+    void close() {
+        m_closed.store(true, std::memory_order_release);
+    }
+    // 満杯で待った回数 (producerのみ参照する)
+    uint64_t fullWaits() const { return m_fullWaits; }
+
+    // consumer
+    bool tryPop(T& value) {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tailCache) {
+            m_tailCache = m_tail.load(std::memory_order_acquire);
+            if (head == m_tailCache) {
+                return false;
+            }
+        }
+        value = m_buffer[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    bool pop(T& value) {
+        for (int i = 0; !tryPop(value); i++) {
+            //close()の前のpushは、closeを確認した後に読み直せば必ず見える
+            if (m_closed.load(std::memory_order_acquire)) {
+                return tryPop(value);
+            }
+            if (i == 0) m_emptyWaits++;
+            wait(i);
+        }
+        return true;
+    }
+    // 空で待った回数 (consumerのみ参照する)
+    uint64_t emptyWaits() const { return m_emptyWaits; }
+private:
+    static size_t roundUpPow2(size_t value) {
+        size_t size = 2;
+        while (size < value) {
+            size <<= 1;
+        }
+        return size;
+    }
+    static void wait(int count) {
+        if (count < SPIN_COUNT) {
+            return;
+        } else if (count < SPIN_COUNT + YIELD_COUNT) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+    std::vector<T> m_buffer;
+    const size_t m_mask;
+    // consumer側 (producer側と別のキャッシュラインに置く)
+    alignas(64) std::atomic<size_t> m_head;
+    size_t m_tailCache;
+    uint64_t m_emptyWaits;
+    // producer側
+    alignas(64) std::atomic<size_t> m_tail;
+    size_t m_headCache;
+    uint64_t m_fullWaits;
+    alignas(64) std::atomic<bool> m_closed;
+};
+
+#endif //__CHECK_BITRATE_RING_H__
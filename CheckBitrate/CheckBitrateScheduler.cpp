@@ -0,0 +1,239 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+
+#include <algorithm>
+#include "CheckBitrateScheduler.h"
+
+// 実行中のワーカースレッドのスケジューラと番号
+static thread_local const CheckBitrateTaskScheduler *g_workerScheduler = nullptr;
+static thread_local int g_workerIndex = -1;
+
+CheckBitrateTaskScheduler::CheckBitrateTaskScheduler(int threads) :
+    m_queues(),
+    m_workers(),
+    m_queued(0),
+    m_nextQueue(0),
+    m_steals(0),
+    m_stop(false),
+    m_mutex(),
+    m_cond() {
+    threads = std::max(threads, 1);
+    for (int i = 0; i < threads; i++) {
+        m_queues.push_back(std::make_unique<WorkerQueue>());
+    }
+    for (int i = 0; i < threads; i++) {
+        m_workers.push_back(std::thread(&CheckBitrateTaskScheduler::workerMain, this, i));
+    }
+}
+
+CheckBitrateTaskScheduler::~CheckBitrateTaskScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    for (auto& th : m_workers) {
+        th.join();
+    }
+}
+
+int CheckBitrateTaskScheduler::currentWorker() const {
+    return (g_workerScheduler == this) ? g_workerIndex : -1;
+}
+
+void CheckBitrateTaskScheduler::submit(CheckBitrateTaskGroup& group, Task task) {
+    group.m_pending++;
+    const int worker = currentWorker();
+    const int index = (worker >= 0) ? worker : (int)(m_nextQueue++ % m_queues.size());
+    {
+        std::lock_guard<std::mutex> lock(m_queues[index]->mutex);
+        m_queues[index]->tasks.push_back({ std::move(task), &group });
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queued++;
+    }
+    m_cond.notify_one();
+    //wait()中のワーカーが、このタスクを実行できるように起こす
+    {
+        std::lock_guard<std::mutex> lock(group.m_mutex);
+        group.m_queued++;
+    }
+    group.m_cond.notify_all();
+}
+
+bool CheckBitrateTaskScheduler::popLocal(int index, TaskItem& item) {
+    auto& queue = *m_queues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+        return false;
+    }
+    item = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    m_queued--;
+    return true;
+}
+
+bool CheckBitrateTaskScheduler::steal(int index, TaskItem& item) {
+    const int count = (int)m_queues.size();
+    for (int i = 1; i < count; i++) {
+        auto& queue = *m_queues[(index + i) % count];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        item = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        m_queued--;
+        m_steals++;
+        return true;
+    }
+    return false;
+}
+
+bool CheckBitrateTaskScheduler::findTask(int index, TaskItem& item) {
+    return popLocal(index, item) || steal(index, item);
+}
+
+bool CheckBitrateTaskScheduler::findGroupTask(int index, const CheckBitrateTaskGroup& group, TaskItem& item) {
+    const int count = (int)m_queues.size();
+    for (int i = 0; i < count; i++) {
+        auto& queue = *m_queues[(index + i) % count];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        //自分のdequeは末尾から、他のワーカーのdequeは先頭から探す
+        auto match = [&group](const TaskItem& task) { return task.group == &group; };
+        auto it = queue.tasks.end();
+        if (i == 0) {
+            auto rit = std::find_if(queue.tasks.rbegin(), queue.tasks.rend(), match);
+            if (rit != queue.tasks.rend()) {
+                it = std::prev(rit.base());
+            }
+        } else {
+            it = std::find_if(queue.tasks.begin(), queue.tasks.end(), match);
+        }
+        if (it == queue.tasks.end()) {
+            continue;
+        }
+        item = std::move(*it);
+        queue.tasks.erase(it);
+        m_queued--;
+        if (i > 0) {
+            m_steals++;
+        }
+        return true;
+    }
+    return false;
+}
+
+void CheckBitrateTaskScheduler::execute(TaskItem& item) {
+    {
+        std::lock_guard<std::mutex> lock(item.group->m_mutex);
+        item.group->m_queued--;
+    }
+    item.task();
+    item.task = nullptr;
+    //wait()はm_mutexを取得してから完了を確認するので、通知を終えるまでgroupは破棄されない
+    auto group = item.group;
+    std::lock_guard<std::mutex> lock(group->m_mutex);
+    if (--group->m_pending == 0) {
+        group->m_cond.notify_all();
+    }
+}
+
+void CheckBitrateTaskScheduler::workerMain(int index) {
+    g_workerScheduler = this;
+    g_workerIndex = index;
+    TaskItem item;
+    for (;;) {
+        if (findTask(index, item)) {
+            execute(item);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]() { return m_stop || m_queued > 0; });
+        if (m_stop && m_queued == 0) {
+            break;
+        }
+    }
+}
+
+void CheckBitrateTaskScheduler::wait(CheckBitrateTaskGroup& group) {
+    const int worker = currentWorker();
+    if (worker < 0) {
+        std::unique_lock<std::mutex> lock(group.m_mutex);
+        group.m_cond.wait(lock, [&group]() { return group.done(); });
+        return;
+    }
+    //ワーカースレッドでは、待っている間も同じグループのタスクを実行する
+    //(他のグループのタスクを実行すると、待っているタスクの中で別のファイルの処理全体を実行することになり、
+    // スタックが深くなるうえ、メモリの見積もりの外で処理が進んでしまう)
+    TaskItem item;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(group.m_mutex);
+            if (group.done()) {
+                return;
+            }
+        }
+        if (findGroupTask(worker, group, item)) {
+            execute(item);
+            continue;
+        }
+        //他のワーカーが実行中のタスクから同じグループにタスクが追加されるか、グループのタスクがすべて完了するまで待つ
+        std::unique_lock<std::mutex> lock(group.m_mutex);
+        group.m_cond.wait(lock, [&group]() { return group.done() || group.m_queued > 0; });
+    }
+}
+
+CheckBitrateMemoryBudget::CheckBitrateMemoryBudget(int64_t budget) :
+    m_budget(budget),
+    m_used(0),
+    m_peak(0) {
+}
+
+bool CheckBitrateMemoryBudget::tryAcquire(int64_t bytes) {
+    int64_t used = m_used.load(std::memory_order_relaxed);
+    do {
+        if (m_budget > 0 && used > 0 && used + bytes > m_budget) {
+            return false;
+        }
+    } while (!m_used.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+    updatePeak(used + bytes);
+    return true;
+}
+
+void CheckBitrateMemoryBudget::add(int64_t bytes) {
+    updatePeak(m_used.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+}
+
+void CheckBitrateMemoryBudget::updatePeak(int64_t used) {
+    int64_t peak = m_peak.load(std::memory_order_relaxed);
+    while (used > peak && !m_peak.compare_exchange_weak(peak, used, std::memory_order_relaxed)) {
+    }
+}
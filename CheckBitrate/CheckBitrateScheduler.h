@@ -0,0 +1,126 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __CHECK_BITRATE_SCHEDULER_H__
+#define __CHECK_BITRATE_SCHEDULER_H__
+
+#include <cstdint>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+
+// タスクの完了を待つためのグループ
+// タスクの中から同じグループにタスクを追加してもよい
+class CheckBitrateTaskGroup {
+public:
+    CheckBitrateTaskGroup() : m_pending(0), m_queued(0), m_mutex(), m_cond() {};
+    CheckBitrateTaskGroup(const CheckBitrateTaskGroup&) = delete;
+    CheckBitrateTaskGroup& operator=(const CheckBitrateTaskGroup&) = delete;
+private:
+    friend class CheckBitrateTaskScheduler;
+    // m_mutexを取得して確認する (タスクの完了の通知が終わる前にグループが破棄されないようにする)
+    bool done() const { return m_pending.load(std::memory_order_acquire) == 0; }
+    std::atomic<int> m_pending;
+    int m_queued; // dequeに積まれていて、まだ実行を始めていないタスクの数 (m_mutexで保護する)
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+};
+
+// work stealing によるタスクの実行
+// - ワーカースレッドごとにタスクのdequeを持ち、ワーカースレッドから追加したタスクは自分のdequeの末尾に積む
+// - 自分のdequeは末尾から (直前に追加したタスクから) 取り出し、空の場合は他のワーカーのdequeの先頭から盗む
+// - ワーカースレッド以外から追加したタスクは、各ワーカーのdequeに順に振り分ける
+// - ワーカースレッドでwait()した場合は、待っている間も同じグループのタスクを実行する
+class CheckBitrateTaskScheduler {
+public:
+    using Task = std::function<void()>;
+
+    explicit CheckBitrateTaskScheduler(int threads);
+    ~CheckBitrateTaskScheduler();
+    CheckBitrateTaskScheduler(const CheckBitrateTaskScheduler&) = delete;
+    CheckBitrateTaskScheduler& operator=(const CheckBitrateTaskScheduler&) = delete;
+
+    void submit(CheckBitrateTaskGroup& group, Task task);
+    void wait(CheckBitrateTaskGroup& group);
+    int threads() const { return (int)m_workers.size(); }
+    uint64_t steals() const { return m_steals; }
+private:
+    struct TaskItem {
+        Task task;
+        CheckBitrateTaskGroup *group;
+    };
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<TaskItem> tasks;
+    };
+    void workerMain(int index);
+    bool popLocal(int index, TaskItem& item);
+    bool steal(int index, TaskItem& item);
+    bool findTask(int index, TaskItem& item);
+    // groupのタスクのみを探す (wait()で使用する)
+    bool findGroupTask(int index, const CheckBitrateTaskGroup& group, TaskItem& item);
+    void execute(TaskItem& item);
+    int currentWorker() const;
+
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+    std::vector<std::thread> m_workers;
+    std::atomic<int> m_queued;      // dequeに積まれているタスクの数
+    std::atomic<uint32_t> m_nextQueue;
+    std::atomic<uint64_t> m_steals;
+    std::atomic<bool> m_stop;
+    std::mutex m_mutex;             // 待機中のワーカーを起こす
+    std::condition_variable m_cond;
+};
+
+// 並列に処理するファイルのメモリ使用量 (見積もり) の上限
+// - 見積もりを確保できた場合のみ新たなファイルの処理を開始する
+//   ただし、何も確保していない場合は上限を超えていても確保し、1ファイルずつは必ず処理できるようにする
+// - 処理中に見積もりを実際の量に合わせて増減する (この場合は上限を超えてもよい)
+class CheckBitrateMemoryBudget {
+public:
+    explicit CheckBitrateMemoryBudget(int64_t budget); // 0の場合は上限なし
+    bool tryAcquire(int64_t bytes);
+    void add(int64_t bytes); // 負の場合は解放
+    int64_t budget() const { return m_budget; }
+    int64_t used() const { return m_used.load(std::memory_order_relaxed); }
+    int64_t peak() const { return m_peak.load(std::memory_order_relaxed); }
+private:
+    void updatePeak(int64_t used);
+
+    int64_t m_budget;
+    std::atomic<int64_t> m_used;
+    std::atomic<int64_t> m_peak;
+};
+
+#endif //__CHECK_BITRATE_SCHEDULER_H__
@@ -0,0 +1,110 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#include <algorithm>
+#include "CheckBitrateStream.h"
+#pragma warning (push)
+#pragma warning (disable: 4244)
+#pragma warning (disable: 4819)
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+#pragma warning (pop)
+
+FrameDataList::FrameDataList() : m_chunks(), m_tsEscape(), m_size(0) {
+}
+
+void FrameDataList::push_back(const FrameData& frame) {
+    const size_t chunkIdx = m_size / CHUNK_FRAMES;
+    const size_t idx = m_size % CHUNK_FRAMES;
+    if (chunkIdx >= m_chunks.size()) {
+        m_chunks.push_back(std::make_unique<Chunk>());
+        m_chunks.back()->baseTs = AV_NOPTS_VALUE;
+    }
+    auto chunk = m_chunks[chunkIdx].get();
+
+    const int64_t ts = (frame.dts != AV_NOPTS_VALUE) ? frame.dts : frame.pts;
+    if (ts != AV_NOPTS_VALUE && chunk->baseTs == AV_NOPTS_VALUE) {
+        chunk->baseTs = ts;
+    }
+    const int64_t offset = (ts != AV_NOPTS_VALUE) ? ts - chunk->baseTs : 0;
+    if (ts == AV_NOPTS_VALUE || offset <= (int64_t)TS_ESCAPE || offset > (int64_t)INT32_MAX) {
+        chunk->tsOffset[idx] = TS_ESCAPE;
+        m_tsEscape.push_back(std::make_pair(m_size, ts));
+    } else {
+        chunk->tsOffset[idx] = (int32_t)offset;
+    }
+    chunk->size[idx] = (uint32_t)frame.size;
+
+    const uint8_t flags = ((frame.flags & AV_PKT_FLAG_KEY) ? 0x01 : 0x00) | ((frame.flags & AV_PKT_FLAG_CORRUPT) ? 0x02 : 0x00);
+    const int shift = (int)(idx & 3) * 2;
+    chunk->flags[idx >> 2] = (uint8_t)((chunk->flags[idx >> 2] & ~(0x03 << shift)) | (flags << shift));
+    m_size++;
+}
+
+void FrameDataList::append(const FrameDataList& other) {
+    reserve(m_size + other.size());
+    for (const auto frame : other) {
+        push_back(frame);
+    }
+}
+
+void FrameDataList::clear() {
+    m_chunks.clear();
+    m_chunks.shrink_to_fit();
+    m_tsEscape.clear();
+    m_tsEscape.shrink_to_fit();
+    m_size = 0;
+}
+
+void FrameDataList::reserve(size_t frames) {
+    m_chunks.reserve((frames + CHUNK_FRAMES - 1) / CHUNK_FRAMES);
+}
+
+FrameData FrameDataList::operator[](size_t index) const {
+    const auto chunk = m_chunks[index / CHUNK_FRAMES].get();
+    const size_t idx = index % CHUNK_FRAMES;
+    int64_t ts = AV_NOPTS_VALUE;
+    if (chunk->tsOffset[idx] != TS_ESCAPE) {
+        ts = chunk->baseTs + chunk->tsOffset[idx];
+    } else {
+        auto escape = std::lower_bound(m_tsEscape.begin(), m_tsEscape.end(), index, [](const std::pair<size_t, int64_t>& a, size_t b) {
+            return a.first < b;
+        });
+        if (escape != m_tsEscape.end() && escape->first == index) {
+            ts = escape->second;
+        }
+    }
+    const uint8_t flags = (chunk->flags[idx >> 2] >> ((idx & 3) * 2)) & 0x03;
+    return FrameData(ts, ts, (int)chunk->size[idx], ((flags & 0x01) ? AV_PKT_FLAG_KEY : 0) | ((flags & 0x02) ? AV_PKT_FLAG_CORRUPT : 0));
+}
+
+size_t FrameDataList::memoryUsage() const {
+    return m_chunks.capacity() * sizeof(m_chunks[0]) + m_chunks.size() * sizeof(Chunk)
+        + m_tsEscape.capacity() * sizeof(m_tsEscape[0]);
+}
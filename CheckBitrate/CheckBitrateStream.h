@@ -0,0 +1,144 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __CHECK_BITRATE_STREAM_H__
+#define __CHECK_BITRATE_STREAM_H__
+
+#include <cstdint>
+#include <iterator>
+#include <vector>
+#include <memory>
+#pragma warning (push)
+#pragma warning (disable: 4244)
+#pragma warning (disable: 4819)
+extern "C" {
+#include <libavutil/avutil.h>
+}
+#pragma warning (pop)
+
+// --frame-type指定時に、スライスヘッダ等から判定したピクチャタイプ
+enum CheckBitrateFrameType {
+    CB_FRAME_TYPE_UNKNOWN = 0,
+    CB_FRAME_TYPE_I,
+    CB_FRAME_TYPE_P,
+    CB_FRAME_TYPE_B,
+    CB_FRAME_TYPE_COUNT
+};
+
+struct FrameData {
+    int64_t pts;
+    int64_t dts;
+    int size;
+    uint32_t flags;
+    CheckBitrateFrameType frameType;
+    int64_t muxSize; // --mux-bytes指定時の、このフレームから同じストリームの次のフレームまでのファイル上のバイト数
+
+    FrameData() : pts(0), dts(0), size(0), flags(0), frameType(CB_FRAME_TYPE_UNKNOWN), muxSize(0) {};
+    FrameData(int64_t pts_, int64_t dts_, int size_, uint32_t flags_, CheckBitrateFrameType frameType_ = CB_FRAME_TYPE_UNKNOWN, int64_t muxSize_ = 0) :
+        pts(pts_), dts(dts_), size(size_), flags(flags_), frameType(frameType_), muxSize(muxSize_) {};
+};
+
+// フレーム情報を省メモリに保持する (1フレームあたり約8byte)
+// - ptsとdtsは、dts (AV_NOPTS_VALUEの場合はpts) のみを保持し、取り出す際はpts/dtsともにその値とする
+// - timestampはチャンクの先頭のtimestampとの差分をint32_tで保持し、
+//   AV_NOPTS_VALUEや差分がint32_tに収まらない場合は例外テーブルに保持する
+// - flagsはAV_PKT_FLAG_KEYとAV_PKT_FLAG_CORRUPTのみを2bitに詰めて保持する (frameType, muxSizeは保持しない)
+// - CHUNK_FRAMESフレームごとの固定長のチャンク単位で確保し、追加時に既存のフレームをコピーしない
+class FrameDataList {
+public:
+    static const size_t CHUNK_FRAMES = 4096;
+
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = FrameData;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const FrameData *;
+        using reference = FrameData;
+
+        const_iterator(const FrameDataList *list, size_t index) : m_list(list), m_index(index) {};
+        FrameData operator*() const { return (*m_list)[m_index]; }
+        const_iterator& operator++() { m_index++; return *this; }
+        const_iterator operator++(int) { auto tmp = *this; m_index++; return tmp; }
+        bool operator==(const const_iterator& other) const { return m_index == other.m_index; }
+        bool operator!=(const const_iterator& other) const { return m_index != other.m_index; }
+        size_t index() const { return m_index; }
+    private:
+        const FrameDataList *m_list;
+        size_t m_index;
+    };
+
+    FrameDataList();
+    FrameDataList(const FrameDataList&) = delete;
+    FrameDataList& operator=(const FrameDataList&) = delete;
+
+    void push_back(const FrameData& frame);
+    // otherのフレームを末尾に追加する
+    void append(const FrameDataList& other);
+    void clear();
+    // チャンクへのポインタの配列のみを確保する
+    void reserve(size_t frames);
+
+    FrameData operator[](size_t index) const;
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, m_size); }
+
+    // 確保しているメモリ量 (byte)
+    size_t memoryUsage() const;
+    // 1フレームあたりのおおよそのメモリ量 (byte)
+    static size_t bytesPerFrame() { return (sizeof(Chunk) + CHUNK_FRAMES - 1) / CHUNK_FRAMES; }
+private:
+    static const int32_t TS_ESCAPE = INT32_MIN; // 例外テーブルを参照する
+
+    struct Chunk {
+        int64_t baseTs; // チャンクの最初の有効なtimestamp
+        int32_t tsOffset[CHUNK_FRAMES];
+        uint32_t size[CHUNK_FRAMES];
+        uint8_t flags[CHUNK_FRAMES / 4];
+    };
+    std::vector<std::unique_ptr<Chunk>> m_chunks;
+    std::vector<std::pair<size_t, int64_t>> m_tsEscape; // フレーム番号順に並んでいる
+    size_t m_size;
+};
+
+struct StreamHandler {
+    int streamId;
+    AVRational streamTimebase;
+    AVRational avgFrameRate; // timestampが全くない場合に使用する
+    FrameDataList frameDataList;
+
+    StreamHandler(int stream_id, AVRational stream_timebase, AVRational avg_frame_rate) :
+        streamId(stream_id), streamTimebase(stream_timebase), avgFrameRate(avg_frame_rate), frameDataList() {};
+};
+
+using StreamHandlerList = std::vector<std::unique_ptr<StreamHandler>>;
+
+#endif //__CHECK_BITRATE_STREAM_H__
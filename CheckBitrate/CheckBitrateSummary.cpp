@@ -0,0 +1,152 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include "CheckBitrateSummary.h"
+#include "CheckBitrateCsv.h"
+#include "CheckBitrateLog.h"
+#include "rgy_util.h"
+
+static const double SKETCH_RELATIVE_ACCURACY = 0.01;
+static const double SKETCH_MIN_VALUE = 1e-3; // これ以下の値は0として数える
+static const double SKETCH_GAMMA = (1.0 + SKETCH_RELATIVE_ACCURACY) / (1.0 - SKETCH_RELATIVE_ACCURACY);
+static const double SKETCH_LOG_GAMMA = std::log(SKETCH_GAMMA);
+
+QuantileSketch::QuantileSketch() :
+    m_buckets(SKETCH_BUCKETS, 0),
+    m_zeroCount(0),
+    m_count(0),
+    m_sum(0.0),
+    m_min(0.0),
+    m_max(0.0) {
+}
+
+// bucket iには、(SKETCH_MIN_VALUE * γ^(i-1), SKETCH_MIN_VALUE * γ^i] の値を数える
+// 範囲を超える値は最後のbucketに数える
+void QuantileSketch::add(double value) {
+    if (m_count == 0) {
+        m_min = value;
+        m_max = value;
+    } else {
+        m_min = std::min(m_min, value);
+        m_max = std::max(m_max, value);
+    }
+    m_count++;
+    m_sum += value;
+    if (value <= SKETCH_MIN_VALUE) {
+        m_zeroCount++;
+        return;
+    }
+    const int index = (int)std::ceil(std::log(value / SKETCH_MIN_VALUE) / SKETCH_LOG_GAMMA);
+    m_buckets[clamp(index, 0, SKETCH_BUCKETS - 1)]++;
+}
+
+void QuantileSketch::merge(const QuantileSketch& other) {
+    if (other.m_count == 0) {
+        return;
+    }
+    if (m_count == 0) {
+        m_min = other.m_min;
+        m_max = other.m_max;
+    } else {
+        m_min = std::min(m_min, other.m_min);
+        m_max = std::max(m_max, other.m_max);
+    }
+    for (int i = 0; i < SKETCH_BUCKETS; i++) {
+        m_buckets[i] += other.m_buckets[i];
+    }
+    m_zeroCount += other.m_zeroCount;
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+}
+
+double QuantileSketch::avg() const {
+    return (m_count > 0) ? m_sum / m_count : 0.0;
+}
+
+double QuantileSketch::quantile(double q) const {
+    if (m_count == 0) {
+        return 0.0;
+    }
+    if (q >= 1.0) {
+        return m_max;
+    }
+    const double rank = clamp(q, 0.0, 1.0) * (m_count - 1);
+    uint64_t cumulative = m_zeroCount;
+    if (rank < cumulative) {
+        return m_min;
+    }
+    for (int i = 0; i < SKETCH_BUCKETS; i++) {
+        cumulative += m_buckets[i];
+        if (rank < cumulative) {
+            // bucketの範囲のうち、相対誤差が最小となる値
+            const double value = SKETCH_MIN_VALUE * 2.0 * std::pow(SKETCH_GAMMA, i) / (SKETCH_GAMMA + 1.0);
+            return clamp(value, m_min, m_max);
+        }
+    }
+    return m_max;
+}
+
+void BitrateSummary::merge(const BitrateSummary& other) {
+    frameSize.merge(other.frameSize);
+    for (const auto& it : other.bitrate) {
+        bitrate[it.first].merge(it.second);
+    }
+}
+
+static void writeSummaryRow(CheckBitrateCsvWriter& csv, const tstring& name, const QuantileSketch& sketch) {
+    csv.write(name);
+    csv.put(',');
+    csv.writeUInt(sketch.count());
+    for (const auto value : { sketch.avg(), sketch.quantile(0.50), sketch.quantile(0.95), sketch.quantile(0.99), sketch.max() }) {
+        csv.put(',');
+        csv.writeFixed(value, 2);
+    }
+    csv.put('\n');
+}
+
+int writeSummary(const tstring& filename, const BitrateSummary& summary, CheckBitrateLog& log) {
+    CheckBitrateCsvWriter csv;
+    if (csv.open(filename)) {
+        log.write(_T("failed to open output file \"%s\"\n"), filename.c_str());
+        return 1;
+    }
+    csv.write(",count,avg,p50,p95,p99,max\n");
+    writeSummaryRow(csv, _T("frame size(byte)"), summary.frameSize);
+    for (const auto& it : summary.bitrate) {
+        writeSummaryRow(csv, strsprintf(_T("bitrate %gs(kbps)"), it.first), it.second);
+    }
+    if (csv.close()) {
+        log.write(_T("failed to write output file \"%s\"\n"), filename.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __CHECK_BITRATE_SUMMARY_H__
+#define __CHECK_BITRATE_SUMMARY_H__
+
+#include <cstdint>
+#include <map>
+#include <vector>
+#include "rgy_tchar.h"
+
+class CheckBitrateLog;
+
+// 値の分布を固定サイズのヒストグラムで保持し、分位点を求める
+// - 対数で等間隔のbucketに数えるので、分位点の相対誤差はSKETCH_RELATIVE_ACCURACY以内となる
+// - bucketの数は固定なので、値の数によらずメモリ使用量は一定
+// - bucketを足し合わせるだけでmergeでき、mergeしても精度は変わらない
+class QuantileSketch {
+public:
+    static const int SKETCH_BUCKETS = 2048;
+
+    QuantileSketch();
+    void add(double value);
+    void merge(const QuantileSketch& other);
+    uint64_t count() const { return m_count; }
+    double avg() const;
+    double max() const { return m_max; }
+    // q: 0～1
+    double quantile(double q) const;
+private:
+    std::vector<uint64_t> m_buckets;
+    uint64_t m_zeroCount; // SKETCH_MIN_VALUE以下の値の数
+    uint64_t m_count;
+    double m_sum;
+    double m_min;
+    double m_max;
+};
+
+// ストリームのフレームサイズと、intervalごとのビットレートの分布
+struct BitrateSummary {
+    QuantileSketch frameSize;
+    std::map<double, QuantileSketch> bitrate; // intervalごと
+
+    BitrateSummary() : frameSize(), bitrate() {};
+    void merge(const BitrateSummary& other);
+};
+
+// 件数・平均・p50/p95/p99・最大をcsvに出力する
+int writeSummary(const tstring& filename, const BitrateSummary& summary, CheckBitrateLog& log);
+
+#endif //__CHECK_BITRATE_SUMMARY_H__
@@ -0,0 +1,841 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#include <cstring>
+#include <algorithm>
+#include <numeric>
+#include <thread>
+#include <atomic>
+#include "rgy_util.h"
+#include "CheckBitrateTS.h"
+#include "CheckBitrateInput.h"
+#include "CheckBitrateLog.h"
+#if defined(_M_IX86) || defined(_M_X64) || defined(__x86_64)
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+#pragma warning (push)
+#pragma warning (disable: 4244)
+#pragma warning (disable: 4819)
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+#pragma warning (pop)
+
+static const uint8_t TS_SYNC_BYTE = 0x47;
+static const int TS_PID_PAT = 0x0000;
+static const int TS_PID_NULL = 0x1fff;
+static const int TS_READ_BLOCK_SIZE = 4 * 1024 * 1024;
+static const int64_t TS_PRESCAN_SIZE = 16 * 1024 * 1024; // 分割読み込み時に、PAT/PMTを探す先頭部分のサイズ
+static const int TS_RESYNC_SIZE = 256 * 1024;             // 分割位置からパケット境界を探す範囲
+static const int TS_RESYNC_PACKETS = 4;                   // パケット境界とみなすのに必要な連続した同期バイトの数
+
+static inline int ts_ctz(uint32_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index = 0;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+static uint32_t ts_crc32(const uint8_t *data, int size) {
+    static const auto table = []() {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i << 24;
+            for (int j = 0; j < 8; j++) {
+                crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : (crc << 1);
+            }
+            t[i] = crc;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xffffffff;
+    for (int i = 0; i < size; i++) {
+        crc = (crc << 8) ^ table[((crc >> 24) ^ data[i]) & 0xff];
+    }
+    return crc;
+}
+
+static inline int64_t ts_parse_timestamp(const uint8_t *ptr) {
+    return ((int64_t)(ptr[0] & 0x0e) << 29)
+        | ((int64_t)ptr[1] << 22)
+        | ((int64_t)(ptr[2] & 0xfe) << 14)
+        | ((int64_t)ptr[3] << 7)
+        | ((int64_t)ptr[4] >> 1);
+}
+
+static bool ts_is_video_stream(int streamType, const uint8_t *desc, int descSize) {
+    switch (streamType) {
+    case 0x01: // MPEG-1 Video
+    case 0x02: // MPEG-2 Video
+    case 0x10: // MPEG-4 Visual
+    case 0x1b: // H.264
+    case 0x20: // H.264 MVC
+    case 0x21: // JPEG 2000
+    case 0x24: // HEVC
+    case 0x33: // VVC
+    case 0x42: // AVS
+    case 0xd1: // Dirac
+    case 0xea: // VC-1
+        return true;
+    case 0x06: // PES private data: registration descriptorで判断する
+        for (int i = 0; i + 2 <= descSize; i += 2 + desc[i + 1]) {
+            if (desc[i] == 0x05 && desc[i + 1] >= 4 && i + 6 <= descSize) {
+                if (memcmp(desc + i + 2, "AV01", 4) == 0
+                    || memcmp(desc + i + 2, "VC-1", 4) == 0) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+CheckBitrateTSReader::CheckBitrateTSReader() :
+    m_packetSize(TS_PACKET_SIZE),
+    m_streamHandlers(nullptr),
+    m_syncOffset(0),
+    m_psi(TS_PID_COUNT),
+    m_pes(TS_PID_COUNT),
+    m_streamIndex(),
+    m_remain(),
+    m_pos(0),
+    m_packetPos(0),
+    m_streamsFixed(false),
+    m_streamsMissed(false),
+    m_corruptPackets(0) {
+    m_psi[TS_PID_PAT] = std::make_unique<PSIState>();
+}
+
+void CheckBitrateTSReader::reset() {
+    for (auto& psi : m_psi) {
+        psi.reset();
+    }
+    for (auto& pes : m_pes) {
+        pes.reset();
+    }
+    m_psi[TS_PID_PAT] = std::make_unique<PSIState>();
+    m_streamIndex.clear();
+    m_remain.clear();
+    m_pos = 0;
+    m_packetPos = 0;
+    m_streamsFixed = false;
+    m_streamsMissed = false;
+    m_corruptPackets = 0;
+}
+
+CheckBitrateTSReader::~CheckBitrateTSReader() {
+}
+
+int CheckBitrateTSReader::probe(const uint8_t *data, size_t size) {
+    static const int PACKET_SIZE_LIST[] = { 188, 192, 204 };
+    static const int PROBE_PACKETS = 8;
+    for (const auto packetSize : PACKET_SIZE_LIST) {
+        for (size_t i = 0; i < (size_t)packetSize && i < size; i++) {
+            if (data[i] != TS_SYNC_BYTE) continue;
+            int count = 0;
+            for (size_t pos = i; pos < size && data[pos] == TS_SYNC_BYTE; pos += packetSize) {
+                count++;
+            }
+            if (count >= PROBE_PACKETS) {
+                return packetSize;
+            }
+        }
+    }
+    return 0;
+}
+
+// 同期バイトを探す
+// 同期バイトの候補が見つかったら、1パケット先も同期バイトになっているかを確認する
+const uint8_t *CheckBitrateTSReader::findSync(const uint8_t *ptr, const uint8_t *fin) const {
+    auto isSync = [fin, packetSize = m_packetSize](const uint8_t *p) {
+        return p + packetSize >= fin || p[packetSize] == TS_SYNC_BYTE;
+    };
+#if defined(_M_IX86) || defined(_M_X64) || defined(__x86_64)
+    const __m128i xSync = _mm_set1_epi8((char)TS_SYNC_BYTE);
+    for (; ptr + 16 <= fin; ptr += 16) {
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)ptr), xSync));
+        while (mask) {
+            const uint8_t *p = ptr + ts_ctz(mask);
+            if (isSync(p)) {
+                return p;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; ptr < fin; ptr++) {
+        if (*ptr == TS_SYNC_BYTE && isSync(ptr)) {
+            return ptr;
+        }
+    }
+    return nullptr;
+}
+
+void CheckBitrateTSReader::parse(const uint8_t *data, size_t size) {
+    const uint8_t *ptr = data;
+    const uint8_t *fin = data + size;
+    //前回の残りがあれば、1パケット分になるまでつなげて処理する
+    if (m_remain.size() > 0) {
+        m_packetPos = m_pos - (int64_t)m_remain.size();
+        const size_t need = std::min((size_t)(m_packetSize - m_remain.size()), size);
+        m_remain.insert(m_remain.end(), ptr, ptr + need);
+        ptr += need;
+        if (m_remain.size() < (size_t)m_packetSize) {
+            m_pos += size;
+            return;
+        }
+        if (m_remain[m_syncOffset] == TS_SYNC_BYTE) {
+            parsePacket(m_remain.data() + m_syncOffset);
+        }
+        m_remain.clear();
+    }
+    while (ptr + m_packetSize <= fin) {
+        if (ptr[m_syncOffset] != TS_SYNC_BYTE) {
+            const uint8_t *sync = findSync(ptr + m_syncOffset, fin);
+            if (sync == nullptr) {
+                ptr = fin;
+                break;
+            }
+            ptr = sync - m_syncOffset;
+            continue;
+        }
+        m_packetPos = m_pos + (ptr - data);
+        parsePacket(ptr + m_syncOffset);
+        ptr += m_packetSize;
+    }
+    m_remain.assign(ptr, fin);
+    m_pos += size;
+}
+
+void CheckBitrateTSReader::parsePacket(const uint8_t *pkt) {
+    const bool tei  = (pkt[1] & 0x80) != 0;
+    const bool pusi = (pkt[1] & 0x40) != 0;
+    const int pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+    const int afc = (pkt[3] >> 4) & 0x03;
+    const int cc = pkt[3] & 0x0f;
+    if (pid == TS_PID_NULL) {
+        return;
+    }
+    auto pes = m_pes[pid].get();
+    if (tei) {
+        m_corruptPackets++;
+        if (pes) {
+            //CCも信用できないので、次のパケットではCCを確認しない (同じエラーを2回数えないようにする)
+            pes->corrupt = true;
+            pes->lastCC = -1;
+            if (pes->leading && pes->leadingFirstCC < 0) {
+                //分割読み込み時も、前の範囲との間でCCを確認しない
+                pes->leadingFirstCC = cc;
+                pes->leadingFirstDiscontinuity = true;
+                pes->leadingFirstPayloadSize = 0;
+            }
+        }
+        return;
+    }
+    int offset = 4;
+    bool randomAccess = false;
+    bool discontinuity = false;
+    if (afc & 0x02) {
+        const int afLength = pkt[4];
+        if (afLength > 0) {
+            discontinuity = (pkt[5] & 0x80) != 0;
+            randomAccess = (pkt[5] & 0x40) != 0;
+        }
+        offset = 5 + afLength;
+    }
+    if ((afc & 0x01) == 0 || offset >= TS_PACKET_SIZE) {
+        return; // payloadなし
+    }
+    const uint8_t *payload = pkt + offset;
+    const int payloadSize = TS_PACKET_SIZE - offset;
+    if (pes) {
+        if (pes->leading && pes->leadingFirstCC < 0) {
+            pes->leadingFirstCC = cc;
+            pes->leadingFirstDiscontinuity = discontinuity;
+            pes->leadingFirstPayloadSize = (pusi) ? 0 : payloadSize;
+        }
+        if (pes->lastCC >= 0 && !discontinuity) {
+            if (cc == pes->lastCC) {
+                return; // 重送パケット
+            }
+            if (cc != ((pes->lastCC + 1) & 0x0f)) {
+                m_corruptPackets++;
+                pes->corrupt = true;
+            }
+        }
+        pes->lastCC = cc;
+        parsePES(*pes, payload, payloadSize, pusi, randomAccess);
+    } else if (auto psi = m_psi[pid].get()) {
+        parsePSI(pid, *psi, payload, payloadSize, pusi);
+    }
+}
+
+void CheckBitrateTSReader::parsePSI(int pid, PSIState& psi, const uint8_t *payload, int payloadSize, bool pusi) {
+    auto parseSection = [this, pid, &psi]() {
+        if (psi.section.size() < 3) {
+            return;
+        }
+        const int sectionSize = 3 + (((psi.section[1] & 0x0f) << 8) | psi.section[2]);
+        if ((int)psi.section.size() < sectionSize) {
+            return;
+        }
+        if (sectionSize > 4 && ts_crc32(psi.section.data(), sectionSize) == 0) {
+            if (pid == TS_PID_PAT) {
+                parsePAT(psi.section.data(), sectionSize);
+            } else {
+                parsePMT(psi.section.data(), sectionSize);
+            }
+        }
+        psi.section.clear();
+    };
+    if (pusi) {
+        const int pointer = payload[0];
+        if (psi.section.size() > 0 && 1 + pointer <= payloadSize) {
+            psi.section.insert(psi.section.end(), payload + 1, payload + 1 + pointer);
+            parseSection();
+        }
+        psi.section.clear();
+        if (1 + pointer >= payloadSize) {
+            return;
+        }
+        psi.section.insert(psi.section.end(), payload + 1 + pointer, payload + payloadSize);
+    } else {
+        if (psi.section.size() == 0) {
+            return;
+        }
+        psi.section.insert(psi.section.end(), payload, payload + payloadSize);
+    }
+    parseSection();
+}
+
+void CheckBitrateTSReader::parsePAT(const uint8_t *section, int sectionSize) {
+    if (section[0] != 0x00 || sectionSize < 12) {
+        return;
+    }
+    for (int i = 8; i + 4 <= sectionSize - 4; i += 4) {
+        const int programNumber = (section[i] << 8) | section[i + 1];
+        const int pid = ((section[i + 2] & 0x1f) << 8) | section[i + 3];
+        if (programNumber == 0) {
+            continue; // NIT
+        }
+        if (!m_psi[pid] && !m_pes[pid]) {
+            m_psi[pid] = std::make_unique<PSIState>();
+        }
+    }
+}
+
+void CheckBitrateTSReader::parsePMT(const uint8_t *section, int sectionSize) {
+    if (section[0] != 0x02 || sectionSize < 16) {
+        return;
+    }
+    const int programInfoLength = ((section[10] & 0x0f) << 8) | section[11];
+    for (int i = 12 + programInfoLength; i + 5 <= sectionSize - 4; ) {
+        const int streamType = section[i];
+        const int pid = ((section[i + 1] & 0x1f) << 8) | section[i + 2];
+        const int esInfoLength = ((section[i + 3] & 0x0f) << 8) | section[i + 4];
+        const uint8_t *desc = section + i + 5;
+        const int descSize = std::min(esInfoLength, sectionSize - 4 - (i + 5));
+        i += 5 + esInfoLength;
+
+        if (m_streamsFixed) {
+            //分割読み込み時は新たなPIDを追加せず、見つかったことのみを記録する
+            if (!m_pes[pid] && ts_is_video_stream(streamType, desc, descSize)) {
+                m_streamsMissed = true;
+            }
+            continue;
+        }
+        const int streamIndex = getStreamIndex(pid);
+        if (m_pes[pid] || !ts_is_video_stream(streamType, desc, descSize)) {
+            continue;
+        }
+        auto pes = std::make_unique<PESState>();
+        pes->streamIndex = streamIndex;
+        m_pes[pid] = std::move(pes);
+        if (m_streamHandlers) {
+            if ((int)m_streamHandlers->size() <= streamIndex) {
+                m_streamHandlers->resize(streamIndex + 1);
+            }
+            if (!(*m_streamHandlers)[streamIndex]) {
+                (*m_streamHandlers)[streamIndex] = std::make_unique<StreamHandler>(streamIndex, av_make_q(1, TS_TIMEBASE), av_make_q(0, 1));
+            }
+        }
+    }
+}
+
+int CheckBitrateTSReader::getStreamIndex(int pid) {
+    auto it = m_streamIndex.find(pid);
+    if (it != m_streamIndex.end()) {
+        return it->second;
+    }
+    const int index = (int)m_streamIndex.size();
+    m_streamIndex[pid] = index;
+    return index;
+}
+
+void CheckBitrateTSReader::parsePES(PESState& pes, const uint8_t *payload, int payloadSize, bool pusi, bool randomAccess) {
+    if (pusi) {
+        if (pes.started) {
+            outputPES(pes);
+        }
+        if (pes.leading) {
+            pes.leading = false;
+            pes.leadingCorrupt = pes.corrupt;
+        }
+        pes.started = true;
+        pes.startOffset = m_packetPos;
+        pes.corrupt = false;
+        pes.headerParsed = false;
+        pes.header.clear();
+        pes.flags = (randomAccess) ? AV_PKT_FLAG_KEY : 0;
+        pes.pts = AV_NOPTS_VALUE;
+        pes.dts = AV_NOPTS_VALUE;
+        pes.size = 0;
+    }
+    if (!pes.started) {
+        if (pes.leading) {
+            //前の範囲のPESの続き (ヘッダが途中で分割されている場合に備え、PESヘッダの最大長までは中身も保持する)
+            const int copySize = std::min(payloadSize, std::max(9 + 255 - (int)pes.leadingHead.size(), 0));
+            pes.leadingHead.insert(pes.leadingHead.end(), payload, payload + copySize);
+            pes.leadingSize += payloadSize;
+        }
+        return;
+    }
+    //PESヘッダを集める (通常は1パケットに収まる)
+    while (!pes.headerParsed && payloadSize > 0) {
+        const int needed = (pes.header.size() >= 9) ? 9 + pes.header[8] : 9;
+        const int copySize = std::min(needed - (int)pes.header.size(), payloadSize);
+        pes.header.insert(pes.header.end(), payload, payload + copySize);
+        payload += copySize;
+        payloadSize -= copySize;
+        if ((int)pes.header.size() == needed && needed > 9) {
+            parsePESHeader(pes);
+        } else if (pes.header.size() == 9 && pes.header[8] == 0) {
+            parsePESHeader(pes);
+        }
+    }
+    pes.size += payloadSize;
+}
+
+void CheckBitrateTSReader::parsePESHeader(PESState& pes) {
+    const auto& header = pes.header;
+    pes.headerParsed = true;
+    if (header[0] != 0x00 || header[1] != 0x00 || header[2] != 0x01) {
+        pes.corrupt = true;
+        return;
+    }
+    const int ptsDtsFlags = header[7] >> 6;
+    const int headerDataLength = header[8];
+    if ((ptsDtsFlags & 0x02) && headerDataLength >= 5) {
+        pes.pts = ts_parse_timestamp(&header[9]);
+        pes.dts = pes.pts;
+    }
+    if (ptsDtsFlags == 0x03 && headerDataLength >= 10) {
+        pes.dts = ts_parse_timestamp(&header[14]);
+    }
+}
+
+void CheckBitrateTSReader::outputPES(PESState& pes) {
+    if (pes.started && pes.headerParsed && !pes.corrupt && pes.size > 0 && m_streamHandlers) {
+        (*m_streamHandlers)[pes.streamIndex]->frameDataList.push_back(FrameData(pes.pts, pes.dts, (int)pes.size, pes.flags));
+        pes.outputOffsets.push_back(pes.startOffset);
+        if ((int)pes.outputOffsets.size() > TS_RESUME_HISTORY) {
+            pes.outputOffsets.pop_front();
+        }
+    }
+    pes.started = false;
+}
+
+void CheckBitrateTSReader::flush() {
+    for (auto& pes : m_pes) {
+        if (pes && pes->started) {
+            outputPES(*pes);
+        }
+    }
+    m_remain.clear();
+}
+
+int CheckBitrateTSReader::probeFile(CheckBitrateInputFile *file, CheckBitrateLog& log) {
+    const int64_t probeSize = std::min<int64_t>(file->size(), 256 * 1024);
+    std::vector<uint8_t> probeBuf;
+    const uint8_t *probeData = file->data();
+    if (probeData == nullptr) {
+        probeBuf.resize((size_t)probeSize);
+        file->seek(0, SEEK_SET);
+        if (file->read(probeBuf.data(), probeSize) != probeSize) {
+            log.write(_T("failed to read input file.\n"));
+            return 1;
+        }
+        probeData = probeBuf.data();
+    }
+    m_packetSize = probe(probeData, (size_t)probeSize);
+    if (m_packetSize == 0) {
+        log.write(_T("input file is not a MPEG-TS.\n"));
+        return 1;
+    }
+    m_syncOffset = (m_packetSize == 192) ? 4 : 0;
+    file->seek(0, SEEK_SET);
+    return 0;
+}
+
+int CheckBitrateTSReader::readRange(CheckBitrateInputFile *file, int64_t start, int64_t end, const std::function<void(int64_t)>& onRead) {
+    std::vector<uint8_t> buffer;
+    const uint8_t *data = file->data();
+    m_pos = start;
+    m_remain.clear();
+    if (data == nullptr) {
+        buffer.resize(TS_READ_BLOCK_SIZE);
+        if (file->seek(start, SEEK_SET) < 0) {
+            return 1;
+        }
+    }
+    for (int64_t pos = start; pos < end; ) {
+        const uint8_t *ptr = nullptr;
+        int64_t size = std::min<int64_t>(TS_READ_BLOCK_SIZE, end - pos);
+        if (data) {
+            ptr = file->mapped(pos, size);
+        } else {
+            ptr = buffer.data();
+            if ((size = file->read(buffer.data(), size)) < 0) {
+                return 1;
+            }
+            if (size == 0) {
+                break;
+            }
+        }
+        parse(ptr, (size_t)size);
+        pos += size;
+        onRead(size);
+    }
+    return 0;
+}
+
+int CheckBitrateTSReader::read(CheckBitrateInputFile *file, StreamHandlerList& streamHandlers, CheckBitrateLog& log) {
+    m_streamHandlers = &streamHandlers;
+    if (probeFile(file, log)) {
+        return 1;
+    }
+    CheckBitrateReadProgress progress(log, file->size(), 1);
+    int64_t pos = 0;
+    if (readRange(file, 0, file->size(), [&](int64_t size) {
+        pos += size;
+        progress.update(pos);
+    })) {
+        log.write(_T("failed to read input file at %lld.\n"), (long long)pos);
+        return 1;
+    }
+    flush();
+    if (m_corruptPackets) {
+        log.write(_T("%llu corrupt packets found in video streams.\n"), (unsigned long long)m_corruptPackets);
+    }
+    return 0;
+}
+
+void CheckBitrateTSReader::copyStreams(const CheckBitrateTSReader& src, StreamHandlerList& streamHandlers) {
+    m_packetSize = src.m_packetSize;
+    m_syncOffset = src.m_syncOffset;
+    m_streamHandlers = &streamHandlers;
+    m_streamIndex = src.m_streamIndex;
+    m_streamsFixed = true;
+    for (int pid = 0; pid < TS_PID_COUNT; pid++) {
+        if (!src.m_pes[pid]) {
+            continue;
+        }
+        const int streamIndex = src.m_pes[pid]->streamIndex;
+        auto pes = std::make_unique<PESState>();
+        pes->streamIndex = streamIndex;
+        pes->leading = true;
+        m_pes[pid] = std::move(pes);
+        if ((int)streamHandlers.size() <= streamIndex) {
+            streamHandlers.resize(streamIndex + 1);
+        }
+        streamHandlers[streamIndex] = std::make_unique<StreamHandler>(streamIndex, av_make_q(1, TS_TIMEBASE), av_make_q(0, 1));
+    }
+}
+
+void CheckBitrateTSReader::joinChunk(CheckBitrateTSReader& next, StreamHandlerList& nextStreamHandlers) {
+    for (int pid = 0; pid < TS_PID_COUNT; pid++) {
+        if (!m_pes[pid] || !next.m_pes[pid]) {
+            continue;
+        }
+        auto& pes = *m_pes[pid];
+        auto& nextPes = *next.m_pes[pid];
+        if (nextPes.leadingFirstCC < 0) {
+            continue; // 次の範囲にはこのPIDのパケットがない
+        }
+        //次の範囲の先頭から最初のPUSIまでを、今のPESの続きとして処理する
+        const bool nextStarted = !nextPes.leading;
+        if (pes.started) {
+            //順に読み込んだ場合と同じく、discontinuity_indicatorがあればCCを確認せず、重送パケットは数えない
+            const bool checkCC = pes.lastCC >= 0 && !nextPes.leadingFirstDiscontinuity;
+            const int skipSize = (checkCC && nextPes.leadingFirstCC == pes.lastCC) ? nextPes.leadingFirstPayloadSize : 0;
+            if (checkCC && nextPes.leadingFirstCC != pes.lastCC && nextPes.leadingFirstCC != ((pes.lastCC + 1) & 0x0f)) {
+                m_corruptPackets++;
+                pes.corrupt = true;
+            }
+            if ((nextStarted) ? nextPes.leadingCorrupt : nextPes.corrupt) {
+                pes.corrupt = true;
+            }
+            const int headSize = (int)nextPes.leadingHead.size();
+            const int headSkip = std::min(skipSize, headSize);
+            parsePES(pes, nextPes.leadingHead.data() + headSkip, headSize - headSkip, false, false);
+            pes.size += nextPes.leadingSize - skipSize - (headSize - headSkip);
+        }
+        pes.lastCC = nextPes.lastCC;
+        if (!nextStarted) {
+            continue;
+        }
+        if (pes.started) {
+            outputPES(pes);
+        }
+        auto& dstFrames = (*m_streamHandlers)[pes.streamIndex]->frameDataList;
+        auto& srcFrames = nextStreamHandlers[nextPes.streamIndex]->frameDataList;
+        dstFrames.append(srcFrames);
+        srcFrames.clear();
+        pes.outputOffsets.insert(pes.outputOffsets.end(), nextPes.outputOffsets.begin(), nextPes.outputOffsets.end());
+        while ((int)pes.outputOffsets.size() > TS_RESUME_HISTORY) {
+            pes.outputOffsets.pop_front();
+        }
+        //次の範囲の最後のPESを引き継ぐ
+        pes.started = nextPes.started;
+        pes.startOffset = nextPes.startOffset;
+        pes.corrupt = nextPes.corrupt;
+        pes.headerParsed = nextPes.headerParsed;
+        pes.flags = nextPes.flags;
+        pes.pts = nextPes.pts;
+        pes.dts = nextPes.dts;
+        pes.size = nextPes.size;
+        pes.header = std::move(nextPes.header);
+    }
+    m_corruptPackets += next.m_corruptPackets;
+}
+
+int CheckBitrateTSReader::readParallel(CheckBitrateInputFile *file, const tstring& filename, int threads, StreamHandlerList& streamHandlers, uint64_t& otherBytesRead, CheckBitrateLog& log) {
+    otherBytesRead = 0;
+    threads = (int)std::min<int64_t>(threads, file->size() / TS_MIN_CHUNK_SIZE);
+    if (threads <= 1) {
+        return read(file, streamHandlers, log);
+    }
+    m_streamHandlers = &streamHandlers;
+    if (probeFile(file, log)) {
+        return 1;
+    }
+
+    //先頭部分のPAT/PMTから映像のPIDを取得し、2番目以降の範囲に引き継ぐ
+    CheckBitrateTSReader prescan;
+    prescan.m_packetSize = m_packetSize;
+    prescan.m_syncOffset = m_syncOffset;
+    if (prescan.readRange(file, 0, std::min(file->size(), TS_PRESCAN_SIZE), [](int64_t) {})
+        || std::none_of(prescan.m_pes.begin(), prescan.m_pes.end(), [](const std::unique_ptr<PESState>& pes) { return (bool)pes; })) {
+        log.write(_T("video stream not found in the first %d MB, reading input file without splitting.\n"), (int)(TS_PRESCAN_SIZE >> 20));
+        return read(file, streamHandlers, log);
+    }
+
+    //分割位置を決め、それぞれパケット境界に合わせる
+    std::vector<int64_t> boundaries(1, 0);
+    std::vector<uint8_t> buffer(TS_RESYNC_SIZE);
+    for (int i = 1; i < threads; i++) {
+        const int64_t pos = file->size() * i / threads;
+        if (file->seek(pos, SEEK_SET) < 0) {
+            continue;
+        }
+        const int64_t readSize = file->read(buffer.data(), (int64_t)buffer.size());
+        const uint8_t *fin = buffer.data() + std::max<int64_t>(readSize, 0);
+        for (const uint8_t *ptr = buffer.data(); ptr + m_packetSize * TS_RESYNC_PACKETS <= fin; ptr++) {
+            bool sync = true;
+            for (int j = 0; j < TS_RESYNC_PACKETS && sync; j++) {
+                sync = ptr[m_syncOffset + j * m_packetSize] == TS_SYNC_BYTE;
+            }
+            if (sync) {
+                const int64_t start = pos + (ptr - buffer.data());
+                if (start > boundaries.back()) {
+                    boundaries.push_back(start);
+                }
+                break;
+            }
+        }
+    }
+    boundaries.push_back(file->size());
+    const int chunkCount = (int)boundaries.size() - 1;
+    file->seek(0, SEEK_SET);
+
+    std::vector<std::unique_ptr<CheckBitrateTSReader>> readers(chunkCount);
+    std::vector<StreamHandlerList> chunkHandlers(chunkCount);
+    std::vector<uint64_t> chunkBytesRead(chunkCount, 0);
+    std::vector<int> results(chunkCount, 0);
+    std::atomic<int64_t> processed(0);
+    std::atomic<int> finished(0);
+    for (int i = 1; i < chunkCount; i++) {
+        readers[i] = std::make_unique<CheckBitrateTSReader>();
+        readers[i]->copyStreams(prescan, chunkHandlers[i]);
+    }
+    std::vector<std::thread> workers;
+    for (int i = 0; i < chunkCount; i++) {
+        workers.push_back(std::thread([&, i]() {
+            auto onRead = [&processed](int64_t size) { processed += size; };
+            if (i == 0) {
+                results[i] = readRange(file, boundaries[i], boundaries[i + 1], onRead);
+            } else {
+                CheckBitrateInputFile chunkFile;
+                if (chunkFile.open(filename, file->mode())) {
+                    results[i] = 1;
+                } else {
+                    results[i] = readers[i]->readRange(&chunkFile, boundaries[i], boundaries[i + 1], onRead);
+                    chunkBytesRead[i] = chunkFile.bytesRead();
+                }
+            }
+            finished++;
+        }));
+    }
+    CheckBitrateReadProgress progress(log, file->size(), 1);
+    while (finished < chunkCount) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        progress.update(processed);
+    }
+    for (auto& th : workers) {
+        th.join();
+    }
+    if (std::any_of(results.begin(), results.end(), [](int ret) { return ret != 0; })) {
+        log.write(_T("failed to read input file.\n"));
+        return 1;
+    }
+    //先頭部分になかった映像のPIDが途中で見つかった場合は、2番目以降の範囲ではそのPIDを読み込んでいないので、
+    //分割せずに先頭から読み直す
+    bool streamsChanged = std::any_of(readers.begin() + 1, readers.end(), [](const std::unique_ptr<CheckBitrateTSReader>& reader) { return reader->m_streamsMissed; });
+    for (int pid = 0; pid < TS_PID_COUNT && !streamsChanged; pid++) {
+        streamsChanged = (bool)m_pes[pid] != (bool)prescan.m_pes[pid];
+    }
+    if (streamsChanged) {
+        log.write(_T("video stream not found in the first %d MB was found, reading input file without splitting.\n"), (int)(TS_PRESCAN_SIZE >> 20));
+        otherBytesRead = std::accumulate(chunkBytesRead.begin(), chunkBytesRead.end(), (uint64_t)0);
+        readers.clear();
+        chunkHandlers.clear();
+        reset();
+        streamHandlers.clear();
+        return read(file, streamHandlers, log);
+    }
+    //範囲の順に結合する
+    for (int i = 1; i < chunkCount; i++) {
+        joinChunk(*readers[i], chunkHandlers[i]);
+        otherBytesRead += chunkBytesRead[i];
+        readers[i].reset();
+        chunkHandlers[i].clear();
+    }
+    flush();
+    log.write(_T("input file was split into %d chunks.\n"), chunkCount);
+    if (m_corruptPackets) {
+        log.write(_T("%llu corrupt packets found in video streams.\n"), (unsigned long long)m_corruptPackets);
+    }
+    return 0;
+}
+
+CheckBitrateTSReader::ResumeInfo CheckBitrateTSReader::resumeInfo() const {
+    ResumeInfo resume;
+    if (m_streamHandlers == nullptr) {
+        return resume;
+    }
+    //各PIDの最後に出力したPESのうち、最も前にある位置から読み直す
+    int64_t offset = -1;
+    for (int pid = 0; pid < TS_PID_COUNT; pid++) {
+        const auto pes = m_pes[pid].get();
+        if (!pes) continue;
+        if (pes->outputOffsets.size() == 0) {
+            if ((*m_streamHandlers)[pes->streamIndex]->frameDataList.size() > 0) {
+                return resume; // 以前の走査で出力したフレームの位置がわからない
+            }
+            continue;
+        }
+        offset = (offset < 0) ? pes->outputOffsets.back() : std::min(offset, pes->outputOffsets.back());
+    }
+    if (offset < 0) {
+        return resume;
+    }
+    for (int pid = 0; pid < TS_PID_COUNT; pid++) {
+        const auto pes = m_pes[pid].get();
+        if (!pes) continue;
+        const auto& offsets = pes->outputOffsets;
+        //保持している開始位置がすべてoffset以降の場合は、それより前のフレームも読み直す必要があるかわからない
+        if (offsets.size() == TS_RESUME_HISTORY && offsets.front() >= offset) {
+            return resume;
+        }
+        const auto dropFrames = (uint64_t)(offsets.end() - std::lower_bound(offsets.begin(), offsets.end(), offset));
+        resume.streams.push_back({ pid, pes->streamIndex, dropFrames });
+    }
+    resume.offset = offset;
+    resume.packetSize = m_packetSize;
+    return resume;
+}
+
+int CheckBitrateTSReader::readResume(CheckBitrateInputFile *file, const ResumeInfo& resume, StreamHandlerList& streamHandlers, CheckBitrateLog& log) {
+    if (resume.offset < 0 || resume.offset > file->size()
+        || (resume.packetSize != 188 && resume.packetSize != 192 && resume.packetSize != 204)) {
+        log.write(_T("invalid resume position.\n"));
+        return 1;
+    }
+    m_packetSize = resume.packetSize;
+    m_syncOffset = (m_packetSize == 192) ? 4 : 0;
+    m_streamHandlers = &streamHandlers;
+    m_streamsFixed = true;
+    //再開位置はPESの先頭なので、PUSIの前のパケットは以前の走査で処理済みのPESの続きとして読み捨てる
+    for (const auto& stream : resume.streams) {
+        if (stream.pid < 0 || stream.pid >= TS_PID_COUNT || stream.streamIndex < 0) {
+            log.write(_T("invalid resume position.\n"));
+            return 1;
+        }
+        m_streamIndex[stream.pid] = stream.streamIndex;
+        auto pes = std::make_unique<PESState>();
+        pes->streamIndex = stream.streamIndex;
+        m_pes[stream.pid] = std::move(pes);
+        if ((int)streamHandlers.size() <= stream.streamIndex) {
+            streamHandlers.resize(stream.streamIndex + 1);
+        }
+        streamHandlers[stream.streamIndex] = std::make_unique<StreamHandler>(stream.streamIndex, av_make_q(1, TS_TIMEBASE), av_make_q(0, 1));
+    }
+    const int64_t readSize = file->size() - resume.offset;
+    CheckBitrateReadProgress progress(log, readSize, 1);
+    int64_t pos = 0;
+    if (readRange(file, resume.offset, file->size(), [&](int64_t size) {
+        pos += size;
+        progress.update(pos);
+    })) {
+        log.write(_T("failed to read input file.\n"));
+        return 1;
+    }
+    flush();
+    if (m_corruptPackets) {
+        log.write(_T("%llu corrupt packets found in video streams.\n"), (unsigned long long)m_corruptPackets);
+    }
+    return 0;
+}
@@ -0,0 +1,157 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __CHECK_BITRATE_TS_H__
+#define __CHECK_BITRATE_TS_H__
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <array>
+#include <map>
+#include <functional>
+#include "rgy_tchar.h"
+#include "CheckBitrateStream.h"
+
+class CheckBitrateLog;
+class CheckBitrateInputFile;
+
+// libavformatを使わずにMPEG-TSを走査し、映像のPESのサイズとtimestampを取得する
+// PAT/PMTから映像のPIDを特定し、PESヘッダからpts/dts、TSパケットのpayloadからPESのサイズを求める
+class CheckBitrateTSReader {
+public:
+    static const int TS_PACKET_SIZE = 188;
+    static const int TS_PID_COUNT = 8192;
+    static const int TS_TIMEBASE = 90000;
+    static const int64_t TS_MIN_CHUNK_SIZE = 64 * 1024 * 1024; // 分割読み込み時の最小サイズ
+    static const int TS_RESUME_HISTORY = 1024; // 再開位置を求めるために、PIDごとに保持するPESの開始位置の数
+
+    // 追記されたファイルの続きを読み込むための情報
+    // offsetは各PIDの最後のPESのうち最も前にあるものの開始位置で、そこから読み直すことで
+    // ファイルの終端で途切れていたPESも含めて、追記後のファイルを先頭から読んだ場合と同じフレームが得られる
+    struct ResumeStream {
+        int pid;
+        int streamIndex;
+        uint64_t dropFrames; // offset以降に開始したPESのフレーム数 (読み直すので、それまでの結果から除く)
+    };
+    struct ResumeInfo {
+        int64_t offset; // 負の場合は再開できない
+        int packetSize;
+        std::vector<ResumeStream> streams;
+        ResumeInfo() : offset(-1), packetSize(0), streams() {};
+    };
+
+    CheckBitrateTSReader();
+    ~CheckBitrateTSReader();
+
+    // TSかどうかを判定し、パケットサイズ(188/192/204)を返す (TSでなければ0)
+    static int probe(const uint8_t *data, size_t size);
+
+    // ファイル全体を走査し、映像のフレーム情報をstreamHandlersに格納する
+    int read(CheckBitrateInputFile *file, StreamHandlerList& streamHandlers, CheckBitrateLog& log);
+    // ファイルをthreads個のバイト範囲に分割し、並列に走査する
+    // 各範囲の先頭はパケット境界に合わせ、範囲をまたぐPESは順に結合する
+    // fileとは別に開いたファイルから読み込んだバイト数をotherBytesReadに返す
+    int readParallel(CheckBitrateInputFile *file, const tstring& filename, int threads, StreamHandlerList& streamHandlers, uint64_t& otherBytesRead, CheckBitrateLog& log);
+    // read()/readParallel()/readResume()の後に、続きを読み込むための情報を返す
+    ResumeInfo resumeInfo() const;
+    // resume.offsetからファイルの終端までを走査する (PAT/PMTは読まず、resume.streamsのPIDを使用する)
+    int readResume(CheckBitrateInputFile *file, const ResumeInfo& resume, StreamHandlerList& streamHandlers, CheckBitrateLog& log);
+    // メモリ上のTSデータを走査する (呼び出しごとに続きとして処理する)
+    void parse(const uint8_t *data, size_t size);
+    // 最後のPESを出力する
+    void flush();
+
+    int packetSize() const { return m_packetSize; }
+    uint64_t corruptPackets() const { return m_corruptPackets; }
+protected:
+    struct PSIState {
+        std::vector<uint8_t> section;
+        int lastCC;
+        PSIState() : section(), lastCC(-1) {};
+    };
+    struct PESState {
+        int streamIndex;
+        int lastCC;
+        bool started;
+        bool corrupt;
+        bool headerParsed;
+        uint32_t flags;
+        int64_t pts;
+        int64_t dts;
+        int64_t size;
+        std::vector<uint8_t> header;
+        // 分割読み込み時に、範囲の先頭から最初のPUSIまでのデータ (前の範囲のPESの続き)
+        bool leading;
+        int64_t leadingSize;
+        std::vector<uint8_t> leadingHead; // PESヘッダの続きの可能性があるので先頭だけ保持する
+        int leadingFirstCC;
+        bool leadingFirstDiscontinuity;  // 範囲の最初のパケットのdiscontinuity_indicator
+        int leadingFirstPayloadSize;     // 範囲の最初のパケットのうちleadingSizeに含めたサイズ (重送パケットの場合に除く)
+        bool leadingCorrupt;
+        int64_t startOffset;                // 今のPESを開始したパケットのファイル上の位置
+        std::deque<int64_t> outputOffsets;  // 直近に出力したPESの開始位置 (最大TS_RESUME_HISTORY個)
+        PESState() : streamIndex(-1), lastCC(-1), started(false), corrupt(false), headerParsed(false), flags(0), pts(0), dts(0), size(0), header(),
+            leading(false), leadingSize(0), leadingHead(), leadingFirstCC(-1), leadingFirstDiscontinuity(false), leadingFirstPayloadSize(0), leadingCorrupt(false), startOffset(0), outputOffsets() {};
+    };
+
+    int probeFile(CheckBitrateInputFile *file, CheckBitrateLog& log);
+    // [start, end)を走査する (onReadには処理したバイト数を渡す)
+    int readRange(CheckBitrateInputFile *file, int64_t start, int64_t end, const std::function<void(int64_t)>& onRead);
+    // 範囲の途中から走査するため、srcで見つかった映像のPIDを引き継ぐ
+    void copyStreams(const CheckBitrateTSReader& src, StreamHandlerList& streamHandlers);
+    // 次の範囲の走査結果を結合する
+    void joinChunk(CheckBitrateTSReader& next, StreamHandlerList& nextStreamHandlers);
+    // 走査の状態を初期化する (分割読み込みをやめて先頭から読み直す場合)
+    void reset();
+    const uint8_t *findSync(const uint8_t *ptr, const uint8_t *fin) const;
+    void parsePacket(const uint8_t *pkt);
+    void parsePSI(int pid, PSIState& psi, const uint8_t *payload, int payloadSize, bool pusi);
+    void parsePAT(const uint8_t *section, int sectionSize);
+    void parsePMT(const uint8_t *section, int sectionSize);
+    void parsePES(PESState& pes, const uint8_t *payload, int payloadSize, bool pusi, bool randomAccess);
+    void parsePESHeader(PESState& pes);
+    void outputPES(PESState& pes);
+    int getStreamIndex(int pid);
+
+    int m_packetSize;
+    StreamHandlerList *m_streamHandlers;
+    int m_syncOffset;                  // パケットの先頭から同期バイトまでのオフセット (192byteの場合は4)
+    std::vector<std::unique_ptr<PSIState>> m_psi; // [PID] PAT, PMT
+    std::vector<std::unique_ptr<PESState>> m_pes; // [PID] 映像のPES
+    std::map<int, int> m_streamIndex;  // PID -> stream index (PMTに現れた順)
+    std::vector<uint8_t> m_remain;     // 前回のparse()で処理しきれなかったデータ
+    int64_t m_pos;                     // 次のparse()に渡されるデータのファイル上の位置
+    int64_t m_packetPos;               // 処理中のパケットのファイル上の位置
+    bool m_streamsFixed;               // PMTから新たな映像のPIDを追加しない (分割読み込み時)
+    bool m_streamsMissed;              // m_streamsFixedのため追加しなかった映像のPIDがある
+    uint64_t m_corruptPackets;
+};
+
+#endif //__CHECK_BITRATE_TS_H__
@@ -0,0 +1,183 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include "CheckBitrateVBV.h"
+#include "CheckBitrateCsv.h"
+#include "CheckBitrateLog.h"
+#include "rgy_util.h"
+
+VBVResult simulateVBV(const std::vector<VBVFrame>& frames, const VBVParam& prm, double initFullness, CheckBitrateCsvWriter *csv) {
+    VBVResult result;
+    result.prm = prm;
+    result.underflowCount = 0;
+    result.overflowCount = 0;
+    result.underflowEvents = 0;
+    result.overflowEvents = 0;
+    result.minFullness = 100.0;
+    result.error = 0;
+
+    // 単位はbit
+    const double rate = prm.maxrate * 1000.0;
+    const double bufsize = prm.bufsize * 1000.0;
+    double fullness = bufsize * initFullness;
+    double prevsec = (frames.size() > 0) ? frames[0].sec : 0.0;
+    bool prevOverflow = false;
+    bool prevUnderflow = false;
+    if (csv) {
+        csv->write(",fullness(kbit),fullness after frame(kbit)\n");
+    }
+    for (const auto& frame : frames) {
+        fullness += rate * (frame.sec - prevsec);
+        prevsec = frame.sec;
+        const bool overflow = fullness > bufsize;
+        if (overflow) {
+            fullness = bufsize;
+            result.overflowCount++;
+            if (!prevOverflow) {
+                result.overflowEvents++;
+                if ((int)result.overflowPoints.size() < VBV_MAX_REPORT_POINTS) {
+                    result.overflowPoints.push_back(frame.sec);
+                }
+            }
+        }
+        const double before = fullness;
+        fullness -= frame.size * 8.0;
+        const bool underflow = fullness < 0.0;
+        if (underflow) {
+            fullness = 0.0;
+            result.underflowCount++;
+            if (!prevUnderflow) {
+                result.underflowEvents++;
+                if ((int)result.underflowPoints.size() < VBV_MAX_REPORT_POINTS) {
+                    result.underflowPoints.push_back(frame.sec);
+                }
+            }
+        }
+        prevOverflow = overflow;
+        prevUnderflow = underflow;
+        result.minFullness = std::min(result.minFullness, fullness * 100.0 / bufsize);
+        if (csv) {
+            csv->writeFixed(frame.sec, 6);
+            csv->put(',');
+            csv->writeFixed(before * 0.001, 3);
+            csv->put(',');
+            csv->writeFixed(fullness * 0.001, 3);
+            csv->put('\n');
+        }
+    }
+    if (csv && csv->close()) {
+        result.error = 1;
+    }
+    return result;
+}
+
+static tstring getPointsString(const std::vector<double>& points, const int events) {
+    tstring str;
+    for (const auto point : points) {
+        if (str.length() > 0) str += _T(", ");
+        str += strsprintf(_T("%.3f"), point);
+    }
+    if (events > (int)points.size()) {
+        str += _T(", ...");
+    }
+    return str;
+}
+
+int runVBV(const std::vector<VBVFrame>& frames, const std::vector<VBVParam>& params, double initFullness, const tstring& outputBase, CheckBitrateLog& log) {
+    const int paramCount = (int)params.size();
+    std::vector<VBVResult> results(paramCount);
+
+    // 各組は独立なので、組ごとに並列に処理する
+    std::atomic<int> nextParam(0);
+    auto worker = [&]() {
+        for (int i; (i = nextParam++) < paramCount; ) {
+            const auto filename = outputBase + strsprintf(_T("vbv.%gk_%gk.csv"), params[i].maxrate, params[i].bufsize);
+            CheckBitrateCsvWriter csv;
+            if (csv.open(filename)) {
+                results[i].prm = params[i];
+                results[i].error = 1;
+                continue;
+            }
+            results[i] = simulateVBV(frames, params[i], initFullness, &csv);
+        }
+    };
+    const int threadCount = clamp((int)std::thread::hardware_concurrency(), 1, std::max(paramCount, 1));
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadCount; i++) {
+        threads.push_back(std::thread(worker));
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+
+    const auto summaryFilename = outputBase + _T("vbv.csv");
+    CheckBitrateCsvWriter csvSummary;
+    if (csvSummary.open(summaryFilename)) {
+        log.write(_T("failed to open output file \"%s\"\n"), summaryFilename.c_str());
+        return 1;
+    }
+    csvSummary.write("maxrate(kbps),bufsize(kbit),underflow,overflow,first underflow,min fullness(%)\n");
+    int ret = 0;
+    for (const auto& result : results) {
+        if (result.error) {
+            log.write(_T("vbv %g kbps / %g kbit: failed to write output file.\n"), result.prm.maxrate, result.prm.bufsize);
+            ret = 1;
+            continue;
+        }
+        csvSummary.write(strsprintf(_T("%g,%g,"), result.prm.maxrate, result.prm.bufsize));
+        csvSummary.writeInt(result.underflowCount);
+        csvSummary.put(',');
+        csvSummary.writeInt(result.overflowCount);
+        csvSummary.put(',');
+        if (result.underflowPoints.size() > 0) {
+            csvSummary.writeFixed(result.underflowPoints[0], 3);
+        }
+        csvSummary.put(',');
+        csvSummary.writeFixed(result.minFullness, 2);
+        csvSummary.put('\n');
+        log.write(_T("vbv %g kbps / %g kbit: %s, underflow %d frames, overflow %d frames, min fullness %.2f%%\n"),
+            result.prm.maxrate, result.prm.bufsize, (result.underflowCount > 0) ? _T("NG") : _T("OK"),
+            result.underflowCount, result.overflowCount, result.minFullness);
+        if (result.underflowCount > 0) {
+            log.write(_T("  underflow at %s sec\n"), getPointsString(result.underflowPoints, result.underflowEvents).c_str());
+        }
+        if (result.overflowCount > 0) {
+            log.write(_T("  overflow at %s sec\n"), getPointsString(result.overflowPoints, result.overflowEvents).c_str());
+        }
+    }
+    if (csvSummary.close()) {
+        log.write(_T("failed to write output file \"%s\"\n"), summaryFilename.c_str());
+        ret = 1;
+    }
+    return ret;
+}
@@ -0,0 +1,78 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __CHECK_BITRATE_VBV_H__
+#define __CHECK_BITRATE_VBV_H__
+
+#include <cstdint>
+#include <vector>
+#include "rgy_tchar.h"
+
+class CheckBitrateLog;
+class CheckBitrateCsvWriter;
+
+// timestamp補正後のフレーム
+struct VBVFrame {
+    double sec; // 最初のフレームからの時刻(秒)
+    int size;
+};
+
+struct VBVParam {
+    double maxrate; // kbps
+    double bufsize; // kbit
+};
+
+struct VBVResult {
+    VBVParam prm;
+    int underflowCount;      // デコード時刻までにフレームが届かなかったフレーム数
+    int overflowCount;       // バッファが満杯になったフレーム数 (CBRの場合のみ問題となる)
+    std::vector<double> underflowPoints; // 連続するunderflowの開始時刻(秒) (最初のVBV_MAX_REPORT_POINTS個)
+    std::vector<double> overflowPoints;  // 連続するoverflowの開始時刻(秒) (最初のVBV_MAX_REPORT_POINTS個)
+    int underflowEvents;     // 連続するunderflowをまとめた回数
+    int overflowEvents;
+    double minFullness;      // フレームを取り出した後の最小のバッファ占有率(%)
+    int error;               // csvの出力に失敗した
+};
+
+static const int VBV_MAX_REPORT_POINTS = 10;
+static const double VBV_DEFAULT_INIT = 0.9;
+
+// leaky bucketモデルでデコーダのバッファをシミュレーションする
+// - バッファは最初のフレームの時点でbufsize * initFullnessとし、maxrateで満たされる
+// - 各フレームはdtsの時刻に瞬時にバッファから取り出される
+// - フレームの取り出し時にバッファが足りなければunderflow (バッファは0とする)
+// - バッファがbufsizeを超える場合はoverflowとし、bufsizeで止める (VBRでは入力が止まるだけ)
+// csvがnullptrでなければ、フレームごとのバッファの量を出力して閉じる
+VBVResult simulateVBV(const std::vector<VBVFrame>& frames, const VBVParam& prm, double initFullness, CheckBitrateCsvWriter *csv);
+
+// 複数のmaxrate/bufsizeの組を並列にシミュレーションし、
+// 結果を<outputBase>vbv.csvに、各組のバッファの量を<outputBase>vbv.<maxrate>k_<bufsize>k.csvに出力する
+int runVBV(const std::vector<VBVFrame>& frames, const std::vector<VBVParam>& params, double initFullness, const tstring& outputBase, CheckBitrateLog& log);
+
+#endif //__CHECK_BITRATE_VBV_H__
@@ -0,0 +1,524 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include "CheckBitrateWriter.h"
+#include "CheckBitrateRescale.h"
+#include "CheckBitrateLog.h"
+#pragma warning (push)
+#pragma warning (disable: 4244)
+#pragma warning (disable: 4819)
+extern "C" {
+#include <libavutil/mathematics.h>
+#include <libavcodec/avcodec.h>
+}
+#pragma warning (pop)
+
+static const int64_t PCR_WRAP_CHECK_VAL = (1LL << 32) - 1;
+static const int64_t PCR_WRAP_VAL = (1LL << 33);
+static const int EXTRAPOLATE_FRAMES = 30; // 線形外挿に使用するフレーム数
+
+static inline double ts2sec(int64_t ts, AVRational timebase) {
+    return ts * av_q2d(timebase);
+}
+
+static int64_t get_dts(const FrameData& frame) {
+    return frame.dts != AV_NOPTS_VALUE ? frame.dts : frame.pts;
+}
+
+CheckBitrateWriter::CheckBitrateWriter() :
+    m_bins(),
+    m_log(nullptr),
+    m_timebase(av_make_q(0, 1)),
+    m_avgFrameRate(av_make_q(0, 1)),
+    m_maxLookahead(UNLIMITED_LOOKAHEAD),
+    m_flushEachRow(false),
+    m_frameType(false),
+    m_muxBytes(false),
+    m_outputFormat(CB_OUTPUT_CSV),
+    m_binaryFrames(false),
+    m_binaryInfo(),
+    m_binaryFrameData(),
+    m_timestampFound(false),
+    m_useFrameRate(false),
+    m_ptsOffset(0),
+    m_prevWrapTs(AV_NOPTS_VALUE),
+    m_pending(),
+    m_prevts(0),
+    m_history(),
+    m_frameCount(0),
+    m_resumeCheck(false),
+    m_started(false),
+    m_firstts(0),
+    m_framesec(0.0),
+    m_sizesum(0),
+    m_peakWindows(),
+    m_peakFrames(),
+    m_recordFrames(false),
+    m_frames(),
+    m_summary(),
+    m_muxWriter(nullptr),
+    m_muxTrack(0),
+    m_cacheTrack(nullptr) {
+}
+
+CheckBitrateWriter::~CheckBitrateWriter() {
+}
+
+int CheckBitrateWriter::open(const std::vector<CheckBitrateOutput>& outputs, AVRational timebase, AVRational avgFrameRate, int maxLookahead, bool flushEachRow, CheckBitrateLog& log) {
+    m_timebase = timebase;
+    m_avgFrameRate = avgFrameRate;
+    m_maxLookahead = maxLookahead;
+    m_flushEachRow = flushEachRow;
+    m_log = &log;
+
+    m_bins.clear();
+    for (const auto& output : outputs) {
+        IntervalBin bin;
+        if (m_outputFormat & CB_OUTPUT_CSV) {
+            bin.csv.reset(new CheckBitrateCsvWriter());
+            if (bin.csv->open(output.filename)) {
+                log.write(_T("failed to open output file \"%s\"\n"), output.filename.c_str());
+                m_bins.clear();
+                return 1;
+            }
+        }
+        if (m_outputFormat & CB_OUTPUT_BINARY) {
+            const auto binaryFilename = getBinaryFilename(output.filename);
+            bin.binary.reset(new CheckBitrateBinaryWriter());
+            if (bin.binary->open(binaryFilename, m_binaryInfo, timebase.num, timebase.den, avgFrameRate.num, avgFrameRate.den, output.interval)) {
+                log.write(_T("failed to open output file \"%s\"\n"), binaryFilename.c_str());
+                m_bins.clear();
+                return 1;
+            }
+        }
+        bin.interval = output.interval;
+        bin.tick = 0.0;
+        bin.sizetick = 0;
+        memset(bin.typeSize, 0, sizeof(bin.typeSize));
+        memset(bin.typeCount, 0, sizeof(bin.typeCount));
+        bin.muxSizetick = 0;
+        if (bin.csv) {
+            bin.csv->write(",kbps,kbps(avg)");
+            if (m_frameType) {
+                bin.csv->write(",I(byte),P(byte),B(byte),I(frames),P(frames),B(frames)");
+            }
+            if (m_muxBytes) {
+                bin.csv->write(",es(byte),disk(byte),non-es(%)");
+            }
+            bin.csv->put('\n');
+            if (m_flushEachRow) {
+                bin.csv->flush();
+            }
+        }
+        m_bins.push_back(std::move(bin));
+    }
+    return 0;
+}
+
+void CheckBitrateWriter::setPeakWindows(const std::vector<double>& windows) {
+    m_peakWindows.clear();
+    for (const auto window : windows) {
+        m_peakWindows.push_back({ window, 0, 0, 0.0, 0.0 });
+    }
+}
+
+// 基本的にdtsベースで処理する
+void CheckBitrateWriter::push(const FrameData& frame) {
+    auto timestamp = get_dts(frame);
+    const PendingFrame pendingFrame = { frame.size, frame.frameType, frame.muxSize };
+    if (!m_timestampFound) {
+        if (timestamp == AV_NOPTS_VALUE) {
+            if (m_useFrameRate) {
+                emit(frameRateTimestamp(m_frameCount++), pendingFrame);
+                return;
+            }
+            // 有効なtimestampが見つかるまで保持しておき、見つからなければavgFrameRateを仮定する
+            // maxLookaheadを超えた場合は、有効なtimestampが見つかるまでavgFrameRateを仮定して出力する
+            m_pending.push_back(pendingFrame);
+            if (m_maxLookahead != UNLIMITED_LOOKAHEAD && (int)m_pending.size() > m_maxLookahead) {
+                m_useFrameRate = true;
+                for (const auto& pending : m_pending) {
+                    emit(frameRateTimestamp(m_frameCount++), pending);
+                }
+                m_pending.clear();
+            }
+            return;
+        }
+        // 最初の有効なtimestampより前のフレームは使用しない
+        m_pending.clear();
+        m_timestampFound = true;
+        if (m_useFrameRate) {
+            // avgFrameRateを仮定して出力済みのフレームの1フレーム後に続くように、以降のtimestampをずらして補正に戻る
+            const int64_t frameDuration = frameRateTimestamp(1);
+            m_useFrameRate = false;
+            m_ptsOffset = m_prevts + frameDuration - timestamp;
+        }
+        m_prevWrapTs = timestamp + m_ptsOffset;
+    }
+    // 読み直したフレームの途中でPCR Wrapしていた場合は、補正量を戻す
+    if (m_resumeCheck && timestamp != AV_NOPTS_VALUE) {
+        m_resumeCheck = false;
+        if (m_ptsOffset >= PCR_WRAP_VAL && (timestamp + m_ptsOffset) - m_prevWrapTs >= PCR_WRAP_CHECK_VAL) {
+            m_ptsOffset -= PCR_WRAP_VAL;
+        }
+    }
+    // PCR Wrapを考慮 (AV_NOPTS_VALUEでない値を対象にする)
+    // 単調増加に補正する
+    if (timestamp != AV_NOPTS_VALUE) {
+        if (timestamp + m_ptsOffset < m_prevWrapTs) {
+            if ((m_prevWrapTs - (timestamp + m_ptsOffset)) >= PCR_WRAP_CHECK_VAL) {
+                m_ptsOffset += PCR_WRAP_VAL;
+            } else if (frame.flags & AV_PKT_FLAG_CORRUPT) {
+                timestamp = AV_NOPTS_VALUE;
+            }
+        }
+        m_prevWrapTs = (timestamp == AV_NOPTS_VALUE) ? AV_NOPTS_VALUE : timestamp + m_ptsOffset;
+        // dtsを無効にした場合はptsが使われる
+        timestamp = (m_prevWrapTs != AV_NOPTS_VALUE) ? m_prevWrapTs : frame.pts;
+    }
+    pushTimestamp(timestamp, pendingFrame);
+}
+
+void CheckBitrateWriter::pushTimestamp(int64_t timestamp, const PendingFrame& frame) {
+    if (timestamp == AV_NOPTS_VALUE) {
+        m_pending.push_back(frame);
+        if (m_maxLookahead != UNLIMITED_LOOKAHEAD && (int)m_pending.size() > m_maxLookahead) {
+            extrapolatePending(m_pending.size() - m_maxLookahead);
+        }
+        return;
+    }
+    // 途中にAV_NOPTS_VALUEがある場合も多い
+    // その場合は、前後のtimestampから大雑把に線形補間する
+    const int64_t prevts = m_prevts;
+    const int64_t count = (int64_t)m_pending.size() + 1;
+    RescaleStep step(timestamp - prevts, count);
+    for (int64_t j = 0; j < count - 1; j++) {
+        emit(prevts + step.next(), m_pending[j]);
+    }
+    m_pending.clear();
+    emit(timestamp, frame);
+}
+
+// avgFrameRateを仮定したときの、n番目のフレームのtimestamp (avgFrameRateが不明な場合は0)
+int64_t CheckBitrateWriter::frameRateTimestamp(int64_t n) const {
+    if (m_avgFrameRate.num <= 0 || m_avgFrameRate.den <= 0) {
+        return 0;
+    }
+    return (int64_t)av_rescale_q(n, av_inv_q(m_avgFrameRate), m_timebase);
+}
+
+// 保持しているフレームのうち先頭のcount個を、直近のフレームのtimestampを使って線形外挿する
+void CheckBitrateWriter::extrapolatePending(size_t count) {
+    const int64_t iterpInterval = std::min<int64_t>(EXTRAPOLATE_FRAMES, (int64_t)m_history.size() - 1);
+    const int64_t baseTs = m_prevts;
+    const int64_t iterpTs = (iterpInterval > 0) ? m_history[m_history.size() - 1 - iterpInterval] : baseTs;
+    //直近のフレームが1つしかない場合はavgFrameRateを使う
+    const int64_t frameDuration = (iterpInterval <= 0 && m_avgFrameRate.num > 0)
+        ? (int64_t)av_rescale_q(1, av_inv_q(m_avgFrameRate), m_timebase) : 0;
+    RescaleStep step(baseTs - iterpTs, std::max<int64_t>(iterpInterval, 1));
+    for (size_t i = 0; i < count && m_pending.size() > 0; i++) {
+        const int64_t dts = (iterpInterval > 0)
+            ? baseTs + step.next()
+            : baseTs + frameDuration * (int64_t)(i + 1);
+        emit(dts, m_pending.front());
+        m_pending.pop_front();
+    }
+}
+
+void CheckBitrateWriter::emit(int64_t dts, const PendingFrame& frame) {
+    const int size = frame.size;
+    m_prevts = dts;
+    m_history.push_back(dts);
+    if ((int)m_history.size() > EXTRAPOLATE_FRAMES + 1) {
+        m_history.pop_front();
+    }
+    if (!m_started) {
+        m_started = true;
+        m_firstts = dts;
+    }
+    m_framesec = ts2sec(dts - m_firstts, m_timebase);
+    for (auto& bin : m_bins) {
+        if (bin.tick + bin.interval < m_framesec) {
+            writeRow(bin, m_framesec);
+            bin.tick = m_framesec;
+            bin.sizetick = 0;
+            memset(bin.typeSize, 0, sizeof(bin.typeSize));
+            memset(bin.typeCount, 0, sizeof(bin.typeCount));
+            bin.muxSizetick = 0;
+        }
+        bin.sizetick += size;
+        bin.typeSize[frame.frameType] += size;
+        bin.typeCount[frame.frameType]++;
+        bin.muxSizetick += frame.muxSize;
+    }
+    m_sizesum += size;
+    if (m_peakWindows.size() > 0) {
+        updatePeak(m_framesec, size);
+    }
+    if (m_recordFrames) {
+        m_frames.push_back({ m_framesec, size });
+    }
+    if (m_binaryFrames) {
+        m_binaryFrameData.time.push_back(m_framesec);
+        m_binaryFrameData.size.push_back((uint32_t)size);
+        m_binaryFrameData.type.push_back((uint8_t)frame.frameType);
+    }
+    m_summary.frameSize.add(size);
+    if (m_muxWriter) {
+        m_muxWriter->add(m_muxTrack, ts2sec(dts, m_timebase), size);
+    }
+    if (m_cacheTrack) {
+        m_cacheTrack->add(dts, size, frame.frameType, frame.muxSize);
+    }
+}
+
+void CheckBitrateWriter::pushRepaired(int64_t dts, int size, CheckBitrateFrameType frameType, int64_t muxSize) {
+    emit(dts, { size, frameType, muxSize });
+    m_frameCount++; // resumeRepair()でavgFrameRateから計算する場合のフレーム番号として使用する
+}
+
+FrameCacheRepairState CheckBitrateWriter::repairState() const {
+    FrameCacheRepairState state;
+    state.timestampFound = m_timestampFound;
+    state.useFrameRate = m_useFrameRate;
+    state.ptsOffset = m_ptsOffset;
+    return state;
+}
+
+void CheckBitrateWriter::resumeRepair(const FrameCacheRepairState& state) {
+    m_timestampFound = state.timestampFound;
+    m_useFrameRate = state.useFrameRate;
+    m_ptsOffset = state.ptsOffset;
+    m_prevWrapTs = m_prevts;
+    m_resumeCheck = m_timestampFound && !m_useFrameRate;
+}
+
+// 各ウィンドウは、時刻が (framesec - window, framesec] のフレームを含む
+// フレームの追加と削除はそれぞれ1回ずつなので、ウィンドウの数によらずフレームあたりO(1)で更新できる
+// ウィンドウごとの更新は数回の加減算だけなので、ウィンドウごとにスレッドを分けると同期のコストの方が大きくなる
+// そのため、フレームを受け取るたびに全ウィンドウをまとめて更新し、並列化はトラック・ファイル単位で行う
+void CheckBitrateWriter::updatePeak(double framesec, int size) {
+    m_peakFrames.push_back(std::make_pair(framesec, size));
+    size_t maxCount = 0;
+    for (auto& peak : m_peakWindows) {
+        peak.count++;
+        peak.sizesum += size;
+        while (peak.count > 1 && m_peakFrames[m_peakFrames.size() - peak.count].first <= framesec - peak.window) {
+            peak.sizesum -= m_peakFrames[m_peakFrames.size() - peak.count].second;
+            peak.count--;
+        }
+        const double kbps = peak.sizesum * 8 / peak.window * 0.001;
+        if (kbps > peak.peakKbps) {
+            peak.peakKbps = kbps;
+            peak.peakStart = std::max(framesec - peak.window, 0.0);
+        }
+        maxCount = std::max(maxCount, peak.count);
+    }
+    while (m_peakFrames.size() > maxCount) {
+        m_peakFrames.pop_front();
+    }
+}
+
+std::vector<CheckBitrateWriter::PeakResult> CheckBitrateWriter::peakResults() const {
+    std::vector<PeakResult> results;
+    for (const auto& peak : m_peakWindows) {
+        results.push_back({ peak.window, peak.peakKbps, peak.peakStart });
+    }
+    return results;
+}
+
+void CheckBitrateWriter::writeRow(IntervalBin& bin, double framesec) {
+    double time = framesec - bin.tick;
+    double kbps = bin.sizetick * 8 / time * 0.001;
+    double avgkbps = m_sizesum * 8 / framesec * 0.001;
+    m_summary.bitrate[bin.interval].add(kbps);
+    if (bin.binary) {
+        bin.binary->addRow(bin.tick, kbps, avgkbps);
+    }
+    if (!bin.csv) {
+        return;
+    }
+    auto csv = bin.csv.get();
+    csv->writeFixed(bin.tick, 3, 10);
+    csv->put(',');
+    csv->writeFixed(kbps, 2);
+    csv->put(',');
+    csv->writeFixed(avgkbps, 2);
+    if (m_frameType) {
+        for (int type = CB_FRAME_TYPE_I; type < CB_FRAME_TYPE_COUNT; type++) {
+            csv->put(',');
+            csv->writeUInt(bin.typeSize[type]);
+        }
+        for (int type = CB_FRAME_TYPE_I; type < CB_FRAME_TYPE_COUNT; type++) {
+            csv->put(',');
+            csv->writeInt(bin.typeCount[type]);
+        }
+    }
+    if (m_muxBytes) {
+        // non-es: ファイル上のバイト数のうち、このトラックのフレーム以外 (コンテナのヘッダ、他のストリームなど) の割合
+        const double nonEs = (bin.muxSizetick > 0) ? (1.0 - (double)bin.sizetick / bin.muxSizetick) * 100.0 : 0.0;
+        csv->put(',');
+        csv->writeUInt(bin.sizetick);
+        csv->put(',');
+        csv->writeUInt(bin.muxSizetick);
+        csv->put(',');
+        csv->writeFixed(nonEs, 2);
+    }
+    csv->put('\n');
+    if (m_flushEachRow) {
+        csv->flush();
+    }
+}
+
+int CheckBitrateWriter::finish() {
+    if (m_bins.empty()) {
+        return 1;
+    }
+    if (m_pending.size() > 0) {
+        if (m_timestampFound) {
+            // その後の区間にAV_NOPTS_VALUEがあれば、最後の30フレームのtimestampを使って線形外挿する
+            extrapolatePending(m_pending.size());
+        } else {
+            // avgFrameRate を仮定して、timestampを計算する
+            for (const auto& pending : m_pending) {
+                emit(frameRateTimestamp(m_frameCount++), pending);
+            }
+            m_pending.clear();
+        }
+    }
+    if (m_started) {
+        for (auto& bin : m_bins) {
+            writeRow(bin, m_framesec);
+        }
+    }
+    int ret = 0;
+    for (auto& bin : m_bins) {
+        if (bin.csv && bin.csv->close()) {
+            m_log->write(_T("failed to write output file \"%s\"\n"), bin.csv->filename().c_str());
+            ret = 1;
+        }
+        if (bin.binary && bin.binary->close((m_binaryFrames) ? &m_binaryFrameData : nullptr)) {
+            m_log->write(_T("failed to write output file \"%s\"\n"), bin.binary->filename().c_str());
+            ret = 1;
+        }
+    }
+    m_bins.clear();
+    return ret;
+}
+
+CheckBitrateMuxWriter::CheckBitrateMuxWriter() :
+    m_csv(),
+    m_log(nullptr),
+    m_interval(1.0),
+    m_trackCount(0),
+    m_startSec(-1.0),
+    m_flushEachRow(false),
+    m_started(false),
+    m_firstBin(0),
+    m_maxSec(0.0),
+    m_bins() {
+}
+
+CheckBitrateMuxWriter::~CheckBitrateMuxWriter() {
+}
+
+int CheckBitrateMuxWriter::open(const tstring& filename, double interval, const std::vector<tstring>& trackNames, double startSec, bool flushEachRow, CheckBitrateLog& log) {
+    if (m_csv.open(filename)) {
+        log.write(_T("failed to open output file \"%s\"\n"), filename.c_str());
+        return 1;
+    }
+    m_log = &log;
+    m_interval = interval;
+    m_trackCount = trackNames.size();
+    m_startSec = startSec;
+    m_flushEachRow = flushEachRow;
+    m_started = (startSec >= 0.0);
+    for (const auto& name : trackNames) {
+        m_csv.put(',');
+        m_csv.write(name);
+        m_csv.write("(kbps)");
+    }
+    m_csv.write(",total(kbps)\n");
+    if (m_flushEachRow) {
+        m_csv.flush();
+    }
+    return 0;
+}
+
+void CheckBitrateMuxWriter::add(int track, double sec, int size) {
+    if (!m_started) {
+        m_started = true;
+        m_startSec = sec;
+    }
+    sec -= m_startSec;
+    const int64_t bin = std::max((int64_t)std::floor(sec / m_interval), m_firstBin);
+    while (m_firstBin + (int64_t)m_bins.size() <= bin) {
+        m_bins.push_back(std::vector<uint64_t>(m_trackCount, 0));
+    }
+    m_bins[(size_t)(bin - m_firstBin)][track] += size;
+    m_maxSec = std::max(m_maxSec, sec);
+    while (m_bins.size() > 1 && (m_firstBin + 1) * m_interval + MUX_REORDER_SEC < m_maxSec) {
+        writeRow();
+    }
+}
+
+void CheckBitrateMuxWriter::writeRow() {
+    const auto& bin = m_bins.front();
+    uint64_t total = 0;
+    m_csv.writeFixed(m_firstBin * m_interval, 3, 10);
+    for (const auto size : bin) {
+        m_csv.put(',');
+        m_csv.writeFixed(size * 8 / m_interval * 0.001, 2);
+        total += size;
+    }
+    m_csv.put(',');
+    m_csv.writeFixed(total * 8 / m_interval * 0.001, 2);
+    m_csv.put('\n');
+    if (m_flushEachRow) {
+        m_csv.flush();
+    }
+    m_bins.pop_front();
+    m_firstBin++;
+}
+
+int CheckBitrateMuxWriter::finish() {
+    if (!m_csv.isOpen()) {
+        return 1;
+    }
+    while (m_bins.size() > 0) {
+        writeRow();
+    }
+    if (m_csv.close()) {
+        m_log->write(_T("failed to write output file \"%s\"\n"), m_csv.filename().c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,228 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __CHECK_BITRATE_WRITER_H__
+#define __CHECK_BITRATE_WRITER_H__
+
+#include <cstdio>
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <memory>
+#include "rgy_tchar.h"
+#include "rgy_util.h"
+#include "CheckBitrateStream.h"
+#include "CheckBitrateCsv.h"
+#include "CheckBitrateBinary.h"
+#include "CheckBitrateFrameCache.h"
+#include "CheckBitrateVBV.h"
+#include "CheckBitrateSummary.h"
+
+class CheckBitrateLog;
+class CheckBitrateMuxWriter;
+
+// 出力するcsvと、ビットレートを計算する区間の長さ
+struct CheckBitrateOutput {
+    tstring filename;
+    double interval;
+};
+
+// フレームを1つずつ受け取り、timestampの補正・補間を行いながらビットレートをcsvに出力する
+// - PCR Wrapを考慮して単調増加に補正する
+// - AV_NOPTS_VALUEのフレームは前後のtimestampから線形補間する
+//   次の有効なtimestampが来るまでフレームを保持するが、maxLookaheadを超えた場合は
+//   直前のフレームから線形外挿して出力し、保持するフレーム数を制限する
+//   最初の有効なtimestampまでにmaxLookaheadを超えた場合は、avgFrameRateを仮定して出力し、
+//   有効なtimestampが来た時点でその続きとして補正に戻る
+// - intervalごとの区間が確定するたびにcsvに1行出力する
+//   複数のintervalを指定した場合は、timestampの補正は共通で、それぞれのcsvに出力する
+// - 指定した長さの任意の区間 (スライディングウィンドウ) での最大ビットレートを求める
+// - VBVのシミュレーション用に、補正後のフレームを保持することもできる
+// - フレームサイズとintervalごとのビットレートの分布を、固定サイズのsketchに集計する
+// - ピクチャタイプごとのサイズとフレーム数を、intervalごとにcsvに出力することもできる
+// - コンテナを含めたファイル上のバイト数とオーバーヘッドを、intervalごとにcsvに出力することもできる
+class CheckBitrateWriter {
+public:
+    // スライディングウィンドウでの最大ビットレート
+    struct PeakResult {
+        double window; // ウィンドウの長さ(秒)
+        double kbps;   // 最大ビットレート
+        double start;  // 最大となるウィンドウの開始時刻(秒)
+    };
+
+    static const int UNLIMITED_LOOKAHEAD = 0;
+    static const int STREAM_LOOKAHEAD = 600; // 逐次出力時に保持する最大フレーム数
+
+    CheckBitrateWriter();
+    ~CheckBitrateWriter();
+
+    // ピクチャタイプごとの列を出力する (open()の前に呼ぶ)
+    void setFrameType(bool frameType) { m_frameType = frameType; }
+    // FrameData::muxSizeの列を出力する (open()の前に呼ぶ)
+    void setMuxBytes(bool muxBytes) { m_muxBytes = muxBytes; }
+    // 出力形式 (CheckBitrateOutputFormat) を設定する (open()の前に呼ぶ)
+    // バイナリ出力はcsvのファイル名の拡張子を.binとしたファイルに、finish()でまとめて書き出す
+    // binaryFramesの場合は、フレームごとの列も書き出す
+    void setOutputFormat(int format, bool binaryFrames, const CheckBitrateBinaryInfo& info) {
+        m_outputFormat = format;
+        m_binaryFrames = binaryFrames;
+        m_binaryInfo = info;
+    }
+    // flushEachRowの場合は、1行出力するたびにファイルに書き出す
+    int open(const std::vector<CheckBitrateOutput>& outputs, AVRational timebase, AVRational avgFrameRate, int maxLookahead, bool flushEachRow, CheckBitrateLog& log);
+    // 最大ビットレートを求めるウィンドウの長さ(秒)を設定する (open()の後、push()の前に呼ぶ)
+    void setPeakWindows(const std::vector<double>& windows);
+    // 補正後のtimestampをmuxWriterのtrack番目のトラックとして渡す (open()の後、push()の前に呼ぶ)
+    void setMuxWriter(CheckBitrateMuxWriter *muxWriter, int track) { m_muxWriter = muxWriter; m_muxTrack = track; }
+    // 補正後のフレームを保持する (open()の後、push()の前に呼ぶ)
+    void setRecordFrames(bool record) { m_recordFrames = record; }
+    // 補正後のフレームをcacheTrackに追加する (open()の後、push()の前に呼ぶ)
+    void setFrameCacheTrack(FrameCacheTrack *cacheTrack) { m_cacheTrack = cacheTrack; }
+    void push(const FrameData& frame);
+    // 補正済みのtimestampのフレームを、補正を行わずに出力する (FrameCacheから読み込んだフレーム用)
+    void pushRepaired(int64_t dts, int size, CheckBitrateFrameType frameType, int64_t muxSize);
+    // timestampの補正の状態 (finish()の後に呼ぶ)
+    FrameCacheRepairState repairState() const;
+    // 前回までのフレームをpushRepaired()で出力した後、その続きとしてpush()できるように補正の状態を戻す
+    void resumeRepair(const FrameCacheRepairState& state);
+    // 保持しているフレームを出力し、最後の区間を出力する
+    int finish();
+    // finish()の後に呼ぶ
+    std::vector<PeakResult> peakResults() const;
+    const std::vector<VBVFrame>& frames() const { return m_frames; }
+    const BitrateSummary& summary() const { return m_summary; }
+private:
+    struct PendingFrame {
+        int size;
+        CheckBitrateFrameType frameType;
+        int64_t muxSize;
+    };
+    void pushTimestamp(int64_t timestamp, const PendingFrame& frame);
+    void extrapolatePending(size_t count);
+    int64_t frameRateTimestamp(int64_t n) const;
+    // intervalごとの集計
+    struct IntervalBin {
+        std::unique_ptr<CheckBitrateCsvWriter> csv;
+        std::unique_ptr<CheckBitrateBinaryWriter> binary;
+        double interval;
+        double tick;
+        uint64_t sizetick;
+        uint64_t typeSize[CB_FRAME_TYPE_COUNT];
+        int typeCount[CB_FRAME_TYPE_COUNT];
+        uint64_t muxSizetick;
+    };
+    // ウィンドウごとに、m_peakFramesの末尾のフレームcount個の合計sizeを保持する
+    struct PeakWindow {
+        double window;
+        size_t count;
+        uint64_t sizesum;
+        double peakKbps;
+        double peakStart;
+    };
+    void emit(int64_t dts, const PendingFrame& frame);
+    void writeRow(IntervalBin& bin, double framesec);
+    void updatePeak(double framesec, int size);
+
+    std::vector<IntervalBin> m_bins;
+    CheckBitrateLog *m_log;
+    AVRational m_timebase;
+    AVRational m_avgFrameRate;
+    int m_maxLookahead;
+    bool m_flushEachRow;
+    bool m_frameType;
+    bool m_muxBytes;
+    int m_outputFormat;
+    bool m_binaryFrames;
+    CheckBitrateBinaryInfo m_binaryInfo;
+    CheckBitrateBinaryFrames m_binaryFrameData;
+
+    // timestampの補正
+    bool m_timestampFound;      // 有効なtimestampが見つかったか
+    bool m_useFrameRate;        // 有効なtimestampがまだないため、avgFrameRateからtimestampを計算する
+    int64_t m_ptsOffset;
+    int64_t m_prevWrapTs;
+    std::deque<PendingFrame> m_pending; // timestampの確定していないフレーム
+    int64_t m_prevts;           // 最後に出力したフレームのtimestamp
+    std::deque<int64_t> m_history; // 外挿に使用する、直近に出力したフレームのtimestamp
+    int64_t m_frameCount;       // avgFrameRateから計算する場合のフレーム番号
+    bool m_resumeCheck;         // resumeRepair()の後、最初の有効なtimestampでPCR Wrapの補正量を確認する
+
+    // 出力
+    bool m_started;
+    int64_t m_firstts;
+    double m_framesec;
+    uint64_t m_sizesum;
+
+    // スライディングウィンドウ
+    std::vector<PeakWindow> m_peakWindows;
+    std::deque<std::pair<double, int>> m_peakFrames; // 最も長いウィンドウに含まれるフレームの(時刻, size)
+
+    bool m_recordFrames;
+    std::vector<VBVFrame> m_frames; // 補正後のフレーム
+
+    BitrateSummary m_summary;
+
+    CheckBitrateMuxWriter *m_muxWriter;
+    int m_muxTrack;
+
+    FrameCacheTrack *m_cacheTrack;
+};
+
+// 複数のトラックのビットレートを、共通の時刻で区切った固定長の区間ごとに1つのcsvに出力する
+// - 各トラックのCheckBitrateWriterから、補正後のtimestamp(秒)とサイズを受け取る
+// - トラック間でtimestampの順序が前後するため、受け取った最新の時刻より
+//   MUX_REORDER_SEC以上前に終わる区間が確定したものとして出力する
+//   それより前の時刻のフレームが来た場合は、まだ出力していない最初の区間に含める
+class CheckBitrateMuxWriter {
+public:
+    static const int MUX_REORDER_SEC = 10;
+
+    CheckBitrateMuxWriter();
+    ~CheckBitrateMuxWriter();
+
+    // startSecが負の場合は、最初に受け取ったフレームの時刻を0とする
+    int open(const tstring& filename, double interval, const std::vector<tstring>& trackNames, double startSec, bool flushEachRow, CheckBitrateLog& log);
+    void add(int track, double sec, int size);
+    int finish();
+private:
+    void writeRow();
+
+    CheckBitrateCsvWriter m_csv;
+    CheckBitrateLog *m_log;
+    double m_interval;
+    size_t m_trackCount;
+    double m_startSec;
+    bool m_flushEachRow;
+    bool m_started;
+    int64_t m_firstBin; // m_bins.front()の区間番号
+    double m_maxSec;
+    std::deque<std::vector<uint64_t>> m_bins; // 区間ごとの各トラックのサイズ
+};
+
+#endif //__CHECK_BITRATE_WRITER_H__
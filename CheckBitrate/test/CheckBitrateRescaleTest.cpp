@@ -0,0 +1,81 @@
+﻿// -----------------------------------------------------------------------------------------
+// CheckBitrate by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2016 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include "CheckBitrateRescale.h"
+#pragma warning (push)
+#pragma warning (disable: 4244)
+#pragma warning (disable: 4819)
+extern "C" {
+#include <libavutil/mathematics.h>
+}
+#pragma warning (pop)
+
+// RescaleStepが、置き換え前のav_rescale_rnd(AV_ROUND_NEAR_INF)と完全に一致することを確認する
+// - 補間: AV_NOPTS_VALUEがn個続く場合、前後のtimestampの差をc = n + 1 で分割し、j = 1 ... n を求める
+// - 外挿: 直近の最大30フレームの差をc = 1 ... 30 で分割し、j = 1, 2, ... を保持しているフレーム数まで求める
+int main() {
+    const std::vector<int64_t> deltas = {
+        0, 1, -1, 2, -2, 1001, -1001, 3003, -3003, 3600, -3600, 90000, -90000, 1234567, -1234567,
+        (1LL << 32) - 1, -((1LL << 32) - 1), (1LL << 33), -(1LL << 33), (1LL << 40) + 12345, -((1LL << 40) + 12345),
+    };
+    std::vector<int64_t> counts;
+    //補間: NOPTSの連続するフレーム数 1, 2, 30, 31, 600, 601, 1000
+    for (const int nopts : { 1, 2, 30, 31, 600, 601, 1000 }) {
+        counts.push_back(nopts + 1);
+    }
+    //外挿: 使用するフレーム数 1 ... 30
+    for (int c = 1; c <= 30; c++) {
+        counts.push_back(c);
+    }
+    const int64_t maxSteps = 1200; // 外挿ではcを超えて求める
+
+    int64_t tested = 0, failed = 0;
+    for (const auto a : deltas) {
+        for (const auto c : counts) {
+            RescaleStep step(a, c);
+            for (int64_t j = 1; j <= maxSteps; j++) {
+                const int64_t expected = av_rescale_rnd(a, j, c, AV_ROUND_NEAR_INF);
+                const int64_t actual = step.next();
+                tested++;
+                if (actual != expected) {
+                    if (failed < 20) {
+                        fprintf(stderr, "mismatch: a=%lld, j=%lld, c=%lld: %lld (expected %lld)\n",
+                            (long long)a, (long long)j, (long long)c, (long long)actual, (long long)expected);
+                    }
+                    failed++;
+                }
+            }
+        }
+    }
+    fprintf(stderr, "RescaleStep: %lld tested, %lld failed.\n", (long long)tested, (long long)failed);
+    return (failed > 0) ? 1 : 0;
+}